@@ -1,25 +1,26 @@
 #include "gml.h"
+#include "kernel.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <math.h>
 #include <unistd.h>
 
 static gml_value_t gml_builtin_print_impl(gml_state_t *gml, gml_value_t *args, size_t nargs, int nl) {
-    char buffer[4096];
-    char *data;
+    char        buffer[4096];
+    const char *data;
     for (size_t i = 0; i < nargs; i++) {
         switch (gml_value_typeof(gml, args[i])) {
             case GML_TYPE_STRING:
-                data = gml_string_utf8data(gml, args[i]);
-                snprintf(buffer, sizeof(buffer), "%s", data);
-                free(data);
+                data = gml_string_utf8(gml, args[i]);
                 break;
             default:
                 gml_dump(gml, args[i], buffer, sizeof(buffer));
+                data = buffer;
                 break;
         }
-        printf("%s%s", buffer, (i < nargs - 1) ? " " : "");
+        printf("%s%s", data, (i < nargs - 1) ? " " : "");
     }
     if (nl)
         printf("\n");
@@ -49,6 +50,8 @@ static gml_value_t gml_builtin_length(gml_state_t *gml, gml_value_t *args, size_
             return gml_number_create(gml, (double)gml_string_length(gml, args[0]));
         case GML_TYPE_ARRAY:
             return gml_number_create(gml, (double)gml_array_length(gml, args[0]));
+        case GML_TYPE_BUFFER:
+            return gml_number_create(gml, (double)gml_buffer_length(gml, args[0]));
         case GML_TYPE_TABLE:
             keys  = gml_table_keys(gml, args[0]);
             value = gml_number_create(gml, list_length(keys));
@@ -60,172 +63,318 @@ static gml_value_t gml_builtin_length(gml_state_t *gml, gml_value_t *args, size_
     return gml_nil_create(gml);
 }
 
+/*
+ * Math functions apply to a number, or to every number of an array or a
+ * buffer in one go, giving a new array or buffer. Functions of two numbers
+ * take two arrays or buffers of the same length or pair one with a number.
+ * Arrays of anything but numbers and lengths differing are errors.
+ */
+static void gml_builtin_numbers(gml_state_t *gml, gml_value_t *args, size_t nargs, const char *name) {
+    for (size_t i = 0; i < nargs; i++) {
+        if (gml_value_typeof(gml, args[i]) != GML_TYPE_ARRAY)
+            continue;
+        for (size_t j = 0; j < gml_array_length(gml, args[i]); j++) {
+            gml_type_t type = gml_value_typeof(gml, gml_array_get(gml, args[i], j));
+            if (type != GML_TYPE_NUMBER) {
+                gml_throw(false, "incompatible type `%s' at index `%zu' of argument `%zu' of `%s', expected type `number'",
+                    gml_typename(gml, type),
+                    j,
+                    i + 1,
+                    name
+                );
+                gml_abort(gml);
+            }
+        }
+    }
+}
+
+/* A number of an argument, whose arrays gml_builtin_numbers has checked */
+static double gml_builtin_element(gml_state_t *gml, gml_value_t value, size_t index) {
+    switch (gml_value_typeof(gml, value)) {
+        case GML_TYPE_BUFFER:
+            return gml_buffer_get(gml, value, index);
+        case GML_TYPE_ARRAY:
+            return gml_number_value(gml, gml_array_get(gml, value, index));
+        default:
+            return gml_number_value(gml, value);
+    }
+}
+
+/* The number of elements of an array or buffer, -1 for anything else */
+static size_t gml_builtin_elements(gml_state_t *gml, gml_value_t value) {
+    switch (gml_value_typeof(gml, value)) {
+        case GML_TYPE_ARRAY:  return gml_array_length(gml, value);
+        case GML_TYPE_BUFFER: return gml_buffer_length(gml, value);
+        default:
+            return (size_t)-1;
+    }
+}
+
+static const kernel_t *gml_builtin_kernel(gml_state_t *gml, gml_value_t buffer) {
+    return kernel_get(gml_buffer_kind(gml, buffer) == GML_BUFFER_F32 ? KERNEL_F32 : KERNEL_F64);
+}
+
+static gml_value_t gml_builtin_math_array(gml_state_t *gml, gml_value_t *args, size_t nargs, size_t length, const char *name,
+                                          double (*op1)(double), double (*op2)(double, double))
+{
+    gml_value_t *results;
+    gml_value_t  value;
+    double       x;
+    gml_builtin_numbers(gml, args, nargs, name);
+    if (!(results = malloc(sizeof(gml_value_t) * (length ? length : 1))))
+        return gml_nil_create(gml);
+    for (size_t i = 0; i < length; i++) {
+        x = gml_builtin_element(gml, args[0], i);
+        results[i] = gml_number_create(gml, nargs == 2 ? op2(x, gml_builtin_element(gml, args[1], i)) : op1(x));
+    }
+    value = gml_array_create(gml, results, length);
+    free(results);
+    return value;
+}
+
+static gml_value_t gml_builtin_math_buffer(gml_state_t *gml, gml_value_t buffer, double (*op)(double), kernel_unary_t unary) {
+    gml_buffer_kind_t kind   = gml_buffer_kind(gml, buffer);
+    size_t            length = gml_buffer_length(gml, buffer);
+    gml_value_t       result = gml_buffer_create(gml, kind, length);
+    if (gml_value_typeof(gml, result) != GML_TYPE_BUFFER)
+        return result;
+    if (unary != KERNEL_UNARIES) {
+        gml_builtin_kernel(gml, buffer)->unary[unary](gml_buffer_data(gml, result), gml_buffer_data(gml, buffer), length);
+    } else if (kind == GML_BUFFER_F32) {
+        float       *r = gml_buffer_data(gml, result);
+        const float *x = gml_buffer_data(gml, buffer);
+        for (size_t i = 0; i < length; i++)
+            r[i] = (float)op(x[i]);
+    } else {
+        double       *r = gml_buffer_data(gml, result);
+        const double *x = gml_buffer_data(gml, buffer);
+        for (size_t i = 0; i < length; i++)
+            r[i] = op(x[i]);
+    }
+    return result;
+}
+
+/* unary is the kernel doing op over a buffer, KERNEL_UNARIES for none */
+static gml_value_t gml_builtin_math1(gml_state_t *gml, gml_value_t *args, size_t nargs, const char *name,
+                                     double (*op)(double), kernel_unary_t unary)
+{
+    if (nargs == 1) {
+        switch (gml_value_typeof(gml, args[0])) {
+            case GML_TYPE_NUMBER:
+                return gml_number_create(gml, op(gml_number_value(gml, args[0])));
+            case GML_TYPE_ARRAY:
+                return gml_builtin_math_array(gml, args, nargs, gml_array_length(gml, args[0]), name, op, NULL);
+            case GML_TYPE_BUFFER:
+                return gml_builtin_math_buffer(gml, args[0], op, unary);
+            default:
+                break;
+        }
+    }
+    gml_arg_check(gml, args, nargs, name, "n");
+    return gml_number_create(gml, op(gml_number_value(gml, args[0])));
+}
+
+static gml_value_t gml_builtin_math2(gml_state_t *gml, gml_value_t *args, size_t nargs, const char *name,
+                                     double (*op)(double, double))
+{
+    gml_value_t shape;
+    gml_value_t result;
+    size_t      length;
+    if (nargs == 2 && gml_value_typeof(gml, args[0]) == GML_TYPE_NUMBER && gml_value_typeof(gml, args[1]) == GML_TYPE_NUMBER)
+        return gml_number_create(gml, op(gml_number_value(gml, args[0]), gml_number_value(gml, args[1])));
+    if (nargs == 2 && (gml_builtin_elements(gml, args[0]) != (size_t)-1 || gml_builtin_elements(gml, args[1]) != (size_t)-1)) {
+        /* The result takes after the first argument which isn't a number */
+        shape  = gml_builtin_elements(gml, args[0]) != (size_t)-1 ? args[0] : args[1];
+        length = gml_builtin_elements(gml, shape);
+        for (size_t i = 0; i < nargs; i++) {
+            if (gml_value_typeof(gml, args[i]) == GML_TYPE_NUMBER || gml_builtin_elements(gml, args[i]) == length)
+                continue;
+            if (gml_builtin_elements(gml, args[i]) == (size_t)-1)
+                gml_throw(false, "incompatible type `%s' in passing argument `%zu' of `%s', expected type `number'",
+                    gml_typename(gml, gml_value_typeof(gml, args[i])),
+                    i + 1,
+                    name
+                );
+            else
+                gml_throw(false, "incompatible length `%zu' of argument `%zu' of `%s', expected length `%zu'",
+                    gml_builtin_elements(gml, args[i]),
+                    i + 1,
+                    name,
+                    length
+                );
+            gml_abort(gml);
+        }
+        if (gml_value_typeof(gml, shape) == GML_TYPE_ARRAY)
+            return gml_builtin_math_array(gml, args, nargs, length, name, NULL, op);
+        gml_builtin_numbers(gml, args, nargs, name);
+        result = gml_buffer_create(gml, gml_buffer_kind(gml, shape), length);
+        if (gml_value_typeof(gml, result) != GML_TYPE_BUFFER)
+            return result;
+        for (size_t i = 0; i < length; i++)
+            gml_buffer_set(gml, result, i, op(gml_builtin_element(gml, args[0], i), gml_builtin_element(gml, args[1], i)));
+        return result;
+    }
+    gml_arg_check(gml, args, nargs, name, "nn");
+    return gml_number_create(gml, op(gml_number_value(gml, args[0]), gml_number_value(gml, args[1])));
+}
+
+static double gml_builtin_ilogb_op(double x) {
+    return ilogb(x);
+}
+
+static double gml_builtin_ldexp_op(double x, double e) {
+    return ldexp(x, (int)e);
+}
+
+static double gml_builtin_scalbn_op(double x, double e) {
+    return scalbn(x, (int)e);
+}
+
 /* math */
 static gml_value_t gml_builtin_cos(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "cos", "n");
-    return gml_number_create(gml, cos(gml_number_value(gml, args[0])));
+    return gml_builtin_math1(gml, args, nargs, "cos", &cos, KERNEL_UNARIES);
 }
 
 static gml_value_t gml_builtin_sin(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "sin", "n");
-    return gml_number_create(gml, sin(gml_number_value(gml, args[0])));
+    return gml_builtin_math1(gml, args, nargs, "sin", &sin, KERNEL_UNARIES);
 }
 
 static gml_value_t gml_builtin_tan(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "tan", "n");
-    return gml_number_create(gml, tan(gml_number_value(gml, args[0])));
+    return gml_builtin_math1(gml, args, nargs, "tan", &tan, KERNEL_UNARIES);
 }
 
 static gml_value_t gml_builtin_acos(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "acos", "n");
-    return gml_number_create(gml, acos(gml_number_value(gml, args[0])));
+    return gml_builtin_math1(gml, args, nargs, "acos", &acos, KERNEL_UNARIES);
 }
 
 static gml_value_t gml_builtin_asin(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "asin", "n");
-    return gml_number_create(gml, asin(gml_number_value(gml, args[0])));
+    return gml_builtin_math1(gml, args, nargs, "asin", &asin, KERNEL_UNARIES);
 }
 
 static gml_value_t gml_builtin_atan(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "atan", "n");
-    return gml_number_create(gml, atan(gml_number_value(gml, args[0])));
+    return gml_builtin_math1(gml, args, nargs, "atan", &atan, KERNEL_UNARIES);
 }
 
 static gml_value_t gml_builtin_atan2(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "atan2", "nn");
-    return gml_number_create(gml, atan2(gml_number_value(gml, args[0]), gml_number_value(gml, args[1])));
+    return gml_builtin_math2(gml, args, nargs, "atan2", &atan2);
 }
 
 static gml_value_t gml_builtin_cosh(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "cosh", "n");
-    return gml_number_create(gml, cosh(gml_number_value(gml, args[0])));
+    return gml_builtin_math1(gml, args, nargs, "cosh", &cosh, KERNEL_UNARIES);
 }
 
 static gml_value_t gml_builtin_sinh(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "sinh", "n");
-    return gml_number_create(gml, sinh(gml_number_value(gml, args[0])));
+    return gml_builtin_math1(gml, args, nargs, "sinh", &sinh, KERNEL_UNARIES);
 }
 
 static gml_value_t gml_builtin_tanh(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "tanh", "n");
-    return gml_number_create(gml, tanh(gml_number_value(gml, args[0])));
+    return gml_builtin_math1(gml, args, nargs, "tanh", &tanh, KERNEL_UNARIES);
 }
 
 static gml_value_t gml_builtin_acosh(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "acosh", "n");
-    return gml_number_create(gml, acosh(gml_number_value(gml, args[0])));
+    return gml_builtin_math1(gml, args, nargs, "acosh", &acosh, KERNEL_UNARIES);
 }
 
 static gml_value_t gml_builtin_asinh(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "sinh", "n");
-    return gml_number_create(gml, asinh(gml_number_value(gml, args[0])));
+    return gml_builtin_math1(gml, args, nargs, "asinh", &asinh, KERNEL_UNARIES);
 }
 
 static gml_value_t gml_builtin_atanh(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "tanh", "n");
-    return gml_number_create(gml, atanh(gml_number_value(gml, args[0])));
+    return gml_builtin_math1(gml, args, nargs, "atanh", &atanh, KERNEL_UNARIES);
 }
 
 static gml_value_t gml_builtin_exp(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "exp", "n");
-    return gml_number_create(gml, exp(gml_number_value(gml, args[0])));
+    return gml_builtin_math1(gml, args, nargs, "exp", &exp, KERNEL_UNARIES);
 }
 
 static gml_value_t gml_builtin_exp2(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "exp2", "n");
-    return gml_number_create(gml, exp2(gml_number_value(gml, args[0])));
+    return gml_builtin_math1(gml, args, nargs, "exp2", &exp2, KERNEL_UNARIES);
 }
 
 static gml_value_t gml_builtin_expm1(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "expm1", "n");
-    return gml_number_create(gml, expm1(gml_number_value(gml, args[0])));
+    return gml_builtin_math1(gml, args, nargs, "expm1", &expm1, KERNEL_UNARIES);
 }
 
 static gml_value_t gml_builtin_ldexp(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "ldexp", "nn");
-    return gml_number_create(gml, ldexp(gml_number_value(gml, args[0]), (int)gml_number_value(gml, args[1])));
+    return gml_builtin_math2(gml, args, nargs, "ldexp", &gml_builtin_ldexp_op);
 }
 
 static gml_value_t gml_builtin_log(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "log", "n");
-    return gml_number_create(gml, log(gml_number_value(gml, args[0])));
+    return gml_builtin_math1(gml, args, nargs, "log", &log, KERNEL_UNARIES);
 }
 
 static gml_value_t gml_builtin_log2(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "log2", "n");
-    return gml_number_create(gml, log2(gml_number_value(gml, args[0])));
+    return gml_builtin_math1(gml, args, nargs, "log2", &log2, KERNEL_UNARIES);
 }
 
 static gml_value_t gml_builtin_log10(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "log10", "n");
-    return gml_number_create(gml, log10(gml_number_value(gml, args[0])));
+    return gml_builtin_math1(gml, args, nargs, "log10", &log10, KERNEL_UNARIES);
 }
 
 static gml_value_t gml_builtin_ilogb(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "ilogb", "n");
-    return gml_number_create(gml, ilogb(gml_number_value(gml, args[0])));
+    return gml_builtin_math1(gml, args, nargs, "ilogb", &gml_builtin_ilogb_op, KERNEL_UNARIES);
 }
 
 static gml_value_t gml_builtin_log1p(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "log1p", "n");
-    return gml_number_create(gml, log1p(gml_number_value(gml, args[0])));
+    return gml_builtin_math1(gml, args, nargs, "log1p", &log1p, KERNEL_UNARIES);
 }
 
 static gml_value_t gml_builtin_logb(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "logb", "n");
-    return gml_number_create(gml, logb(gml_number_value(gml, args[0])));
+    return gml_builtin_math1(gml, args, nargs, "logb", &logb, KERNEL_UNARIES);
 }
 
 static gml_value_t gml_builtin_scalbn(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "scalbn", "nn");
-    return gml_number_create(gml, scalbn(gml_number_value(gml, args[0]), (int)gml_number_value(gml, args[1])));
+    return gml_builtin_math2(gml, args, nargs, "scalbn", &gml_builtin_scalbn_op);
 }
 
 static gml_value_t gml_builtin_pow(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "pow", "nn");
-    return gml_number_create(gml, pow(gml_number_value(gml, args[0]), gml_number_value(gml, args[1])));
+    return gml_builtin_math2(gml, args, nargs, "pow", &pow);
 }
 
 static gml_value_t gml_builtin_sqrt(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "sqrt", "n");
-    return gml_number_create(gml, sqrt(gml_number_value(gml, args[0])));
+    return gml_builtin_math1(gml, args, nargs, "sqrt", &sqrt, KERNEL_SQRT);
 }
 
 static gml_value_t gml_builtin_cbrt(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "cbrt", "n");
-    return gml_number_create(gml, cbrt(gml_number_value(gml, args[0])));
+    return gml_builtin_math1(gml, args, nargs, "cbrt", &cbrt, KERNEL_UNARIES);
 }
 
 static gml_value_t gml_builtin_hypot(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "hypot", "nn");
-    return gml_number_create(gml, hypot(gml_number_value(gml, args[0]), gml_number_value(gml, args[1])));
+    return gml_builtin_math2(gml, args, nargs, "hypot", &hypot);
 }
 
 static gml_value_t gml_builtin_floor(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "floor", "n");
-    return gml_number_create(gml, floor(gml_number_value(gml, args[0])));
+    return gml_builtin_math1(gml, args, nargs, "floor", &floor, KERNEL_FLOOR);
 }
 
 static gml_value_t gml_builtin_ceil(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "ceil", "n");
-    return gml_number_create(gml, ceil(gml_number_value(gml, args[0])));
+    return gml_builtin_math1(gml, args, nargs, "ceil", &ceil, KERNEL_CEIL);
 }
 
 static gml_value_t gml_builtin_map(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "map", "fa");
+    (void)nargs;
     size_t       length  = gml_array_length(gml, args[1]);
+    size_t       first   = 0;
     gml_value_t *applied = malloc(sizeof(gml_value_t) * length);
     if (!applied)
         return gml_nil_create(gml);
     for (size_t i = 0; i < length; i++) {
         gml_value_t current = gml_array_get(gml, args[1], i);
-        applied[i] = gml_function_run(gml, args[0], &current, 1);
+        size_t      handle  = gml_handle_push(gml, gml_function_run(gml, args[0], &current, 1));
+        if (i == 0)
+            first = handle;
     }
-    return gml_array_create(gml, applied, length);
+    /* The results may have moved while running later ones */
+    for (size_t i = 0; i < length; i++)
+        applied[i] = gml_handle_get(gml, first + i);
+    gml_value_t value = gml_array_create(gml, applied, length);
+    gml_handle_pop(gml, length);
+    free(applied);
+    return value;
 }
 
 static gml_value_t gml_builtin_range(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "range", "nn");
+    (void)nargs;
     int    beg = (int)gml_number_value(gml, args[0]);
     int    end = (int)gml_number_value(gml, args[1]);
     int    cur = beg;
@@ -249,95 +398,726 @@ static gml_value_t gml_builtin_range(gml_state_t *gml, gml_value_t *args, size_t
 }
 
 static gml_value_t gml_builtin_filter(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "filter", "fa");
+    (void)nargs;
     size_t       length  = gml_array_length(gml, args[1]);
     size_t       matched = 0;
+    size_t       first   = 0;
     gml_value_t *applied = malloc(sizeof(gml_value_t) * length);
     if (!applied)
         return gml_nil_create(gml);
     for (size_t i = 0; i < length; i++) {
         gml_value_t current = gml_array_get(gml, args[1], i);
         gml_value_t eval    = gml_function_run(gml, args[0], &current, 1);
-        if (gml_istrue(gml, eval))
-            applied[matched++] = current;
+        if (gml_istrue(gml, eval)) {
+            size_t handle = gml_handle_push(gml, gml_array_get(gml, args[1], i));
+            if (matched++ == 0)
+                first = handle;
+        }
     }
+    for (size_t i = 0; i < matched; i++)
+        applied[i] = gml_handle_get(gml, first + i);
     gml_value_t value = gml_array_create(gml, applied, matched);
+    gml_handle_pop(gml, matched);
     free(applied);
     return value;
 }
 
 static gml_value_t gml_builtin_reduce(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "reduce", "fa");
+    (void)nargs;
     size_t      length  = gml_array_length(gml, args[1]);
     gml_value_t result  = gml_array_get(gml, args[1], 0);
     gml_value_t pass[2];
+    size_t      handle;
 
     if (length < 2)
         return gml_nil_create(gml);
 
+    /* The accumulator may move while running the function */
+    handle = gml_handle_push(gml, result);
     for (size_t i = 1; i < length; i++) {
-        pass[0] = result;
+        pass[0] = gml_handle_get(gml, handle);
         pass[1] = gml_array_get(gml, args[1], i);
         result  = gml_function_run(gml, args[0], pass, 2);
+        gml_handle_pop(gml, 1);
+        handle  = gml_handle_push(gml, result);
     }
+    gml_handle_pop(gml, 1);
     return result;
 }
 
-static int gml_builtin_find_array_equal(gml_state_t *gml, gml_value_t x, gml_value_t y, size_t start) {
-    size_t length = gml_array_length(gml, y);
-    for (size_t i = 0; i < length; i++) {
-        if (!gml_equal(gml, gml_array_get(gml, x, start++), gml_array_get(gml, y, i)))
-            return 0;
-    }
-    return 1;
+/* The runes of a string from start, as many as length or as there are */
+static gml_value_t gml_builtin_substring(gml_state_t *gml, gml_value_t *args, size_t nargs) {
+    (void)nargs;
+    size_t length = gml_string_length(gml, args[0]);
+    double start  = gml_number_value(gml, args[1]);
+    double count  = gml_number_value(gml, args[2]);
+    if (!(start >= 0))
+        start = 0;
+    if (start > length)
+        start = length;
+    if (!(count >= 0))
+        count = 0;
+    if (count > length - (size_t)start)
+        count = length - (size_t)start;
+    return gml_string_substring(gml, args[0], (size_t)start, (size_t)count);
 }
 
-static size_t gml_builtin_find_array_index(gml_state_t *gml, gml_value_t x, gml_value_t y) {
-    size_t max = 1 + gml_array_length(gml, x) - gml_array_length(gml, y);
-    for (size_t i = 0 ; i < max ; i++) {
-        if (gml_builtin_find_array_equal(gml, x, y, i))
-            return i;
-    }
-    return (size_t)-1;
+/* Arrays grow in place and yield themselves, or nil when out of memory */
+static gml_value_t gml_builtin_push(gml_state_t *gml, gml_value_t *args, size_t nargs) {
+    if (nargs != 2 || gml_value_typeof(gml, args[0]) != GML_TYPE_ARRAY)
+        return gml_nil_create(gml);
+    if (!gml_array_push(gml, args[0], args[1]))
+        return gml_nil_create(gml);
+    return args[0];
 }
 
-static gml_value_t gml_builtin_find(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    if (nargs != 2)
+static gml_value_t gml_builtin_pop(gml_state_t *gml, gml_value_t *args, size_t nargs) {
+    (void)nargs;
+    return gml_array_pop(gml, args[0]);
+}
+
+static gml_value_t gml_builtin_insert(gml_state_t *gml, gml_value_t *args, size_t nargs) {
+    if (nargs != 3 || gml_value_typeof(gml, args[0]) != GML_TYPE_ARRAY || gml_value_typeof(gml, args[1]) != GML_TYPE_NUMBER)
+        return gml_nil_create(gml);
+    double index = gml_number_value(gml, args[1]);
+    if (!(index >= 0 && index <= gml_array_length(gml, args[0])))
+        return gml_nil_create(gml);
+    if (!gml_array_insert(gml, args[0], (size_t)index, args[2]))
         return gml_nil_create(gml);
+    return args[0];
+}
 
-    gml_type_t a = gml_value_typeof(gml, args[0]);
-    gml_type_t b = gml_value_typeof(gml, args[1]);
+static gml_value_t gml_builtin_remove(gml_state_t *gml, gml_value_t *args, size_t nargs) {
+    (void)nargs;
+    double index = gml_number_value(gml, args[1]);
+    if (!(index >= 0 && index < gml_array_length(gml, args[0])))
+        return gml_nil_create(gml);
+    return gml_array_remove(gml, args[0], (size_t)index);
+}
 
-    if (a != b)
+static gml_value_t gml_builtin_reserve(gml_state_t *gml, gml_value_t *args, size_t nargs) {
+    (void)nargs;
+    double capacity = gml_number_value(gml, args[1]);
+    /* Also rejects NaN */
+    if (!(capacity <= SIZE_MAX / sizeof(gml_value_t)))
+        return gml_nil_create(gml);
+    if (capacity > 0 && !gml_array_reserve(gml, args[0], (size_t)capacity))
         return gml_nil_create(gml);
+    return args[0];
+}
 
-    char  *stra;
-    char  *strb;
-    char  *strf;
-    size_t find;
-    switch (a) {
-        case GML_TYPE_STRING:
-            stra = gml_string_utf8data(gml, args[0]);
-            strb = gml_string_utf8data(gml, args[1]);
-            strf = strstr(stra, strb);
-            free(stra);
-            free(strb);
-            if (strf) {
-                size_t index = strf - stra;
-                return gml_number_create(gml, index);
-            }
-            break;
+/* The elements of an array from start, as many as length or as there are */
+static gml_value_t gml_builtin_slice(gml_state_t *gml, gml_value_t *args, size_t nargs) {
+    (void)nargs;
+    size_t length = gml_array_length(gml, args[0]);
+    double start  = gml_number_value(gml, args[1]);
+    double count  = gml_number_value(gml, args[2]);
+    if (!(start >= 0))
+        start = 0;
+    if (start > length)
+        start = length;
+    if (!(count >= 0))
+        count = 0;
+    if (count > length - (size_t)start)
+        count = length - (size_t)start;
+    return gml_array_slice(gml, args[0], (size_t)start, (size_t)count);
+}
+
+/* buffers */
+static const char *gml_builtin_kindname(gml_buffer_kind_t kind) {
+    return kind == GML_BUFFER_F32 ? "f32" : "f64";
+}
 
+/* Buffers must be of the same kind and length as the first one */
+static void gml_builtin_conform(gml_state_t *gml, gml_value_t *args, size_t nargs, const char *name) {
+    for (size_t i = 1; i < nargs; i++) {
+        if (gml_buffer_kind(gml, args[i]) != gml_buffer_kind(gml, args[0])
+         || gml_buffer_length(gml, args[i]) != gml_buffer_length(gml, args[0])) {
+            gml_throw(false, "incompatible buffer `%s[%zu]' in passing argument `%zu' of `%s', expected `%s[%zu]' like argument `1'",
+                gml_builtin_kindname(gml_buffer_kind(gml, args[i])),
+                gml_buffer_length(gml, args[i]),
+                i + 1,
+                name,
+                gml_builtin_kindname(gml_buffer_kind(gml, args[0])),
+                gml_buffer_length(gml, args[0])
+            );
+            gml_abort(gml);
+        }
+    }
+}
+
+/* A buffer of length zeroes, or of the numbers of an array or buffer */
+static gml_value_t gml_builtin_buffer(gml_state_t *gml, gml_value_t value, gml_buffer_kind_t kind) {
+    gml_value_t buffer;
+    size_t      length;
+    double      number;
+    switch (gml_value_typeof(gml, value)) {
+        case GML_TYPE_NUMBER:
+            number = gml_number_value(gml, value);
+            /* Sizes past what a size_t holds can't be allocated anyway */
+            if (!(number >= 0 && number < (double)SIZE_MAX))
+                break;
+            return gml_buffer_create(gml, kind, (size_t)number);
         case GML_TYPE_ARRAY:
-            find = gml_builtin_find_array_index(gml, args[0], args[1]);
-            if (find != (size_t)-1)
-                return gml_number_create(gml, find);
+            length = gml_array_length(gml, value);
+            for (size_t i = 0; i < length; i++)
+                if (gml_value_typeof(gml, gml_array_get(gml, value, i)) != GML_TYPE_NUMBER)
+                    return gml_nil_create(gml);
+            buffer = gml_buffer_create(gml, kind, length);
+            if (gml_value_typeof(gml, buffer) != GML_TYPE_BUFFER)
+                break;
+            for (size_t i = 0; i < length; i++)
+                gml_buffer_set(gml, buffer, i, gml_number_value(gml, gml_array_get(gml, value, i)));
+            return buffer;
+        case GML_TYPE_BUFFER:
+            length = gml_buffer_length(gml, value);
+            buffer = gml_buffer_create(gml, kind, length);
+            if (gml_value_typeof(gml, buffer) != GML_TYPE_BUFFER)
+                break;
+            for (size_t i = 0; i < length; i++)
+                gml_buffer_set(gml, buffer, i, gml_buffer_get(gml, value, i));
+            return buffer;
         default:
             break;
     }
     return gml_nil_create(gml);
 }
 
+static gml_value_t gml_builtin_f64(gml_state_t *gml, gml_value_t *args, size_t nargs) {
+    if (nargs != 1)
+        return gml_nil_create(gml);
+    return gml_builtin_buffer(gml, args[0], GML_BUFFER_F64);
+}
+
+static gml_value_t gml_builtin_f32(gml_state_t *gml, gml_value_t *args, size_t nargs) {
+    if (nargs != 1)
+        return gml_nil_create(gml);
+    return gml_builtin_buffer(gml, args[0], GML_BUFFER_F32);
+}
+
+static gml_value_t gml_builtin_add(gml_state_t *gml, gml_value_t *args, size_t nargs) {
+    gml_builtin_conform(gml, args, nargs, "add");
+    size_t      length = gml_buffer_length(gml, args[0]);
+    gml_value_t result = gml_buffer_create(gml, gml_buffer_kind(gml, args[0]), length);
+    if (gml_value_typeof(gml, result) == GML_TYPE_BUFFER)
+        gml_builtin_kernel(gml, args[0])->add(gml_buffer_data(gml, result),
+            gml_buffer_data(gml, args[0]), gml_buffer_data(gml, args[1]), length);
+    return result;
+}
+
+static gml_value_t gml_builtin_mul(gml_state_t *gml, gml_value_t *args, size_t nargs) {
+    gml_builtin_conform(gml, args, nargs, "mul");
+    size_t      length = gml_buffer_length(gml, args[0]);
+    gml_value_t result = gml_buffer_create(gml, gml_buffer_kind(gml, args[0]), length);
+    if (gml_value_typeof(gml, result) == GML_TYPE_BUFFER)
+        gml_builtin_kernel(gml, args[0])->mul(gml_buffer_data(gml, result),
+            gml_buffer_data(gml, args[0]), gml_buffer_data(gml, args[1]), length);
+    return result;
+}
+
+/* a * b + c elementwise */
+static gml_value_t gml_builtin_fma(gml_state_t *gml, gml_value_t *args, size_t nargs) {
+    gml_builtin_conform(gml, args, nargs, "fma");
+    size_t      length = gml_buffer_length(gml, args[0]);
+    gml_value_t result = gml_buffer_create(gml, gml_buffer_kind(gml, args[0]), length);
+    if (gml_value_typeof(gml, result) == GML_TYPE_BUFFER)
+        gml_builtin_kernel(gml, args[0])->fma(gml_buffer_data(gml, result),
+            gml_buffer_data(gml, args[0]), gml_buffer_data(gml, args[1]),
+            gml_buffer_data(gml, args[2]), length);
+    return result;
+}
+
+static gml_value_t gml_builtin_dot(gml_state_t *gml, gml_value_t *args, size_t nargs) {
+    gml_builtin_conform(gml, args, nargs, "dot");
+    return gml_number_create(gml, gml_builtin_kernel(gml, args[0])->dot(
+        gml_buffer_data(gml, args[0]), gml_buffer_data(gml, args[1]), gml_buffer_length(gml, args[0])));
+}
+
+static gml_value_t gml_builtin_sum(gml_state_t *gml, gml_value_t *args, size_t nargs) {
+    (void)nargs;
+    return gml_number_create(gml, gml_builtin_kernel(gml, args[0])->sum(
+        gml_buffer_data(gml, args[0]), gml_buffer_length(gml, args[0])));
+}
+
+static gml_value_t gml_builtin_min(gml_state_t *gml, gml_value_t *args, size_t nargs) {
+    (void)nargs;
+    if (gml_buffer_length(gml, args[0]) == 0)
+        return gml_nil_create(gml);
+    return gml_number_create(gml, gml_builtin_kernel(gml, args[0])->min(
+        gml_buffer_data(gml, args[0]), gml_buffer_length(gml, args[0])));
+}
+
+static gml_value_t gml_builtin_max(gml_state_t *gml, gml_value_t *args, size_t nargs) {
+    (void)nargs;
+    if (gml_buffer_length(gml, args[0]) == 0)
+        return gml_nil_create(gml);
+    return gml_number_create(gml, gml_builtin_kernel(gml, args[0])->max(
+        gml_buffer_data(gml, args[0]), gml_buffer_length(gml, args[0])));
+}
+
+/*
+ * Sorting. Arrays of nothing but numbers or nothing but strings sort
+ * without a comparator, numbers by a radix sort of their bits and strings
+ * by their bytes, which for UTF-8 is the order of their runes. Anything
+ * else needs a comparator telling whether its first argument goes before
+ * its second. Everything but numbers sorts with an introsort over a
+ * context which knows how to compare and swap two elements.
+ */
+#define GML_SORT_INSERTION 16
+
+typedef struct {
+    int  (*less)(void *context, size_t i, size_t j);
+    void (*swap)(void *context, size_t i, size_t j);
+    void  *context;
+} gml_sort_t;
+
+static void gml_sort_insertion(gml_sort_t *sort, size_t lo, size_t hi) {
+    for (size_t i = lo + 1; i < hi; i++)
+        for (size_t j = i; j > lo && sort->less(sort->context, j, j - 1); j--)
+            sort->swap(sort->context, j, j - 1);
+}
+
+static void gml_sort_sift(gml_sort_t *sort, size_t lo, size_t root, size_t length) {
+    for (size_t child; (child = 2 * root + 1) < length; root = child) {
+        if (child + 1 < length && sort->less(sort->context, lo + child, lo + child + 1))
+            child++;
+        if (!sort->less(sort->context, lo + root, lo + child))
+            return;
+        sort->swap(sort->context, lo + root, lo + child);
+    }
+}
+
+static void gml_sort_heap(gml_sort_t *sort, size_t lo, size_t hi) {
+    size_t length = hi - lo;
+    for (size_t i = length / 2; i-- > 0; )
+        gml_sort_sift(sort, lo, i, length);
+    for (size_t i = length; i-- > 1; ) {
+        sort->swap(sort->context, lo, lo + i);
+        gml_sort_sift(sort, lo, 0, i);
+    }
+}
+
+static void gml_sort_intro(gml_sort_t *sort, size_t lo, size_t hi, size_t depth) {
+    while (hi - lo > GML_SORT_INSERTION) {
+        if (depth-- == 0) {
+            gml_sort_heap(sort, lo, hi);
+            return;
+        }
+        /* The median of the first, middle and last element goes to lo as the pivot */
+        size_t mid = lo + (hi - lo) / 2;
+        size_t end = hi - 1;
+        if (sort->less(sort->context, mid, lo))
+            sort->swap(sort->context, mid, lo);
+        if (sort->less(sort->context, end, mid)) {
+            sort->swap(sort->context, end, mid);
+            if (sort->less(sort->context, mid, lo))
+                sort->swap(sort->context, mid, lo);
+        }
+        sort->swap(sort->context, lo, mid);
+
+        size_t i = lo + 1;
+        size_t j = hi - 1;
+        for (;;) {
+            while (i <= j && sort->less(sort->context, i, lo))
+                i++;
+            while (i <= j && sort->less(sort->context, lo, j))
+                j--;
+            if (i >= j)
+                break;
+            sort->swap(sort->context, i++, j--);
+        }
+        sort->swap(sort->context, lo, j);
+
+        /* Recurse into the smaller side to bound the stack */
+        if (j - lo < hi - j - 1) {
+            gml_sort_intro(sort, lo, j, depth);
+            lo = j + 1;
+        } else {
+            gml_sort_intro(sort, j + 1, hi, depth);
+            hi = j;
+        }
+    }
+    gml_sort_insertion(sort, lo, hi);
+}
+
+static void gml_sort_run(gml_sort_t *sort, size_t length) {
+    size_t depth = 0;
+    for (size_t n = length; n > 1; n >>= 1)
+        depth += 2;
+    gml_sort_intro(sort, 0, length, depth);
+}
+
+/* Doubles as integers which order the same way, negative numbers flipped */
+static inline uint64_t gml_sort_key(double number) {
+    union { double f64; uint64_t u64; } bits = { .f64 = number };
+    return bits.u64 & 0x8000000000000000ull ? ~bits.u64 : bits.u64 | 0x8000000000000000ull;
+}
+
+static inline double gml_sort_number(uint64_t key) {
+    union { double f64; uint64_t u64; } bits;
+    bits.u64 = key & 0x8000000000000000ull ? key & ~0x8000000000000000ull : ~key;
+    return bits.f64;
+}
+
+/* A least significant digit radix sort, a byte at a time */
+static int gml_sort_numbers(uint64_t *keys, size_t length) {
+    uint64_t *scratch = malloc(sizeof(uint64_t) * length);
+    uint64_t *from    = keys;
+    uint64_t *to      = scratch;
+    size_t    counts[256];
+    if (!scratch)
+        return 0;
+    for (size_t shift = 0; shift < 64; shift += 8) {
+        memset(counts, 0, sizeof(counts));
+        for (size_t i = 0; i < length; i++)
+            counts[(from[i] >> shift) & 0xFF]++;
+        /* Skip bytes every key has the same of */
+        if (counts[(from[0] >> shift) & 0xFF] == length)
+            continue;
+        for (size_t i = 0, total = 0; i < 256; i++) {
+            size_t count = counts[i];
+            counts[i] = total;
+            total    += count;
+        }
+        for (size_t i = 0; i < length; i++)
+            to[counts[(from[i] >> shift) & 0xFF]++] = from[i];
+        uint64_t *swap = from;
+        from = to;
+        to   = swap;
+    }
+    if (from != keys)
+        memcpy(keys, from, sizeof(uint64_t) * length);
+    free(scratch);
+    return 1;
+}
+
+typedef struct {
+    gml_value_t value;
+    const char *data;
+    size_t      size;
+} gml_sort_string_t;
+
+static int gml_sort_string_less(void *context, size_t i, size_t j) {
+    gml_sort_string_t *strings = context;
+    size_t             size    = strings[i].size < strings[j].size ? strings[i].size : strings[j].size;
+    int                order   = memcmp(strings[i].data, strings[j].data, size);
+    return order < 0 || (order == 0 && strings[i].size < strings[j].size);
+}
+
+static void gml_sort_string_swap(void *context, size_t i, size_t j) {
+    gml_sort_string_t *strings = context;
+    gml_sort_string_t  swap    = strings[i];
+    strings[i] = strings[j];
+    strings[j] = swap;
+}
+
+/*
+ * Running the comparator may collect and move both the array and the
+ * comparator, so they're kept in handles and every element is fetched
+ * anew for every comparison.
+ */
+typedef struct {
+    gml_state_t *gml;
+    size_t       handle;  /* the array then the comparator */
+    size_t       length;
+} gml_sort_call_t;
+
+static int gml_sort_call_less(void *context, size_t i, size_t j) {
+    gml_sort_call_t *call  = context;
+    gml_state_t     *gml   = call->gml;
+    gml_value_t      array = gml_handle_get(gml, call->handle);
+    gml_value_t      args[2];
+    /* A comparator which shrank the array leaves the rest of it unsorted */
+    if (gml_array_length(gml, array) < call->length)
+        return 0;
+    args[0] = gml_array_get(gml, array, i);
+    args[1] = gml_array_get(gml, array, j);
+    return !gml_isfalse(gml, gml_function_run(gml, gml_handle_get(gml, call->handle + 1), args, 2));
+}
+
+static void gml_sort_call_swap(void *context, size_t i, size_t j) {
+    gml_sort_call_t *call  = context;
+    gml_state_t     *gml   = call->gml;
+    gml_value_t      array = gml_handle_get(gml, call->handle);
+    if (gml_array_length(gml, array) < call->length)
+        return;
+    gml_value_t swap = gml_array_get(gml, array, i);
+    gml_array_set(gml, array, i, gml_array_get(gml, array, j));
+    gml_array_set(gml, array, j, swap);
+}
+
+static gml_value_t gml_builtin_sort_numbers(gml_state_t *gml, gml_value_t array, size_t length) {
+    uint64_t *keys = malloc(sizeof(uint64_t) * length);
+    if (!keys)
+        return gml_nil_create(gml);
+    for (size_t i = 0; i < length; i++)
+        keys[i] = gml_sort_key(gml_number_value(gml, gml_array_get(gml, array, i)));
+    if (!gml_sort_numbers(keys, length)) {
+        free(keys);
+        return gml_nil_create(gml);
+    }
+    for (size_t i = 0; i < length; i++)
+        gml_array_set(gml, array, i, gml_number_create(gml, gml_sort_number(keys[i])));
+    free(keys);
+    return array;
+}
+
+static gml_value_t gml_builtin_sort_strings(gml_state_t *gml, gml_value_t array, size_t length) {
+    gml_sort_string_t *strings = malloc(sizeof(gml_sort_string_t) * length);
+    if (!strings)
+        return gml_nil_create(gml);
+    for (size_t i = 0; i < length; i++) {
+        strings[i].value = gml_array_get(gml, array, i);
+        strings[i].data  = gml_string_utf8(gml, strings[i].value);
+        strings[i].size  = gml_string_utf8length(gml, strings[i].value);
+    }
+    gml_sort_t sort = { &gml_sort_string_less, &gml_sort_string_swap, strings };
+    gml_sort_run(&sort, length);
+    for (size_t i = 0; i < length; i++)
+        gml_array_set(gml, array, i, strings[i].value);
+    free(strings);
+    return array;
+}
+
+/* Sorts an array in place, yielding it, or nil for what can't be sorted */
+static gml_value_t gml_builtin_sort(gml_state_t *gml, gml_value_t *args, size_t nargs) {
+    if (nargs < 1 || gml_value_typeof(gml, args[0]) != GML_TYPE_ARRAY)
+        return gml_nil_create(gml);
+
+    size_t length = gml_array_length(gml, args[0]);
+    if (nargs == 2) {
+        gml_type_t type = gml_value_typeof(gml, args[1]);
+        if (type != GML_TYPE_FUNCTION && type != GML_TYPE_NATIVE)
+            return gml_nil_create(gml);
+        gml_sort_call_t call = { gml, gml_handle_push(gml, args[0]), length };
+        gml_handle_push(gml, args[1]);
+        gml_sort_t sort = { &gml_sort_call_less, &gml_sort_call_swap, &call };
+        gml_sort_run(&sort, length);
+        gml_value_t array = gml_handle_get(gml, call.handle);
+        gml_handle_pop(gml, 2);
+        return array;
+    }
+
+    if (length < 2)
+        return args[0];
+    gml_type_t type = gml_value_typeof(gml, gml_array_get(gml, args[0], 0));
+    for (size_t i = 1; i < length; i++)
+        if (gml_value_typeof(gml, gml_array_get(gml, args[0], i)) != type)
+            return gml_nil_create(gml);
+    switch (type) {
+        case GML_TYPE_NUMBER: return gml_builtin_sort_numbers(gml, args[0], length);
+        case GML_TYPE_STRING: return gml_builtin_sort_strings(gml, args[0], length);
+        default:
+            return gml_nil_create(gml);
+    }
+}
+
+/*
+ * Searching. Strings are searched in their UTF-8 data for the first byte
+ * of the needle with memchr, which the C library vectorizes, comparing
+ * the rest only where that matches. Matches are counted in runes as they
+ * are found. Arrays are searched with Knuth-Morris-Pratt so no element is
+ * compared more than twice. Matches don't overlap.
+ */
+typedef struct {
+    gml_state_t *gml;
+    gml_type_t   type;
+    gml_value_t  haystack;
+    gml_value_t  needle;
+    const char  *data;     /* strings */
+    size_t       size;
+    const char  *pattern;
+    size_t       psize;
+    size_t       plength;  /* runes or elements of the needle */
+    int          ascii;
+    size_t       byte;
+    size_t      *fail;     /* arrays */
+    size_t       length;
+    size_t       matched;
+    size_t       index;    /* where the search goes on from, in runes or elements */
+} gml_find_t;
+
+static const char *gml_find_bytes(const char *data, size_t size, const char *pattern, size_t psize) {
+    if (psize == 0)
+        return data;
+    if (psize > size)
+        return NULL;
+    const char *end = data + size - psize + 1;
+    const char *at;
+    while ((at = memchr(data, (unsigned char)pattern[0], end - data))) {
+        if (!memcmp(at + 1, pattern + 1, psize - 1))
+            return at;
+        data = at + 1;
+    }
+    return NULL;
+}
+
+static size_t gml_find_runes(const char *data, size_t size) {
+    size_t runes = 0;
+    for (size_t i = 0; i < size; i++)
+        runes += ((unsigned char)data[i] & 0xC0) != 0x80;
+    return runes;
+}
+
+static inline int gml_find_equal(gml_state_t *gml, gml_value_t x, gml_value_t y) {
+    if (gml_value_typeof(gml, x) == GML_TYPE_NUMBER && gml_value_typeof(gml, y) == GML_TYPE_NUMBER)
+        return gml_number_value(gml, x) == gml_number_value(gml, y);
+    return gml_equal(gml, x, y);
+}
+
+/* Whether the haystack and needle are strings or arrays both */
+static int gml_find_init(gml_find_t *find, gml_state_t *gml, gml_value_t *args, size_t nargs) {
+    memset(find, 0, sizeof(*find));
+    if (nargs != 2 || gml_value_typeof(gml, args[0]) != gml_value_typeof(gml, args[1]))
+        return 0;
+    find->gml      = gml;
+    find->type     = gml_value_typeof(gml, args[0]);
+    find->haystack = args[0];
+    find->needle   = args[1];
+    switch (find->type) {
+        case GML_TYPE_STRING:
+            find->data    = gml_string_utf8(gml, args[0]);
+            find->size    = gml_string_utf8length(gml, args[0]);
+            find->pattern = gml_string_utf8(gml, args[1]);
+            find->psize   = gml_string_utf8length(gml, args[1]);
+            find->plength = gml_string_length(gml, args[1]);
+            find->ascii   = gml_string_length(gml, args[0]) == find->size;
+            return 1;
+        case GML_TYPE_ARRAY:
+            find->length  = gml_array_length(gml, args[0]);
+            find->plength = gml_array_length(gml, args[1]);
+            if (!find->plength)
+                return 1;
+            if (!(find->fail = malloc(sizeof(size_t) * find->plength)))
+                return 0;
+            /* fail[q] is the longest proper prefix of needle[0..q] which is also a suffix of it */
+            find->fail[0] = 0;
+            for (size_t q = 1, k = 0; q < find->plength; q++) {
+                gml_value_t element = gml_array_get(gml, args[1], q);
+                while (k > 0 && !gml_find_equal(gml, element, gml_array_get(gml, args[1], k)))
+                    k = find->fail[k - 1];
+                if (gml_find_equal(gml, element, gml_array_get(gml, args[1], k)))
+                    k++;
+                find->fail[q] = k;
+            }
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+static int gml_find_next_string(gml_find_t *find, size_t *index) {
+    if (find->byte > find->size)
+        return 0;
+    const char *at = gml_find_bytes(find->data + find->byte, find->size - find->byte, find->pattern, find->psize);
+    if (!at)
+        return 0;
+    size_t skip = at - (find->data + find->byte);
+    find->index += find->ascii ? skip : gml_find_runes(find->data + find->byte, skip);
+    find->byte  += skip;
+    *index = find->index;
+    if (find->psize) {
+        find->byte  += find->psize;
+        find->index += find->plength;
+    } else {
+        /* An empty needle is found at every rune and past the last one */
+        do {
+            find->byte++;
+        } while (find->byte < find->size && ((unsigned char)find->data[find->byte] & 0xC0) == 0x80);
+        find->index++;
+    }
+    return 1;
+}
+
+static int gml_find_next_array(gml_find_t *find, size_t *index) {
+    gml_state_t *gml = find->gml;
+    if (!find->plength) {
+        if (find->index > find->length)
+            return 0;
+        *index = find->index++;
+        return 1;
+    }
+    while (find->index < find->length) {
+        gml_value_t element = gml_array_get(gml, find->haystack, find->index++);
+        while (find->matched > 0 && !gml_find_equal(gml, element, gml_array_get(gml, find->needle, find->matched)))
+            find->matched = find->fail[find->matched - 1];
+        if (gml_find_equal(gml, element, gml_array_get(gml, find->needle, find->matched)))
+            find->matched++;
+        if (find->matched == find->plength) {
+            find->matched = 0;
+            *index = find->index - find->plength;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int gml_find_next(gml_find_t *find, size_t *index) {
+    return find->type == GML_TYPE_STRING
+        ? gml_find_next_string(find, index)
+        : gml_find_next_array(find, index);
+}
+
+static void gml_find_done(gml_find_t *find) {
+    free(find->fail);
+}
+
+/* The index of the first match, in runes for strings */
+static gml_value_t gml_builtin_find(gml_state_t *gml, gml_value_t *args, size_t nargs) {
+    gml_find_t find;
+    size_t     index;
+    if (!gml_find_init(&find, gml, args, nargs))
+        return gml_nil_create(gml);
+    gml_value_t value = gml_find_next(&find, &index)
+        ? gml_number_create(gml, index)
+        : gml_nil_create(gml);
+    gml_find_done(&find);
+    return value;
+}
+
+static gml_value_t gml_builtin_find_all(gml_state_t *gml, gml_value_t *args, size_t nargs) {
+    gml_find_t   find;
+    size_t       index;
+    size_t       count    = 0;
+    size_t       capacity = 8;
+    gml_value_t *indices;
+    if (!gml_find_init(&find, gml, args, nargs))
+        return gml_nil_create(gml);
+    if (!(indices = malloc(sizeof(gml_value_t) * capacity))) {
+        gml_find_done(&find);
+        return gml_nil_create(gml);
+    }
+    while (gml_find_next(&find, &index)) {
+        if (count == capacity) {
+            gml_value_t *resize = realloc(indices, sizeof(gml_value_t) * capacity * 2);
+            if (!resize) {
+                free(indices);
+                gml_find_done(&find);
+                return gml_nil_create(gml);
+            }
+            indices   = resize;
+            capacity *= 2;
+        }
+        indices[count++] = gml_number_create(gml, index);
+    }
+    gml_find_done(&find);
+    gml_value_t value = gml_array_create(gml, indices, count);
+    free(indices);
+    return value;
+}
+
+static gml_value_t gml_builtin_count(gml_state_t *gml, gml_value_t *args, size_t nargs) {
+    gml_find_t find;
+    size_t     index;
+    size_t     count = 0;
+    if (!gml_find_init(&find, gml, args, nargs))
+        return gml_nil_create(gml);
+    while (gml_find_next(&find, &index))
+        count++;
+    gml_find_done(&find);
+    return gml_number_create(gml, count);
+}
+
 void gml_builtins_install(gml_state_t *gml) {
     /* IO */
     gml_set_native(gml, "print",    &gml_builtin_print,    0, -1);
@@ -376,11 +1156,34 @@ void gml_builtins_install(gml_state_t *gml) {
     gml_set_native(gml, "ceil",     &gml_builtin_ceil,     1,  1);
 
     /* Map filter reduce */
-    gml_set_native(gml, "map",      &gml_builtin_map,      2,  2);
-    gml_set_native(gml, "range",    &gml_builtin_range,    2,  2);
-    gml_set_native(gml, "filter",   &gml_builtin_filter,   2,  2);
-    gml_set_native(gml, "reduce",   &gml_builtin_reduce,   2,  2);
+    gml_set_native_contract(gml, "map",       &gml_builtin_map,        "fa");
+    gml_set_native_contract(gml, "range",     &gml_builtin_range,      "nn");
+    gml_set_native_contract(gml, "filter",    &gml_builtin_filter,     "fa");
+    gml_set_native_contract(gml, "reduce",    &gml_builtin_reduce,     "fa");
 
     gml_set_native(gml, "length",   &gml_builtin_length,   1,  1);
     gml_set_native(gml, "find",     &gml_builtin_find,     2,  2);
+    gml_set_native(gml, "find_all", &gml_builtin_find_all, 2,  2);
+    gml_set_native(gml, "count",    &gml_builtin_count,    2,  2);
+    gml_set_native_contract(gml, "substring", &gml_builtin_substring,  "snn");
+
+    /* Arrays */
+    gml_set_native(gml, "push",     &gml_builtin_push,     2,  2);
+    gml_set_native_contract(gml, "pop",       &gml_builtin_pop,        "a");
+    gml_set_native(gml, "insert",   &gml_builtin_insert,   3,  3);
+    gml_set_native_contract(gml, "remove",    &gml_builtin_remove,     "an");
+    gml_set_native_contract(gml, "reserve",   &gml_builtin_reserve,    "an");
+    gml_set_native_contract(gml, "slice",     &gml_builtin_slice,      "ann");
+    gml_set_native(gml, "sort",     &gml_builtin_sort,     1,  2);
+
+    /* Buffers */
+    gml_set_native(gml, "f64",      &gml_builtin_f64,      1,  1);
+    gml_set_native(gml, "f32",      &gml_builtin_f32,      1,  1);
+    gml_set_native_contract(gml, "add",       &gml_builtin_add,        "bb");
+    gml_set_native_contract(gml, "mul",       &gml_builtin_mul,        "bb");
+    gml_set_native_contract(gml, "fma",       &gml_builtin_fma,        "bbb");
+    gml_set_native_contract(gml, "dot",       &gml_builtin_dot,        "bb");
+    gml_set_native_contract(gml, "sum",       &gml_builtin_sum,        "b");
+    gml_set_native_contract(gml, "min",       &gml_builtin_min,        "b");
+    gml_set_native_contract(gml, "max",       &gml_builtin_max,        "b");
 }
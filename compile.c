@@ -0,0 +1,932 @@
+#include "compile.h"
+#include <stdlib.h>
+#include <string.h>
+
+void gml_error(gml_position_t *position, const char *format, ...);
+
+/*
+ * A scope is opened for every function being compiled. The variables of a
+ * scope are the slots of its chunk.
+ */
+typedef struct compile_scope_s compile_scope_t;
+
+struct compile_scope_s {
+    compile_scope_t *outer;
+    chunk_t         *chunk;
+};
+
+typedef struct {
+    chunk_t          *root;
+    chunk_t          *chunk;
+    size_t            depth;
+    compile_scope_t  *scope;
+    const char      **globals;  /* names assigned at the top level */
+    size_t            nglobals;
+    int             (*global)(void *data, const char *name);
+    void             *data;
+    jmp_buf           escape;
+} compile_t;
+
+/* Chunks */
+static chunk_t *chunk_create(const char *name, list_t *formals) {
+    chunk_t *chunk = malloc(sizeof(*chunk));
+    if (!chunk)
+        return NULL;
+
+    chunk->name         = name;
+    chunk->formals      = formals;
+    chunk->nformals     = list_length(formals);
+    chunk->slots        = NULL;
+    chunk->nslots       = 0;
+    chunk->upvalues     = NULL;
+    chunk->nupvalues    = 0;
+    chunk->code         = NULL;
+    chunk->positions    = NULL;
+    chunk->length       = 0;
+    chunk->capacity     = 0;
+    chunk->constants    = NULL;
+    chunk->nconstants   = 0;
+    chunk->maxconstants = 0;
+    chunk->caches       = NULL;
+    chunk->ncaches      = 0;
+    chunk->maxcaches    = 0;
+    chunk->maxstack     = 0;
+    return chunk;
+}
+
+void chunk_destroy(chunk_t *chunk) {
+    if (!chunk)
+        return;
+    for (size_t i = 0; i < chunk->nconstants; i++)
+        if (chunk->constants[i].class == CONSTANT_CHUNK)
+            chunk_destroy(chunk->constants[i].chunk);
+        else if (chunk->constants[i].class == CONSTANT_ARRAY)
+            free(chunk->constants[i].array.items);
+    free(chunk->constants);
+    free(chunk->caches);
+    free(chunk->slots);
+    free(chunk->upvalues);
+    free(chunk->positions);
+    free(chunk->code);
+    free(chunk);
+}
+
+const char *compile_opname(opcode_t op) {
+    switch (op) {
+        case OP_NIL:        return "nil";
+        case OP_NUMBER:     return "number";
+        case OP_STRING:     return "string";
+        case OP_ATOM:       return "atom";
+        case OP_POP:        return "pop";
+        case OP_NIP:        return "nip";
+        case OP_GETLOCAL:   return "getlocal";
+        case OP_SETLOCAL:   return "setlocal";
+        case OP_BINDLOCAL:  return "bindlocal";
+        case OP_GETUPVAL:   return "getupval";
+        case OP_SETUPVAL:   return "setupval";
+        case OP_GETGLOBAL:  return "getglobal";
+        case OP_SETGLOBAL:  return "setglobal";
+        case OP_BINDGLOBAL: return "bindglobal";
+        case OP_ARRAY:      return "array";
+        case OP_LITERAL:    return "literal";
+        case OP_TABLE:      return "table";
+        case OP_SUBSCRIPT:  return "subscript";
+        case OP_SETINDEX:   return "setindex";
+        case OP_GETFIELD:   return "getfield";
+        case OP_SETFIELD:   return "setfield";
+        case OP_ADD:        return "add";
+        case OP_SUB:        return "sub";
+        case OP_MUL:        return "mul";
+        case OP_DIV:        return "div";
+        case OP_MOD:        return "mod";
+        case OP_BITAND:     return "bitand";
+        case OP_BITOR:      return "bitor";
+        case OP_BITXOR:     return "bitxor";
+        case OP_SHL:        return "shl";
+        case OP_SHR:        return "shr";
+        case OP_LT:         return "lt";
+        case OP_GT:         return "gt";
+        case OP_LE:         return "le";
+        case OP_GE:         return "ge";
+        case OP_EQ:         return "eq";
+        case OP_NE:         return "ne";
+        case OP_IS:         return "is";
+        case OP_AND:        return "and";
+        case OP_OR:         return "or";
+        case OP_NOT:        return "not";
+        case OP_NEGATE:     return "negate";
+        case OP_BITNOT:     return "bitnot";
+        case OP_CALL:       return "call";
+        case OP_METHOD:     return "method";
+        case OP_INVOKE:     return "invoke";
+        case OP_TAILCALL:   return "tailcall";
+        case OP_TAILINVOKE: return "tailinvoke";
+        case OP_CLOSURE:    return "closure";
+        case OP_JUMP:       return "jump";
+        case OP_JUMPFALSE:  return "jumpfalse";
+        case OP_FORPREP:    return "forprep";
+        case OP_FORLOOP:    return "forloop";
+        case OP_FORBIND:    return "forbind";
+        case OP_FORSTEP:    return "forstep";
+        case OP_RETURN:     return "return";
+    }
+    return "unknown";
+}
+
+/* The net effect an instruction has on the depth of the operand stack */
+static int compile_effect(opcode_t op, size_t arg) {
+    switch (op) {
+        case OP_NIL:
+        case OP_NUMBER:
+        case OP_STRING:
+        case OP_ATOM:
+        case OP_LITERAL:
+        case OP_GETLOCAL:
+        case OP_GETUPVAL:
+        case OP_GETGLOBAL:
+        case OP_CLOSURE:
+        case OP_FORBIND:
+        case OP_METHOD:
+            return 1;
+        case OP_ARRAY:
+            return 1 - (int)arg;
+        case OP_TABLE:
+            return 1 - 2 * (int)arg;
+        case OP_CALL:
+        case OP_TAILCALL:
+            return -(int)arg;
+        case OP_INVOKE:
+        case OP_TAILINVOKE:
+            return -(int)arg - 1;
+        case OP_SETINDEX:
+            return -2;
+        case OP_FORPREP:
+            return 2;
+        case OP_SETLOCAL:
+        case OP_BINDLOCAL:
+        case OP_SETUPVAL:
+        case OP_SETGLOBAL:
+        case OP_BINDGLOBAL:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_BITNOT:
+        case OP_GETFIELD:
+        case OP_JUMP:
+        case OP_FORLOOP:
+            return 0;
+        default:
+            /* binary operations, pops and stores consume one value */
+            return -1;
+    }
+}
+
+/* Emitters */
+static void compile_grow(compile_t *compile) {
+    chunk_t *chunk = compile->chunk;
+    if (chunk->length < chunk->capacity)
+        return;
+
+    size_t          capacity  = chunk->capacity ? chunk->capacity * 2 : 64;
+    code_t         *code      = realloc(chunk->code, sizeof(code_t) * capacity);
+    gml_position_t *positions = code ? realloc(chunk->positions, sizeof(gml_position_t) * capacity) : NULL;
+    if (code)
+        chunk->code = code;
+    if (!positions)
+        longjmp(compile->escape, 1);
+    chunk->positions = positions;
+    chunk->capacity  = capacity;
+}
+
+static size_t compile_word(compile_t *compile, gml_position_t *position, code_t word) {
+    chunk_t *chunk = compile->chunk;
+    compile_grow(compile);
+    chunk->code[chunk->length]      = word;
+    chunk->positions[chunk->length] = *position;
+    return chunk->length++;
+}
+
+static size_t compile_emit(compile_t *compile, gml_position_t *position, opcode_t op, size_t arg) {
+    if (arg > CODE_ARG_MAX) {
+        gml_error(position, "Function is too large to compile.");
+        longjmp(compile->escape, 1);
+    }
+    compile->depth += compile_effect(op, arg);
+    if (compile->depth > compile->chunk->maxstack)
+        compile->chunk->maxstack = compile->depth;
+    return compile_word(compile, position, CODE_MAKE(op, arg));
+}
+
+static size_t compile_label(compile_t *compile) {
+    return compile->chunk->length;
+}
+
+static void compile_patch(compile_t *compile, size_t at, size_t target) {
+    code_t *word = &compile->chunk->code[at];
+    *word = CODE_MAKE(CODE_OP(*word), target);
+}
+
+/* Constants */
+static size_t compile_constant(compile_t *compile, constant_t constant) {
+    chunk_t *chunk = compile->chunk;
+
+    /* Reuse existing constants where possible */
+    for (size_t i = 0; i < chunk->nconstants; i++) {
+        constant_t *find = &chunk->constants[i];
+        if (find->class != constant.class)
+            continue;
+        if (constant.class == CONSTANT_NUMBER && !memcmp(&find->number, &constant.number, sizeof(double)))
+            return i;
+        if ((constant.class == CONSTANT_STRING || constant.class == CONSTANT_ATOM) && !strcmp(find->string, constant.string))
+            return i;
+    }
+
+    if (chunk->nconstants == chunk->maxconstants) {
+        size_t      size      = chunk->maxconstants ? chunk->maxconstants * 2 : 16;
+        constant_t *constants = realloc(chunk->constants, sizeof(constant_t) * size);
+        if (!constants)
+            longjmp(compile->escape, 1);
+        chunk->constants    = constants;
+        chunk->maxconstants = size;
+    }
+    chunk->constants[chunk->nconstants] = constant;
+    return chunk->nconstants++;
+}
+
+/* Every field access gets a cache of its own */
+static size_t compile_cache(compile_t *compile, const char *name) {
+    chunk_t *chunk = compile->chunk;
+    if (chunk->ncaches == chunk->maxcaches) {
+        size_t   size   = chunk->maxcaches ? chunk->maxcaches * 2 : 16;
+        cache_t *caches = realloc(chunk->caches, sizeof(cache_t) * size);
+        if (!caches)
+            longjmp(compile->escape, 1);
+        chunk->caches    = caches;
+        chunk->maxcaches = size;
+    }
+    chunk->caches[chunk->ncaches] = (cache_t) { .name = name };
+    return chunk->ncaches++;
+}
+
+static size_t compile_number(compile_t *compile, double number) {
+    return compile_constant(compile, (constant_t) { .class = CONSTANT_NUMBER, .number = number });
+}
+
+static size_t compile_string(compile_t *compile, const char *string) {
+    return compile_constant(compile, (constant_t) { .class = CONSTANT_STRING, .string = string });
+}
+
+static size_t compile_atom(compile_t *compile, const char *atom) {
+    return compile_constant(compile, (constant_t) { .class = CONSTANT_ATOM, .string = atom });
+}
+
+/*
+ * An array literal of nothing but number, string and atom literals is a
+ * constant of its own which the runtime copies rather than building the
+ * array one element at a time. Yields whether the array was one.
+ */
+static int compile_literal(compile_t *compile, ast_t *ast) {
+    size_t           length = list_length(ast->array);
+    size_t          *items;
+    size_t           index;
+    list_iterator_t *it;
+
+    if (length == 0)
+        return 0;
+    it = list_iterator_create(ast->array);
+    while (!list_iterator_end(it)) {
+        ast_t *item = list_iterator_next(it);
+        if (item->class != AST_NUMBER && item->class != AST_STRING && item->class != AST_ATOM) {
+            list_iterator_destroy(it);
+            return 0;
+        }
+    }
+    list_iterator_destroy(it);
+
+    /* Reserve the array's constant first so it's freed should the items fail */
+    index = compile_constant(compile, (constant_t) { .class = CONSTANT_ARRAY });
+    if (!(items = malloc(sizeof(size_t) * length)))
+        longjmp(compile->escape, 1);
+    compile->chunk->constants[index].array.items = items;
+
+    it = list_iterator_create(ast->array);
+    for (size_t i = 0; !list_iterator_end(it); i++) {
+        ast_t *item = list_iterator_next(it);
+        if (item->class == AST_NUMBER)
+            items[i] = compile_number(compile, item->number);
+        else if (item->class == AST_STRING)
+            items[i] = compile_string(compile, item->string);
+        else
+            items[i] = compile_atom(compile, item->atom);
+    }
+    list_iterator_destroy(it);
+    compile->chunk->constants[index].array.nitems = length;
+    compile_emit(compile, &ast->position, OP_LITERAL, index);
+    return 1;
+}
+
+/*
+ * Resolution of variables. Before the body of a function is compiled it's
+ * scanned for the variables it introduces so every reference can be given
+ * a lexical address. Nested function bodies are not scanned, they get their
+ * own scope when they are compiled.
+ */
+static int compile_names_find(const char **names, size_t length, const char *name, size_t *index) {
+    for (size_t i = 0; i < length; i++) {
+        if (!strcmp(names[i], name)) {
+            if (index)
+                *index = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void compile_names_add(compile_t *compile, const char ***names, size_t *length, const char *name) {
+    if (compile_names_find(*names, *length, name, NULL))
+        return;
+    const char **grow = realloc(*names, sizeof(const char *) * (*length + 1));
+    if (!grow)
+        longjmp(compile->escape, 1);
+    grow[(*length)++] = name;
+    *names = grow;
+}
+
+static int compile_isglobal(compile_t *compile, const char *name) {
+    if (compile_names_find(compile->globals, compile->nglobals, name, NULL))
+        return 1;
+    return compile->global && compile->global(compile->data, name);
+}
+
+/* Whether a name is a variable of the current or an enclosing function */
+static int compile_isvariable(compile_t *compile, const char *name) {
+    for (compile_scope_t *scope = compile->scope; scope; scope = scope->outer)
+        if (compile_names_find(scope->chunk->slots, scope->chunk->nslots, name, NULL))
+            return 1;
+    return 0;
+}
+
+static size_t compile_upvalue_add(compile_t *compile, chunk_t *chunk, const char *name, size_t index, int local) {
+    for (size_t i = 0; i < chunk->nupvalues; i++)
+        if (chunk->upvalues[i].index == index && chunk->upvalues[i].local == local)
+            return i;
+    upvalue_t *grow = realloc(chunk->upvalues, sizeof(upvalue_t) * (chunk->nupvalues + 1));
+    if (!grow)
+        longjmp(compile->escape, 1);
+    grow[chunk->nupvalues] = (upvalue_t) { .name = name, .index = index, .local = local };
+    chunk->upvalues = grow;
+    return chunk->nupvalues++;
+}
+
+/*
+ * Capture a variable of an enclosing function, threading it through the
+ * upvalues of every function in between.
+ */
+static int compile_upvalue(compile_t *compile, compile_scope_t *scope, const char *name, size_t *index) {
+    compile_scope_t *outer = scope->outer;
+    size_t           found;
+    if (!outer)
+        return 0;
+    if (compile_names_find(outer->chunk->slots, outer->chunk->nslots, name, &found)) {
+        *index = compile_upvalue_add(compile, scope->chunk, name, found, 1);
+        return 1;
+    }
+    if (compile_upvalue(compile, outer, name, &found)) {
+        *index = compile_upvalue_add(compile, scope->chunk, name, found, 0);
+        return 1;
+    }
+    return 0;
+}
+
+typedef enum {
+    COMPILE_LOCAL,
+    COMPILE_UPVALUE,
+    COMPILE_GLOBAL
+} compile_class_t;
+
+static compile_class_t compile_resolve(compile_t *compile, const char *name, size_t *index) {
+    if (!compile->scope)
+        return COMPILE_GLOBAL;
+    if (compile_names_find(compile->scope->chunk->slots, compile->scope->chunk->nslots, name, index))
+        return COMPILE_LOCAL;
+    if (compile_upvalue(compile, compile->scope, name, index))
+        return COMPILE_UPVALUE;
+    return COMPILE_GLOBAL;
+}
+
+/*
+ * Declarations with `var' and `fn' and the formals of a for loop always
+ * introduce a variable in the current scope. Assignment only does when the
+ * name doesn't refer to a variable of an enclosing scope or a global.
+ */
+static void compile_declare(compile_t *compile, const char *name, int assign) {
+    if (!compile->scope) {
+        compile_names_add(compile, &compile->globals, &compile->nglobals, name);
+        return;
+    }
+    if (assign && (compile_isvariable(compile, name) || compile_isglobal(compile, name)))
+        return;
+    chunk_t *chunk = compile->scope->chunk;
+    compile_names_add(compile, &chunk->slots, &chunk->nslots, name);
+}
+
+static void compile_scan(compile_t *compile, ast_t *ast);
+
+static void compile_scan_list(compile_t *compile, list_t *list) {
+    list_iterator_t *it = list_iterator_create(list);
+    while (!list_iterator_end(it))
+        compile_scan(compile, list_iterator_next(it));
+    list_iterator_destroy(it);
+}
+
+static void compile_scan(compile_t *compile, ast_t *ast) {
+    list_iterator_t *it;
+    switch (ast->class) {
+        case AST_TOPLEVEL:
+            compile_scan_list(compile, ast->toplevel);
+            break;
+        case AST_ARRAY:
+            compile_scan_list(compile, ast->array);
+            break;
+        case AST_TABLE:
+            it = list_iterator_create(ast->table);
+            while (!list_iterator_end(it)) {
+                ast_t *entry = list_iterator_next(it);
+                compile_scan(compile, entry->dictentry.key);
+                compile_scan(compile, entry->dictentry.expr);
+            }
+            list_iterator_destroy(it);
+            break;
+        case AST_BINARY:
+            if (ast->binary.op == LEX_TOKEN_ASSIGN && ast->binary.left->class == AST_IDENT)
+                compile_declare(compile, ast->binary.left->ident, 1);
+            else
+                compile_scan(compile, ast->binary.left);
+            compile_scan(compile, ast->binary.right);
+            break;
+        case AST_UNARY:
+            compile_scan(compile, ast->unary.expr);
+            break;
+        case AST_SUBSCRIPT:
+            compile_scan(compile, ast->subscript.expr);
+            compile_scan(compile, ast->subscript.key);
+            break;
+        case AST_CALL:
+            compile_scan(compile, ast->call.callee);
+            compile_scan_list(compile, ast->call.args);
+            break;
+        case AST_DECLFUN:
+            compile_declare(compile, ast->fundecl.name, 0);
+            break;
+        case AST_DECLVAR:
+            compile_declare(compile, ast->vardecl.name, 0);
+            if (ast->vardecl.initializer)
+                compile_scan(compile, ast->vardecl.initializer);
+            break;
+        case AST_IF:
+            it = list_iterator_create(ast->ifstmt);
+            while (!list_iterator_end(it)) {
+                ast_t *clause = list_iterator_next(it);
+                if (clause->ifclause.condition)
+                    compile_scan(compile, clause->ifclause.condition);
+                compile_scan_list(compile, clause->ifclause.body);
+            }
+            list_iterator_destroy(it);
+            break;
+        case AST_WHILE:
+            compile_scan(compile, ast->whilestmt.condition);
+            compile_scan_list(compile, ast->whilestmt.body);
+            break;
+        case AST_FOR:
+            it = list_iterator_create(ast->forstmt.impl.formals);
+            while (!list_iterator_end(it))
+                compile_declare(compile, list_iterator_next(it), 0);
+            list_iterator_destroy(it);
+            compile_scan(compile, ast->forstmt.expr);
+            compile_scan_list(compile, ast->forstmt.impl.body);
+            break;
+        default:
+            break;
+    }
+}
+
+/* Compiler */
+static void compile_expression(compile_t *compile, ast_t *ast);
+
+static void compile_get(compile_t *compile, gml_position_t *position, const char *name) {
+    size_t index;
+    switch (compile_resolve(compile, name, &index)) {
+        case COMPILE_LOCAL:   compile_emit(compile, position, OP_GETLOCAL, index); break;
+        case COMPILE_UPVALUE: compile_emit(compile, position, OP_GETUPVAL, index); break;
+        case COMPILE_GLOBAL:
+            compile_emit(compile, position, OP_GETGLOBAL, compile_string(compile, name));
+            break;
+    }
+}
+
+static void compile_set(compile_t *compile, gml_position_t *position, const char *name) {
+    size_t index;
+    switch (compile_resolve(compile, name, &index)) {
+        case COMPILE_LOCAL:   compile_emit(compile, position, OP_SETLOCAL, index); break;
+        case COMPILE_UPVALUE: compile_emit(compile, position, OP_SETUPVAL, index); break;
+        case COMPILE_GLOBAL:
+            compile_emit(compile, position, OP_SETGLOBAL, compile_string(compile, name));
+            break;
+    }
+}
+
+/* Declared names are always in the current scope */
+static void compile_bind(compile_t *compile, gml_position_t *position, const char *name) {
+    size_t index;
+    if (compile_resolve(compile, name, &index) == COMPILE_LOCAL)
+        compile_emit(compile, position, OP_BINDLOCAL, index);
+    else
+        compile_emit(compile, position, OP_BINDGLOBAL, compile_string(compile, name));
+}
+static void compile_chunk(compile_t *compile, chunk_t *chunk, list_t *body);
+
+static void compile_block(compile_t *compile, list_t *block, gml_position_t *position) {
+    size_t length = list_length(block);
+    if (length == 0) {
+        compile_emit(compile, position, OP_NIL, 0);
+        return;
+    }
+    list_iterator_t *it = list_iterator_create(block);
+    for (size_t i = 0; !list_iterator_end(it); i++) {
+        ast_t *next = list_iterator_next(it);
+        compile_expression(compile, next);
+        if (i != length - 1)
+            compile_emit(compile, &next->position, OP_POP, 0);
+    }
+    list_iterator_destroy(it);
+}
+
+static void compile_list(compile_t *compile, list_t *list) {
+    list_iterator_t *it = list_iterator_create(list);
+    while (!list_iterator_end(it))
+        compile_expression(compile, list_iterator_next(it));
+    list_iterator_destroy(it);
+}
+
+static void compile_function(compile_t *compile, ast_t *ast, const char *name, ast_lambda_t *lambda) {
+    chunk_t *chunk = chunk_create(name, lambda->formals);
+    if (!chunk)
+        longjmp(compile->escape, 1);
+
+    /*
+     * The chunk goes into the constants before it's compiled so that it
+     * gets cleaned up with the rest if compilation fails.
+     */
+    size_t index = compile_constant(compile, (constant_t) { .class = CONSTANT_CHUNK, .chunk = chunk });
+    compile_chunk(compile, chunk, lambda->body);
+    compile_emit(compile, &ast->position, OP_CLOSURE, index);
+}
+
+static void compile_assign(compile_t *compile, ast_t *ast) {
+    ast_t *left = ast->binary.left;
+    switch (left->class) {
+        case AST_IDENT:
+            compile_expression(compile, ast->binary.right);
+            compile_set(compile, &ast->position, left->ident);
+            break;
+        case AST_SUBSCRIPT:
+            compile_expression(compile, left->subscript.expr);
+            if (left->subscript.key->class == AST_ATOM) {
+                compile_expression(compile, ast->binary.right);
+                compile_emit(compile, &ast->position, OP_SETFIELD, compile_cache(compile, left->subscript.key->atom));
+                break;
+            }
+            compile_expression(compile, left->subscript.key);
+            compile_expression(compile, ast->binary.right);
+            compile_emit(compile, &ast->position, OP_SETINDEX, 0);
+            break;
+        default:
+            gml_error(&ast->position, "Assignment target is not a valid lvalue.");
+            longjmp(compile->escape, 1);
+    }
+}
+
+static void compile_binary(compile_t *compile, ast_t *ast) {
+    opcode_t op;
+    switch (ast->binary.op) {
+        case LEX_TOKEN_ASSIGN:
+            compile_assign(compile, ast);
+            return;
+        case LEX_TOKEN_PLUS:      op = OP_ADD;    break;
+        case LEX_TOKEN_MINUS:     op = OP_SUB;    break;
+        case LEX_TOKEN_MUL:       op = OP_MUL;    break;
+        case LEX_TOKEN_DIV:       op = OP_DIV;    break;
+        case LEX_TOKEN_MOD:       op = OP_MOD;    break;
+        case LEX_TOKEN_BITAND:    op = OP_BITAND; break;
+        case LEX_TOKEN_BITOR:     op = OP_BITOR;  break;
+        case LEX_TOKEN_BITXOR:    op = OP_BITXOR; break;
+        case LEX_TOKEN_BITLSHIFT: op = OP_SHL;    break;
+        case LEX_TOKEN_BITRSHIFT: op = OP_SHR;    break;
+        case LEX_TOKEN_LESS:      op = OP_LT;     break;
+        case LEX_TOKEN_GREATER:   op = OP_GT;     break;
+        case LEX_TOKEN_LEQUAL:    op = OP_LE;     break;
+        case LEX_TOKEN_GEQUAL:    op = OP_GE;     break;
+        case LEX_TOKEN_EQUAL:     op = OP_EQ;     break;
+        case LEX_TOKEN_NEQUAL:    op = OP_NE;     break;
+        case LEX_TOKEN_IS:        op = OP_IS;     break;
+        case LEX_TOKEN_AND:       op = OP_AND;    break;
+        case LEX_TOKEN_OR:        op = OP_OR;     break;
+        default:
+            gml_error(&ast->position, "operation %s is not a binary operation",
+                lex_token_classname(ast->binary.op));
+            longjmp(compile->escape, 1);
+    }
+    /* Both operands are always evaluated, even for `&&' and `||' */
+    compile_expression(compile, ast->binary.left);
+    compile_expression(compile, ast->binary.right);
+    compile_emit(compile, &ast->position, op, 0);
+}
+
+static void compile_unary(compile_t *compile, ast_t *ast) {
+    compile_expression(compile, ast->unary.expr);
+    switch (ast->unary.op) {
+        case LEX_TOKEN_NOT:    compile_emit(compile, &ast->position, OP_NOT,    0); break;
+        case LEX_TOKEN_MINUS:  compile_emit(compile, &ast->position, OP_NEGATE, 0); break;
+        case LEX_TOKEN_BITNOT: compile_emit(compile, &ast->position, OP_BITNOT, 0); break;
+        case LEX_TOKEN_PLUS:   break;
+        default:
+            gml_error(&ast->position, "operation %s is not a unary operation",
+                lex_token_classname(ast->unary.op));
+            longjmp(compile->escape, 1);
+    }
+}
+
+static void compile_table(compile_t *compile, ast_t *ast) {
+    list_iterator_t *it = list_iterator_create(ast->table);
+    while (!list_iterator_end(it)) {
+        ast_t *entry = list_iterator_next(it);
+        compile_expression(compile, entry->dictentry.key);
+        compile_expression(compile, entry->dictentry.expr);
+    }
+    list_iterator_destroy(it);
+    compile_emit(compile, &ast->position, OP_TABLE, list_length(ast->table));
+}
+
+static void compile_if(compile_t *compile, ast_t *ast) {
+    size_t  nclauses = list_length(ast->ifstmt);
+    size_t *exits    = malloc(sizeof(size_t) * (nclauses + 1));
+    size_t  nexits   = 0;
+    int     haselse  = 0;
+    if (!exits)
+        longjmp(compile->escape, 1);
+
+    list_iterator_t *it = list_iterator_create(ast->ifstmt);
+    while (!list_iterator_end(it)) {
+        ast_t *clause = list_iterator_next(it);
+        size_t next   = 0;
+        if (clause->ifclause.condition) {
+            compile_expression(compile, clause->ifclause.condition);
+            next = compile_emit(compile, &clause->position, OP_JUMPFALSE, 0);
+        } else {
+            haselse = 1;
+        }
+        compile_block(compile, clause->ifclause.body, &clause->position);
+        if (!clause->ifclause.condition)
+            break;
+        exits[nexits++] = compile_emit(compile, &clause->position, OP_JUMP, 0);
+        /* Only one of the clause bodies leaves a value behind */
+        compile->depth--;
+        compile_patch(compile, next, compile_label(compile));
+    }
+    list_iterator_destroy(it);
+
+    /* No clause taken yields :nil */
+    if (!haselse)
+        compile_emit(compile, &ast->position, OP_NIL, 0);
+    for (size_t i = 0; i < nexits; i++)
+        compile_patch(compile, exits[i], compile_label(compile));
+    free(exits);
+}
+
+static void compile_while(compile_t *compile, ast_t *ast) {
+    compile_emit(compile, &ast->position, OP_NIL, 0);
+    size_t loop = compile_label(compile);
+    compile_expression(compile, ast->whilestmt.condition);
+    size_t exit = compile_emit(compile, &ast->position, OP_JUMPFALSE, 0);
+    compile_block(compile, ast->whilestmt.body, &ast->position);
+    compile_emit(compile, &ast->position, OP_NIP, 0);
+    compile_emit(compile, &ast->position, OP_JUMP, loop);
+    compile_patch(compile, exit, compile_label(compile));
+}
+
+static void compile_for(compile_t *compile, ast_t *ast) {
+    ast_t  *expr     = ast->forstmt.expr;
+    list_t *formals  = ast->forstmt.impl.formals;
+    size_t  nformals = list_length(formals);
+
+    /* Only literals and calls can be iterated */
+    switch (expr->class) {
+        case AST_ARRAY:
+        case AST_STRING:
+        case AST_TABLE:
+        case AST_CALL:
+            break;
+        default:
+            compile_emit(compile, &ast->position, OP_NIL, 0);
+            return;
+    }
+
+    compile_emit(compile, &ast->position, OP_NIL, 0);
+    compile_expression(compile, expr);
+    compile_emit(compile, &ast->position, OP_FORPREP, 0);
+    size_t loop = compile_label(compile);
+    size_t exit = compile_emit(compile, &ast->position, OP_FORLOOP, 0);
+    /* Formals past the end of a partial group keep their values */
+    list_iterator_t *it = list_iterator_create(formals);
+    for (size_t j = 0; !list_iterator_end(it); j++) {
+        const char *name = list_iterator_next(it);
+        size_t      skip = compile_emit(compile, &ast->position, OP_FORBIND, 0);
+        compile_word(compile, &ast->position, (code_t)j);
+        compile_bind(compile, &ast->position, name);
+        compile_emit(compile, &ast->position, OP_POP, 0);
+        compile_patch(compile, skip, compile_label(compile));
+    }
+    list_iterator_destroy(it);
+    compile_block(compile, ast->forstmt.impl.body, &ast->position);
+    compile_emit(compile, &ast->position, OP_FORSTEP, nformals ? nformals : 1);
+    compile_emit(compile, &ast->position, OP_JUMP, loop);
+    compile_patch(compile, exit, compile_label(compile));
+    /* The exhausted loop drops the subject, keys and index */
+    compile->depth -= 3;
+}
+
+static void compile_expression(compile_t *compile, ast_t *ast) {
+    switch (ast->class) {
+        case AST_TOPLEVEL:
+            compile_block(compile, ast->toplevel, &ast->position);
+            break;
+        case AST_IDENT:
+            compile_get(compile, &ast->position, ast->ident);
+            break;
+        case AST_ATOM:
+            compile_emit(compile, &ast->position, OP_ATOM, compile_atom(compile, ast->atom));
+            break;
+        case AST_NUMBER:
+            compile_emit(compile, &ast->position, OP_NUMBER, compile_number(compile, ast->number));
+            break;
+        case AST_STRING:
+            compile_emit(compile, &ast->position, OP_STRING, compile_string(compile, ast->string));
+            break;
+        case AST_ARRAY:
+            if (compile_literal(compile, ast))
+                break;
+            compile_list(compile, ast->array);
+            compile_emit(compile, &ast->position, OP_ARRAY, list_length(ast->array));
+            break;
+        case AST_TABLE:
+            compile_table(compile, ast);
+            break;
+        case AST_BINARY:
+            compile_binary(compile, ast);
+            break;
+        case AST_UNARY:
+            compile_unary(compile, ast);
+            break;
+        case AST_SUBSCRIPT:
+            compile_expression(compile, ast->subscript.expr);
+            if (ast->subscript.key->class == AST_ATOM) {
+                compile_emit(compile, &ast->position, OP_GETFIELD, compile_cache(compile, ast->subscript.key->atom));
+                break;
+            }
+            compile_expression(compile, ast->subscript.key);
+            compile_emit(compile, &ast->position, OP_SUBSCRIPT, 0);
+            break;
+        case AST_LAMBDA:
+            compile_function(compile, ast, NULL, &ast->lambda);
+            break;
+        case AST_CALL:
+            /* Calling a field passes the table along in case it's a method */
+            if (ast->call.callee->class == AST_SUBSCRIPT && ast->call.callee->subscript.key->class == AST_ATOM) {
+                ast_t *callee = ast->call.callee;
+                compile_expression(compile, callee->subscript.expr);
+                compile_emit(compile, &callee->position, OP_METHOD, compile_cache(compile, callee->subscript.key->atom));
+                compile_list(compile, ast->call.args);
+                compile_emit(compile, &ast->position, OP_INVOKE, list_length(ast->call.args));
+                break;
+            }
+            compile_expression(compile, ast->call.callee);
+            compile_list(compile, ast->call.args);
+            compile_emit(compile, &ast->position, OP_CALL, list_length(ast->call.args));
+            break;
+        case AST_DECLFUN:
+            compile_function(compile, ast, ast->fundecl.name, &ast->fundecl.impl);
+            compile_bind(compile, &ast->position, ast->fundecl.name);
+            break;
+        case AST_DECLVAR:
+            if (ast->vardecl.initializer)
+                compile_expression(compile, ast->vardecl.initializer);
+            else
+                compile_emit(compile, &ast->position, OP_NIL, 0);
+            compile_bind(compile, &ast->position, ast->vardecl.name);
+            break;
+        case AST_IF:
+            compile_if(compile, ast);
+            break;
+        case AST_WHILE:
+            compile_while(compile, ast);
+            break;
+        case AST_FOR:
+            compile_for(compile, ast);
+            break;
+        default:
+            compile_emit(compile, &ast->position, OP_NIL, 0);
+            break;
+    }
+}
+
+/* Whether control reaches a return from at, following unconditional jumps */
+static int compile_returns(chunk_t *chunk, size_t at) {
+    for (size_t hops = 0; hops < chunk->length; hops++) {
+        if (CODE_OP(chunk->code[at]) != OP_JUMP)
+            return CODE_OP(chunk->code[at]) == OP_RETURN;
+        at = CODE_ARG(chunk->code[at]);
+    }
+    return 0;
+}
+
+/*
+ * A call whose result the function returns right away is in tail position:
+ * the last expression of the body or of an if clause which is. Those get
+ * to reuse the frame of the function so recursion in tail position runs in
+ * constant stack space.
+ */
+static void compile_tailcalls(chunk_t *chunk) {
+    for (size_t at = 0; at < chunk->length; at++) {
+        code_t word = chunk->code[at];
+        switch (CODE_OP(word)) {
+            case OP_CALL:
+                if (compile_returns(chunk, at + 1))
+                    chunk->code[at] = CODE_MAKE(OP_TAILCALL, CODE_ARG(word));
+                break;
+            case OP_INVOKE:
+                if (compile_returns(chunk, at + 1))
+                    chunk->code[at] = CODE_MAKE(OP_TAILINVOKE, CODE_ARG(word));
+                break;
+            case OP_FORBIND:
+                /* Skip the operand word */
+                at++;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static void compile_chunk(compile_t *compile, chunk_t *chunk, list_t *body) {
+    chunk_t        *enclosing = compile->chunk;
+    size_t          depth     = compile->depth;
+    compile_scope_t scope     = { .outer = compile->scope, .chunk = chunk };
+
+    compile->chunk = chunk;
+    compile->depth = 0;
+    compile->scope = &scope;
+
+    /* The formals take the first slots */
+    list_iterator_t *it = list_iterator_create(chunk->formals);
+    while (!list_iterator_end(it))
+        compile_names_add(compile, &chunk->slots, &chunk->nslots, list_iterator_next(it));
+    list_iterator_destroy(it);
+    compile_scan_list(compile, body);
+
+    gml_position_t position = { .filename = "<chunk>", .line = 0, .column = 0 };
+    if (list_length(body))
+        position = ((ast_t*)list_at(body, 0))->position;
+    compile_block(compile, body, &position);
+    compile_emit(compile, &position, OP_RETURN, 0);
+    compile_tailcalls(chunk);
+
+    compile->chunk = enclosing;
+    compile->depth = depth;
+    compile->scope = scope.outer;
+}
+
+chunk_t *compile_run(ast_t *ast, int (*global)(void *data, const char *name), void *data) {
+    compile_t compile = {
+        .root     = NULL,
+        .chunk    = NULL,
+        .depth    = 0,
+        .scope    = NULL,
+        .globals  = NULL,
+        .nglobals = 0,
+        .global   = global,
+        .data     = data
+    };
+    if (!(compile.root = chunk_create(NULL, NULL)))
+        return NULL;
+
+    compile.chunk = compile.root;
+    if (setjmp(compile.escape) != 0) {
+        chunk_destroy(compile.root);
+        free(compile.globals);
+        return NULL;
+    }
+    compile_scan(&compile, ast);
+    compile_expression(&compile, ast);
+    compile_emit(&compile, &ast->position, OP_RETURN, 0);
+    free(compile.globals);
+    return compile.root;
+}
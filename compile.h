@@ -0,0 +1,178 @@
+#ifndef GML_COMPILE_HDR
+#define GML_COMPILE_HDR
+#include "parse.h"
+#include <stdint.h>
+
+/*
+ * Instructions are 32-bit words. The low 8 bits hold the opcode and the
+ * upper 24 bits hold the operand. Instructions which need more than one
+ * operand are followed by raw operand words.
+ */
+typedef uint32_t code_t;
+
+#define CODE_OP(WORD)       ((opcode_t)((WORD) & 0xFF))
+#define CODE_ARG(WORD)      ((size_t)((WORD) >> 8))
+#define CODE_MAKE(OP, ARG)  ((code_t)(OP) | ((code_t)(ARG) << 8))
+#define CODE_ARG_MAX        0xFFFFFF
+
+typedef enum {
+    OP_NIL,          /* push :nil                                       */
+    OP_NUMBER,       /* push constants[arg]                             */
+    OP_STRING,       /* push the string literal constants[arg]          */
+    OP_ATOM,         /* push the atom literal constants[arg]            */
+    OP_POP,          /* discard the top of the stack                    */
+    OP_NIP,          /* discard the value below the top of the stack    */
+    OP_GETLOCAL,     /* push slot arg of the current frame              */
+    OP_SETLOCAL,     /* assign the top of the stack to slot arg         */
+    OP_BINDLOCAL,    /* bind the top of the stack to slot arg           */
+    OP_GETUPVAL,     /* push upvalue arg of the current function        */
+    OP_SETUPVAL,     /* assign the top of the stack to upvalue arg      */
+    OP_GETGLOBAL,    /* push the global named constants[arg]            */
+    OP_SETGLOBAL,    /* assign the global named constants[arg]          */
+    OP_BINDGLOBAL,   /* bind the global named constants[arg]            */
+    OP_ARRAY,        /* build an array from arg values                  */
+    OP_LITERAL,      /* push a copy of the array literal constants[arg] */
+    OP_TABLE,        /* build a table from arg key and value pairs      */
+    OP_SUBSCRIPT,    /* expr key -> value                               */
+    OP_SETINDEX,     /* expr key value -> value                         */
+    OP_GETFIELD,     /* expr -> value of the field cached in caches[arg] */
+    OP_SETFIELD,     /* expr value -> value, field cached in caches[arg] */
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_MOD,
+    OP_BITAND,
+    OP_BITOR,
+    OP_BITXOR,
+    OP_SHL,
+    OP_SHR,
+    OP_LT,
+    OP_GT,
+    OP_LE,
+    OP_GE,
+    OP_EQ,
+    OP_NE,
+    OP_IS,
+    OP_AND,
+    OP_OR,
+    OP_NOT,
+    OP_NEGATE,
+    OP_BITNOT,
+    OP_CALL,         /* callee args... -> result, arg is the arg count  */
+    OP_METHOD,       /* expr -> callee self, field cached in caches[arg] */
+    OP_INVOKE,       /* callee self args... -> result, arg is the count */
+    OP_TAILCALL,     /* call in place of the current frame and return   */
+    OP_TAILINVOKE,   /* invoke in place of the current frame and return */
+    OP_CLOSURE,      /* push a function for the chunk constants[arg]    */
+    OP_JUMP,         /* jump to arg                                     */
+    OP_JUMPFALSE,    /* pop and jump to arg if false                    */
+    OP_FORPREP,      /* subject -> subject keys index                   */
+    OP_FORLOOP,      /* jump to arg and drop loop state when exhausted  */
+    OP_FORBIND,      /* push element (next word) or jump to arg         */
+    OP_FORSTEP,      /* store loop result and advance index by arg      */
+    OP_RETURN        /* return the top of the stack                     */
+} opcode_t;
+
+typedef struct chunk_s chunk_t;
+
+/*
+ * An upvalue is a variable of an enclosing function captured by a closure.
+ * It is either a slot of the function directly enclosing the closure or
+ * one of that function's own upvalues.
+ */
+typedef struct {
+    const char *name;
+    size_t      index;
+    int         local;  /* whether index is a slot rather than an upvalue */
+} upvalue_t;
+
+/*
+ * An inline cache remembers the shapes of the tables a field access with
+ * a constant atom key has seen and which slot the field is in for each.
+ * A store which added the field also remembers the shape it led to. The
+ * shapes belong to the runtime, the compiler only reserves the caches.
+ */
+#define CACHE_WAYS 4
+
+typedef struct {
+    const char *name;                /* the atom naming the field */
+    void       *atom;                /* the interned atom once looked up */
+    const void *shapes[CACHE_WAYS];  /* NULL for unused ways */
+    const void *targets[CACHE_WAYS]; /* the shape after adding the field */
+    size_t      slots[CACHE_WAYS];
+} cache_t;
+
+typedef enum {
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+    CONSTANT_ATOM,
+    CONSTANT_ARRAY,
+    CONSTANT_CHUNK
+} constant_class_t;
+
+/*
+ * Strings in the constant pool are literals and identifier names, atoms
+ * are the names of atom literals. They point into the AST the chunk was
+ * compiled from which must outlive the chunk. Arrays are array literals
+ * of nothing but number, string and atom literals, given as the indices
+ * of those in the constant pool.
+ *
+ * The runtime makes the object of a string, atom or array literal the
+ * first time it's evaluated and keeps it in value, sharing it from then
+ * on. The compiler only reserves value.
+ */
+typedef struct {
+    constant_class_t class;
+    union {
+        double       number;
+        const char  *string;
+        chunk_t     *chunk;
+        struct {
+            size_t  *items;
+            size_t   nitems;
+        } array;
+    };
+    void            *value;  /* NULL until the runtime made the literal */
+} constant_t;
+
+/*
+ * A chunk is the compiled form of a function body or of the top level
+ * of a source buffer.
+ *
+ * Variables local to a function live in the slots of its frame, with the
+ * formals occupying the first slots. Variables of enclosing functions are
+ * reached through upvalues. Only variables not local to any enclosing
+ * function are looked up by name.
+ */
+struct chunk_s {
+    const char     *name;       /* NULL for lambdas and the top level */
+    list_t         *formals;
+    size_t          nformals;
+    const char    **slots;      /* the name of every slot for diagnostics */
+    size_t          nslots;
+    upvalue_t      *upvalues;
+    size_t          nupvalues;
+    code_t         *code;
+    gml_position_t *positions;  /* source position for every code word */
+    size_t          length;
+    size_t          capacity;
+    constant_t     *constants;
+    size_t          nconstants;
+    size_t          maxconstants;
+    cache_t        *caches;
+    size_t          ncaches;
+    size_t          maxcaches;
+    size_t          maxstack;   /* deepest the operand stack gets */
+};
+
+/*
+ * The global predicate lets the compiler know which names are already
+ * bound globally; assigning to one of those from a function assigns the
+ * global instead of introducing a local.
+ */
+chunk_t *compile_run(ast_t *ast, int (*global)(void *data, const char *name), void *data);
+void chunk_destroy(chunk_t *chunk);
+const char *compile_opname(opcode_t op);
+
+#endif
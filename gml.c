@@ -10,7 +10,8 @@ typedef struct {
 } repl_t;
 
 static gml_value_t repl_builtin_quit(gml_state_t *gml, gml_value_t *args, size_t nargs) {
-    gml_arg_check(gml, args, nargs, "quit", "");
+    (void)args;
+    (void)nargs;
     ((repl_t*)gml_state_user_get(gml))->quit = 1;
     return gml_none_create(gml);
 }
@@ -22,7 +23,10 @@ static const char *repl_completions[] = {
     "atanh",  "exp",     "exp2",   "expm1",  "ldexp",  "log",   "log2",
     "log10",  "ilogb",   "log1p",  "logb",   "scalbn", "pow",   "sqrt",
     "cbrt",   "hypot",   "floor",  "ceil",   "map",    "range", "filter",
-    "reduce", "length",  "find",
+    "reduce", "length",  "find",   "find_all", "count", "substring",
+    "push",   "pop",     "insert", "remove", "reserve", "slice", "sort",
+    "f64",    "f32",     "add",    "mul",    "fma",    "dot",   "sum",
+    "min",    "max",
 
     /* Keywords */
     "if",     "elif",    "else",   "fn",     "var",    "for",   "in",
@@ -79,7 +83,7 @@ static int repl_read(int history) {
 
     /* Install the builtins */
     gml_builtins_install(gml);
-    gml_set_native(gml, "quit", &repl_builtin_quit, 0, 0);
+    gml_set_native_contract(gml, "quit", &repl_builtin_quit, "");
 
     char   *linedata  = NULL;
     char   *linetail  = NULL;
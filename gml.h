@@ -21,14 +21,25 @@ typedef enum {
     GML_TYPE_ARRAY,
     GML_TYPE_TABLE,
     GML_TYPE_NATIVE,
-    GML_TYPE_FUNCTION
+    GML_TYPE_FUNCTION,
+    GML_TYPE_BUFFER
 } gml_type_t;
 
+/*
+ * A buffer is an array of numbers kept unboxed and contiguous, as doubles
+ * or as floats, for numeric work over many numbers at once.
+ */
+typedef enum {
+    GML_BUFFER_F64,
+    GML_BUFFER_F32
+} gml_buffer_kind_t;
+
 /*
  * In GML a rune is a character of a string. Every character is thus 32bits.
  * This allows for a variety of character sets. How the implementation
  * choses to utilize the 32 bits is undefined. In this paticular case the
- * implementation is using UTF-8.
+ * implementation is using UTF-8, which strings are also stored as. The
+ * data gml_string_utf8 yields is the string's own and lives as long as it.
  */
 typedef uint32_t gml_string_rune_t;
 
@@ -59,11 +70,24 @@ typedef struct gml_state_s gml_state_t;
 typedef double gml_value_t;
 typedef struct gml_header_s gml_header_t;
 
+/*
+ * Every object on the heap starts with a header. The runtime threads all
+ * old objects on a list for the garbage collector to sweep. A young object
+ * which was moved out of the nursery refers to its new location instead.
+ */
 struct gml_header_s {
     gml_type_t    type;
+    int           flags;
+    gml_header_t *next;
     void        (*destroy)(gml_state_t *gml, gml_value_t value);
 };
 
+/*
+ * Natives are passed their arguments in place on the operand stack of
+ * the caller, only ever as many as the native was created to take, from
+ * min to max or any number past min when max is negative. The collector
+ * keeps those arguments up to date, values held elsewhere are not.
+ */
 typedef gml_value_t (*gml_native_func_t)(gml_state_t *state, gml_value_t *value_array, size_t value_length);
 
 gml_value_t gml_nil_create(gml_state_t *gml);
@@ -89,26 +113,99 @@ gml_value_t gml_value_box(gml_state_t *gml, gml_header_t *value);
 gml_header_t *gml_value_unbox(gml_state_t *gml, gml_value_t value);
 void gml_set_global(gml_state_t *gml, const char *name, gml_value_t value);
 void gml_set_native(gml_state_t *gml, const char *name, gml_native_func_t func, int min, int max);
+/*
+ * Natives set with a contract take one argument per character of it, of
+ * the type gml_arg_contract gives for the character. Calls check that
+ * ahead of running the native, which need not check again. Contracts are
+ * at most eight characters. A native whose contract is invalid, or which
+ * can't be made, isn't set and zero is returned.
+ */
+int gml_set_native_contract(gml_state_t *gml, const char *name, gml_native_func_t func, const char *contract);
 gml_value_t gml_string_create(gml_state_t *gml, const char *string);
 size_t gml_string_length(gml_state_t *gml, gml_value_t string);
 gml_value_t gml_array_create(gml_state_t *gml, gml_value_t *elements, size_t length);
 gml_type_t gml_arg_contract(char c);
 void gml_arg_check(gml_state_t *gml, gml_value_t *args, size_t nargs, const char *name, const char *contract);
 void gml_builtins_install(gml_state_t *gml);
+const char *gml_string_utf8(gml_state_t *gml, gml_value_t string);
 char *gml_string_utf8data(gml_state_t *gml, gml_value_t string);
 size_t gml_string_utf8length(gml_state_t *gml, gml_value_t string);
 void gml_throw(int internal, const char *format, ...);
+/* Unwind out of the source running, once gml_throw has said why */
+void gml_abort(gml_state_t *gml);
 gml_value_t gml_string_substring(gml_state_t *gml, gml_value_t string, size_t start, size_t length);
 void gml_table_put(gml_state_t *gml, gml_value_t dict, gml_value_t key, gml_value_t value);
 gml_value_t gml_table_get(gml_state_t *gml, gml_value_t dict, gml_value_t key);
+int gml_table_remove(gml_state_t *gml, gml_value_t dict, gml_value_t key);
 int gml_table_empty(gml_state_t *gml, gml_value_t dict);
 list_t *gml_table_keys(gml_state_t *gml, gml_value_t dict);
 gml_value_t gml_table_create(gml_state_t *gml);
 gml_value_t gml_function_run(gml_state_t *gml, gml_value_t function, gml_value_t *args, size_t nargs);
 size_t gml_array_length(gml_state_t *gml, gml_value_t array);
 gml_value_t gml_array_get(gml_state_t *gml, gml_value_t array, size_t index);
+void gml_array_set(gml_state_t *gml, gml_value_t array, size_t index, gml_value_t value);
+
+/*
+ * Arrays grow in place. The functions which may need memory for that
+ * yield false when there's none, leaving the array as it was. Indices
+ * are not checked.
+ */
+int gml_array_reserve(gml_state_t *gml, gml_value_t array, size_t capacity);
+int gml_array_push(gml_state_t *gml, gml_value_t array, gml_value_t value);
+gml_value_t gml_array_pop(gml_state_t *gml, gml_value_t array);
+int gml_array_insert(gml_state_t *gml, gml_value_t array, size_t index, gml_value_t value);
+gml_value_t gml_array_remove(gml_state_t *gml, gml_value_t array, size_t index);
+gml_value_t gml_array_slice(gml_state_t *gml, gml_value_t array, size_t start, size_t length);
+
+/* Buffers start out zeroed. Their data doesn't move for as long as they live. */
+gml_value_t gml_buffer_create(gml_state_t *gml, gml_buffer_kind_t kind, size_t length);
+gml_buffer_kind_t gml_buffer_kind(gml_state_t *gml, gml_value_t buffer);
+size_t gml_buffer_length(gml_state_t *gml, gml_value_t buffer);
+void *gml_buffer_data(gml_state_t *gml, gml_value_t buffer);
+double gml_buffer_get(gml_state_t *gml, gml_value_t buffer, size_t index);
+void gml_buffer_set(gml_state_t *gml, gml_value_t buffer, size_t index, double value);
 gml_value_t gml_none_create(gml_state_t *gml);
 void gml_state_user_set(gml_state_t *gml, void *user);
 void *gml_state_user_get(gml_state_t *gml);
 
+/*
+ * Calls nest no deeper than the depth set, 32768 unless set otherwise.
+ * The operand stack is sized to match, with room for four values every
+ * call for the function called, its arguments, variables and temporaries.
+ * Calls taking more than that run out of stack before reaching the depth.
+ * Nesting past either fails with a stack overflow. The depth can only be
+ * set while nothing is running; zero is returned then, or when the stack
+ * can't be sized for the depth, and the depth stays as it was.
+ */
+int gml_set_depth(gml_state_t *gml, size_t depth);
+
+/*
+ * Values only referenced from C are not seen by the garbage collector,
+ * which may also move them. A native which holds on to values while
+ * calling back into GML has to push them as handles and read them back
+ * through the handle once it's done calling.
+ */
+size_t gml_handle_push(gml_state_t *gml, gml_value_t value);
+gml_value_t gml_handle_get(gml_state_t *gml, size_t handle);
+void gml_handle_pop(gml_state_t *gml, size_t count);
+
+/*
+ * A callable is a function prepared once to be called from C over and
+ * over with as many arguments as it was made for, taken from an argument
+ * buffer of its own. Like a handle the callable keeps the function and
+ * its arguments alive and up to date until it's destroyed. Calls which
+ * raise an error yield nil rather than unwinding past the caller.
+ *
+ * A batch calls once per nargs values of tuples, storing each result to
+ * results, and returns how many calls completed. It stops at the first
+ * error and leaves the argument buffer holding the last tuple.
+ */
+typedef struct gml_callable_s gml_callable_t;
+
+gml_callable_t *gml_callable_create(gml_state_t *gml, gml_value_t function, size_t nargs);
+void gml_callable_destroy(gml_state_t *gml, gml_callable_t *callable);
+gml_value_t *gml_callable_args(gml_callable_t *callable);
+gml_value_t gml_callable_invoke(gml_state_t *gml, gml_callable_t *callable);
+size_t gml_callable_batch(gml_state_t *gml, gml_callable_t *callable, const gml_value_t *tuples, size_t ntuples, gml_value_t *results);
+
 #endif
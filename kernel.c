@@ -0,0 +1,252 @@
+#include "kernel.h"
+#include <math.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#   define KERNEL_X86
+#   include <immintrin.h>
+#endif
+
+/*
+ * The kernels of every instruction set are stamped out of the same two
+ * macros, one for plain loops and one for vectors of WIDTH elements. The
+ * vector kernels finish whatever is left over after the last full vector
+ * one element at a time.
+ */
+#define KERNEL_SCALAR(S, T)                                                                  \
+    static void kernel_add_##S##_scalar(void *out, const void *a, const void *b, size_t n) { \
+        T *r = out; const T *x = a, *y = b;                                                  \
+        for (size_t i = 0; i < n; i++)                                                       \
+            r[i] = x[i] + y[i];                                                              \
+    }                                                                                        \
+    static void kernel_mul_##S##_scalar(void *out, const void *a, const void *b, size_t n) { \
+        T *r = out; const T *x = a, *y = b;                                                  \
+        for (size_t i = 0; i < n; i++)                                                       \
+            r[i] = x[i] * y[i];                                                              \
+    }                                                                                        \
+    static void kernel_fma_##S##_scalar(void *out, const void *a, const void *b,             \
+                                        const void *c, size_t n) {                           \
+        T *r = out; const T *x = a, *y = b, *z = c;                                          \
+        for (size_t i = 0; i < n; i++)                                                       \
+            r[i] = x[i] * y[i] + z[i];                                                       \
+    }                                                                                        \
+    static double kernel_dot_##S##_scalar(const void *a, const void *b, size_t n) {          \
+        const T *x = a, *y = b;                                                              \
+        T        s = 0;                                                                      \
+        for (size_t i = 0; i < n; i++)                                                       \
+            s += x[i] * y[i];                                                                \
+        return s;                                                                            \
+    }                                                                                        \
+    static double kernel_sum_##S##_scalar(const void *a, size_t n) {                         \
+        const T *x = a;                                                                      \
+        T        s = 0;                                                                      \
+        for (size_t i = 0; i < n; i++)                                                       \
+            s += x[i];                                                                       \
+        return s;                                                                            \
+    }                                                                                        \
+    static double kernel_min_##S##_scalar(const void *a, size_t n) {                         \
+        const T *x = a;                                                                      \
+        T        m = x[0];                                                                   \
+        for (size_t i = 1; i < n; i++)                                                       \
+            m = x[i] < m ? x[i] : m;                                                         \
+        return m;                                                                            \
+    }                                                                                        \
+    static double kernel_max_##S##_scalar(const void *a, size_t n) {                         \
+        const T *x = a;                                                                      \
+        T        m = x[0];                                                                   \
+        for (size_t i = 1; i < n; i++)                                                       \
+            m = x[i] > m ? x[i] : m;                                                         \
+        return m;                                                                            \
+    }
+
+#define KERNEL_SCALAR_UNARY(NAME, S, T, F)                                                   \
+    static void kernel_##NAME##_##S##_scalar(void *out, const void *a, size_t n) {           \
+        T *r = out; const T *x = a;                                                          \
+        for (size_t i = 0; i < n; i++)                                                       \
+            r[i] = F(x[i]);                                                                  \
+    }
+
+#define KERNEL_VECTOR(ISA, TARGET, S, T, V, WIDTH, LOAD, STORE, ZERO, ADD, MUL, FMA, MIN, MAX)   \
+    TARGET static void kernel_add_##S##_##ISA(void *out, const void *a, const void *b, size_t n) { \
+        T *r = out; const T *x = a, *y = b;                                                      \
+        size_t i = 0;                                                                            \
+        for (; i + WIDTH <= n; i += WIDTH)                                                       \
+            STORE(r + i, ADD(LOAD(x + i), LOAD(y + i)));                                         \
+        for (; i < n; i++)                                                                       \
+            r[i] = x[i] + y[i];                                                                  \
+    }                                                                                            \
+    TARGET static void kernel_mul_##S##_##ISA(void *out, const void *a, const void *b, size_t n) { \
+        T *r = out; const T *x = a, *y = b;                                                      \
+        size_t i = 0;                                                                            \
+        for (; i + WIDTH <= n; i += WIDTH)                                                       \
+            STORE(r + i, MUL(LOAD(x + i), LOAD(y + i)));                                         \
+        for (; i < n; i++)                                                                       \
+            r[i] = x[i] * y[i];                                                                  \
+    }                                                                                            \
+    TARGET static void kernel_fma_##S##_##ISA(void *out, const void *a, const void *b,           \
+                                              const void *c, size_t n) {                         \
+        T *r = out; const T *x = a, *y = b, *z = c;                                              \
+        size_t i = 0;                                                                            \
+        for (; i + WIDTH <= n; i += WIDTH)                                                       \
+            STORE(r + i, FMA(LOAD(x + i), LOAD(y + i), LOAD(z + i)));                            \
+        for (; i < n; i++)                                                                       \
+            r[i] = x[i] * y[i] + z[i];                                                           \
+    }                                                                                            \
+    TARGET static double kernel_dot_##S##_##ISA(const void *a, const void *b, size_t n) {        \
+        const T *x = a, *y = b;                                                                  \
+        V        s0 = ZERO(), s1 = ZERO();                                                       \
+        T        lanes[WIDTH];                                                                   \
+        T        s = 0;                                                                          \
+        size_t   i = 0;                                                                          \
+        for (; i + 2 * WIDTH <= n; i += 2 * WIDTH) {                                             \
+            s0 = FMA(LOAD(x + i), LOAD(y + i), s0);                                              \
+            s1 = FMA(LOAD(x + i + WIDTH), LOAD(y + i + WIDTH), s1);                              \
+        }                                                                                        \
+        for (; i + WIDTH <= n; i += WIDTH)                                                       \
+            s0 = FMA(LOAD(x + i), LOAD(y + i), s0);                                              \
+        STORE(lanes, ADD(s0, s1));                                                               \
+        for (size_t k = 0; k < WIDTH; k++)                                                       \
+            s += lanes[k];                                                                       \
+        for (; i < n; i++)                                                                       \
+            s += x[i] * y[i];                                                                    \
+        return s;                                                                                \
+    }                                                                                            \
+    TARGET static double kernel_sum_##S##_##ISA(const void *a, size_t n) {                       \
+        const T *x = a;                                                                          \
+        V        s0 = ZERO(), s1 = ZERO();                                                       \
+        T        lanes[WIDTH];                                                                   \
+        T        s = 0;                                                                          \
+        size_t   i = 0;                                                                          \
+        for (; i + 2 * WIDTH <= n; i += 2 * WIDTH) {                                             \
+            s0 = ADD(LOAD(x + i), s0);                                                           \
+            s1 = ADD(LOAD(x + i + WIDTH), s1);                                                   \
+        }                                                                                        \
+        for (; i + WIDTH <= n; i += WIDTH)                                                       \
+            s0 = ADD(LOAD(x + i), s0);                                                           \
+        STORE(lanes, ADD(s0, s1));                                                               \
+        for (size_t k = 0; k < WIDTH; k++)                                                       \
+            s += lanes[k];                                                                       \
+        for (; i < n; i++)                                                                       \
+            s += x[i];                                                                           \
+        return s;                                                                                \
+    }                                                                                            \
+    TARGET static double kernel_min_##S##_##ISA(const void *a, size_t n) {                       \
+        const T *x = a;                                                                          \
+        T        lanes[WIDTH];                                                                   \
+        T        m = x[0];                                                                       \
+        size_t   i = 0;                                                                          \
+        if (n >= WIDTH) {                                                                        \
+            V v = LOAD(x);                                                                       \
+            for (i = WIDTH; i + WIDTH <= n; i += WIDTH)                                          \
+                v = MIN(v, LOAD(x + i));                                                         \
+            STORE(lanes, v);                                                                     \
+            for (size_t k = 0; k < WIDTH; k++)                                                   \
+                m = lanes[k] < m ? lanes[k] : m;                                                 \
+        }                                                                                        \
+        for (; i < n; i++)                                                                       \
+            m = x[i] < m ? x[i] : m;                                                             \
+        return m;                                                                                \
+    }                                                                                            \
+    TARGET static double kernel_max_##S##_##ISA(const void *a, size_t n) {                       \
+        const T *x = a;                                                                          \
+        T        lanes[WIDTH];                                                                   \
+        T        m = x[0];                                                                       \
+        size_t   i = 0;                                                                          \
+        if (n >= WIDTH) {                                                                        \
+            V v = LOAD(x);                                                                       \
+            for (i = WIDTH; i + WIDTH <= n; i += WIDTH)                                          \
+                v = MAX(v, LOAD(x + i));                                                         \
+            STORE(lanes, v);                                                                     \
+            for (size_t k = 0; k < WIDTH; k++)                                                   \
+                m = lanes[k] > m ? lanes[k] : m;                                                 \
+        }                                                                                        \
+        for (; i < n; i++)                                                                       \
+            m = x[i] > m ? x[i] : m;                                                             \
+        return m;                                                                                \
+    }
+
+#define KERNEL_VECTOR_UNARY(NAME, ISA, TARGET, S, T, WIDTH, LOAD, STORE, OP, F)                  \
+    TARGET static void kernel_##NAME##_##S##_##ISA(void *out, const void *a, size_t n) {         \
+        T *r = out; const T *x = a;                                                              \
+        size_t i = 0;                                                                            \
+        for (; i + WIDTH <= n; i += WIDTH)                                                       \
+            STORE(r + i, OP(LOAD(x + i)));                                                       \
+        for (; i < n; i++)                                                                       \
+            r[i] = F(x[i]);                                                                      \
+    }
+
+/* Instruction sets without an instruction for a unary kernel use the plain loop */
+#define KERNEL_TABLE(ISA, S, SQRT, FLOOR, CEIL)                                                  \
+    static const kernel_t kernel_##S##_##ISA = {                                                 \
+        #ISA,                                                                                    \
+        &kernel_add_##S##_##ISA, &kernel_mul_##S##_##ISA, &kernel_fma_##S##_##ISA,               \
+        &kernel_dot_##S##_##ISA, &kernel_sum_##S##_##ISA,                                        \
+        &kernel_min_##S##_##ISA, &kernel_max_##S##_##ISA,                                        \
+        { &kernel_sqrt_##S##_##SQRT, &kernel_floor_##S##_##FLOOR, &kernel_ceil_##S##_##CEIL }    \
+    };
+
+KERNEL_SCALAR(f64, double)
+KERNEL_SCALAR(f32, float)
+KERNEL_SCALAR_UNARY(sqrt,  f64, double, sqrt)
+KERNEL_SCALAR_UNARY(floor, f64, double, floor)
+KERNEL_SCALAR_UNARY(ceil,  f64, double, ceil)
+KERNEL_SCALAR_UNARY(sqrt,  f32, float,  sqrtf)
+KERNEL_SCALAR_UNARY(floor, f32, float,  floorf)
+KERNEL_SCALAR_UNARY(ceil,  f32, float,  ceilf)
+KERNEL_TABLE(scalar, f64, scalar, scalar, scalar)
+KERNEL_TABLE(scalar, f32, scalar, scalar, scalar)
+
+#if defined(KERNEL_X86) && defined(__SSE2__)
+#   define KERNEL_HAVE_SSE2
+/* SSE2 has no fused multiply-add */
+#   define KERNEL_SSE2_FMA_PD(A, B, C) _mm_add_pd(_mm_mul_pd((A), (B)), (C))
+#   define KERNEL_SSE2_FMA_PS(A, B, C) _mm_add_ps(_mm_mul_ps((A), (B)), (C))
+
+KERNEL_VECTOR(sse2, , f64, double, __m128d, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_setzero_pd,
+              _mm_add_pd, _mm_mul_pd, KERNEL_SSE2_FMA_PD, _mm_min_pd, _mm_max_pd)
+KERNEL_VECTOR(sse2, , f32, float, __m128, 4, _mm_loadu_ps, _mm_storeu_ps, _mm_setzero_ps,
+              _mm_add_ps, _mm_mul_ps, KERNEL_SSE2_FMA_PS, _mm_min_ps, _mm_max_ps)
+KERNEL_VECTOR_UNARY(sqrt, sse2, , f64, double, 2, _mm_loadu_pd, _mm_storeu_pd, _mm_sqrt_pd, sqrt)
+KERNEL_VECTOR_UNARY(sqrt, sse2, , f32, float,  4, _mm_loadu_ps, _mm_storeu_ps, _mm_sqrt_ps, sqrtf)
+/* Rounding instructions came with SSE4.1 */
+KERNEL_TABLE(sse2, f64, sse2, scalar, scalar)
+KERNEL_TABLE(sse2, f32, sse2, scalar, scalar)
+#endif
+
+#if defined(KERNEL_X86)
+#   define KERNEL_HAVE_AVX2
+#   define KERNEL_AVX2 __attribute__((target("avx2,fma")))
+
+KERNEL_VECTOR(avx2, KERNEL_AVX2, f64, double, __m256d, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_setzero_pd,
+              _mm256_add_pd, _mm256_mul_pd, _mm256_fmadd_pd, _mm256_min_pd, _mm256_max_pd)
+KERNEL_VECTOR(avx2, KERNEL_AVX2, f32, float, __m256, 8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_setzero_ps,
+              _mm256_add_ps, _mm256_mul_ps, _mm256_fmadd_ps, _mm256_min_ps, _mm256_max_ps)
+KERNEL_VECTOR_UNARY(sqrt,  avx2, KERNEL_AVX2, f64, double, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_sqrt_pd,  sqrt)
+KERNEL_VECTOR_UNARY(floor, avx2, KERNEL_AVX2, f64, double, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_floor_pd, floor)
+KERNEL_VECTOR_UNARY(ceil,  avx2, KERNEL_AVX2, f64, double, 4, _mm256_loadu_pd, _mm256_storeu_pd, _mm256_ceil_pd,  ceil)
+KERNEL_VECTOR_UNARY(sqrt,  avx2, KERNEL_AVX2, f32, float,  8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_sqrt_ps,  sqrtf)
+KERNEL_VECTOR_UNARY(floor, avx2, KERNEL_AVX2, f32, float,  8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_floor_ps, floorf)
+KERNEL_VECTOR_UNARY(ceil,  avx2, KERNEL_AVX2, f32, float,  8, _mm256_loadu_ps, _mm256_storeu_ps, _mm256_ceil_ps,  ceilf)
+KERNEL_TABLE(avx2, f64, avx2, avx2, avx2)
+KERNEL_TABLE(avx2, f32, avx2, avx2, avx2)
+#endif
+
+const kernel_t *kernel_get(kernel_kind_t kind) {
+    static const kernel_t *f64 = NULL;
+    static const kernel_t *f32 = NULL;
+    if (!f64) {
+        f64 = &kernel_f64_scalar;
+        f32 = &kernel_f32_scalar;
+#ifdef KERNEL_HAVE_SSE2
+        f64 = &kernel_f64_sse2;
+        f32 = &kernel_f32_sse2;
+#endif
+#ifdef KERNEL_HAVE_AVX2
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            f64 = &kernel_f64_avx2;
+            f32 = &kernel_f32_avx2;
+        }
+#endif
+    }
+    return kind == KERNEL_F32 ? f32 : f64;
+}
@@ -0,0 +1,47 @@
+#ifndef GML_KERNEL_HDR
+#define GML_KERNEL_HDR
+#include <stddef.h>
+
+/*
+ * Numeric kernels over contiguous arrays of doubles or floats. Every kind
+ * of element has a table of kernels picked for the processor the first
+ * time it's asked for: AVX2 with fused multiply-add where the processor
+ * has them, SSE2 on any other x86 processor and plain loops elsewhere.
+ *
+ * Elementwise kernels may write their result over one of their operands.
+ * Sums and dot products add in several lanes at once so they round in a
+ * different order than adding one element after the other would; fma
+ * rounds once only where the processor has fused multiply-add. Minimum
+ * and maximum expect at least one element.
+ *
+ * Unary kernels apply a function to every element. Only those with an
+ * instruction of their own are here; everything else in math.h goes
+ * through a plain loop.
+ */
+typedef enum {
+    KERNEL_F64,
+    KERNEL_F32
+} kernel_kind_t;
+
+typedef enum {
+    KERNEL_SQRT,
+    KERNEL_FLOOR,
+    KERNEL_CEIL,
+    KERNEL_UNARIES
+} kernel_unary_t;
+
+typedef struct {
+    const char *isa;
+    void      (*add)(void *out, const void *a, const void *b, size_t length);
+    void      (*mul)(void *out, const void *a, const void *b, size_t length);
+    void      (*fma)(void *out, const void *a, const void *b, const void *c, size_t length);
+    double    (*dot)(const void *a, const void *b, size_t length);
+    double    (*sum)(const void *a, size_t length);
+    double    (*min)(const void *a, size_t length);
+    double    (*max)(const void *a, size_t length);
+    void      (*unary[KERNEL_UNARIES])(void *out, const void *a, size_t length);
+} kernel_t;
+
+const kernel_t *kernel_get(kernel_kind_t kind);
+
+#endif
@@ -1,5 +1,5 @@
 #include "gml.h"
-#include "parse.h"
+#include "compile.h"
 
 #include <stdlib.h>
 #include <stdint.h>
@@ -7,6 +7,10 @@
 #include <setjmp.h>
 #include <stdarg.h>
 #include <stdio.h>
+#include <math.h>
+#ifdef __SSE2__
+#   include <emmintrin.h>
+#endif
 
 /* Core runtime */
 void gml_error(gml_position_t *position, const char *format, ...) {
@@ -37,6 +41,7 @@ const char *gml_typename(gml_state_t *gml, gml_type_t type) {
         case GML_TYPE_TABLE:    return "table";
         case GML_TYPE_NATIVE:   return "native";
         case GML_TYPE_FUNCTION: return "function";
+        case GML_TYPE_BUFFER:   return "buffer";
     }
     return NULL;
 }
@@ -203,22 +208,218 @@ static void *gml_ht_find(gml_ht_t *hashtable, const char *key) {
     return find ? find->value : NULL;
 }
 
+/* How many frames calls may nest unless set otherwise */
+#define GML_VM_DEPTH 32768
+
+/*
+ * The operand stack holds this many values for every frame calls may nest,
+ * for the function called, its arguments, variables and temporaries, and
+ * no fewer than GML_VM_STACK values for the top level.
+ */
+#define GML_VM_FRAME 4
+#define GML_VM_STACK 65536
+
+/* How many runs of the VM may nest inside natives calling functions */
+#define GML_VM_NESTING 200
+
+/*
+ * The variables of a function invocation are the slots at the bottom of
+ * its window of the operand stack. A closure reaches the variables of the
+ * functions enclosing it through upvalues. While that function is running
+ * an upvalue is open and refers to the slot on the stack. When it returns
+ * the value is moved into the upvalue itself and the upvalue is closed.
+ * Upvalues are shared by every closure capturing the same variable.
+ */
+typedef struct gml_upvalue_s gml_upvalue_t;
+
+struct gml_upvalue_s {
+    gml_value_t   *location;
+    gml_value_t    value;
+    size_t         refs;        /* the number of closures referencing it */
+    int            remembered;  /* closed with a young value */
+    gml_upvalue_t *next;        /* the next open upvalue further down the stack */
+};
+
+typedef struct gml_function_s gml_function_t;
+
+/*
+ * Every call running has a frame on the call stack, which grows as calls
+ * nest instead of the C stack. A function calling another saves where it
+ * resumes in its frame; the frame of the callee has where the caller takes
+ * the value returned. Natives calling functions run the VM afresh on top
+ * of it, that is the only way the VM nests on the C stack.
+ */
+typedef struct {
+    chunk_t        *chunk;
+    gml_function_t *fun;     /* NULL for the top level of a source buffer */
+    gml_value_t    *slots;
+    const code_t   *pc;      /* where to resume once the callee returns */
+    gml_value_t    *result;  /* where the caller takes the value returned */
+} gml_frame_t;
+
+/* Collections happen no more often than every this many allocated bytes */
+#define GML_GC_MINIMUM (1 << 20)
+
+/*
+ * Young objects are bump allocated in the nursery. Once it's mostly full
+ * the next safepoint evacuates the survivors to the old heap.
+ */
+#define GML_NURSERY_SIZE    (1 << 20)
+#define GML_NURSERY_TRIGGER (GML_NURSERY_SIZE / 8 * 7)
+
+#define GML_GC_MARKED     1  /* reachable in the current collection */
+#define GML_GC_REMEMBERED 2  /* old object which may refer to young ones */
+#define GML_GC_FORWARDED  4  /* young object moved to header->next */
+
+/* A growable array of pointers for the bookkeeping of the collector */
+typedef struct {
+    void  **items;
+    size_t  length;
+    size_t  capacity;
+} gml_vector_t;
+
+static int gml_vector_push(gml_vector_t *vector, void *item) {
+    if (vector->length == vector->capacity) {
+        size_t  size  = vector->capacity ? vector->capacity * 2 : 64;
+        void  **items = realloc(vector->items, sizeof(void*) * size);
+        if (!items)
+            return 0;
+        vector->items    = items;
+        vector->capacity = size;
+    }
+    vector->items[vector->length++] = item;
+    return 1;
+}
+
+typedef struct gml_shape_s gml_shape_t;
+
 struct gml_state_s {
-    void      *user;
-    gml_env_t *global;
-    gml_ht_t  *atoms;
-    parse_t   *parse;
-    list_t    *asts;
-    list_t    *objects;
-    list_t    *classes;
-    jmp_buf    escape;
-    size_t     lambdaindex;
+    void           *user;
+    gml_env_t      *global;
+    gml_ht_t       *atoms;
+    parse_t        *parse;
+    list_t         *asts;
+    list_t         *chunks;
+    jmp_buf         escape;
+    size_t          lambdaindex;
+    gml_value_t    *stack;
+    gml_value_t    *top;
+    size_t          stacksize;   /* the number of values the stack holds */
+    gml_upvalue_t  *upvalues;    /* open upvalues, topmost first */
+    gml_frame_t    *frames;      /* the call stack, innermost call last */
+    size_t          nframes;
+    size_t          maxframes;
+    size_t          depth;       /* the most frames calls may nest */
+    size_t          nesting;     /* runs of the VM nested inside natives */
+    gml_header_t   *objects;     /* every object on the old heap */
+    size_t          allocated;   /* bytes allocated since the last collection */
+    size_t          threshold;   /* allocated bytes triggering a collection */
+    char           *nursery;
+    char           *nurserytop;
+    gml_vector_t    gray;        /* objects yet to be traversed */
+    gml_vector_t    remembered;  /* old objects which may refer to young ones */
+    gml_vector_t    boxes;       /* closed upvalues which may hold young values */
+    gml_vector_t    young;       /* young objects owning malloc'd memory */
+    gml_value_t    *handles;
+    size_t          nhandles;
+    size_t          maxhandles;
+    gml_value_t     atomnil;     /* the special atoms, interned up front */
+    gml_value_t     atomnone;
+    gml_value_t     atomtrue;
+    gml_value_t     atomfalse;
+    gml_shape_t    *shapes;      /* the shape of records without keys */
+    gml_header_t   *chars[128];  /* the strings of single ASCII runes, made as needed */
+    gml_header_t  **interned;    /* short string literals, open addressed */
+    size_t          ninterned;
+    size_t          maxinterned; /* zero or a power of two */
+    gml_callable_t *callables;   /* roots just like handles */
+};
+
+struct gml_callable_s {
+    gml_callable_t *next;
+    gml_callable_t *prev;
+    gml_value_t     function;
+    size_t          nargs;
+    gml_value_t     args[];
 };
 
-static void gml_abort(gml_state_t *gml) {
+void gml_abort(gml_state_t *gml) {
     longjmp(gml->escape, 1);
 }
 
+/*
+ * Put a new object on the old heap. The size is what the object allocated,
+ * it paces the garbage collector.
+ */
+static void gml_gc_track(gml_state_t *gml, gml_header_t *head, size_t size) {
+    head->flags     = 0;
+    head->next      = gml->objects;
+    gml->objects    = head;
+    gml->allocated += size;
+}
+
+static inline int gml_gc_isyoung(gml_state_t *gml, const void *pointer) {
+    return (const char *)pointer >= gml->nursery && (const char *)pointer < gml->nursery + GML_NURSERY_SIZE;
+}
+
+/*
+ * Allocate a new object. Young objects are allocated in the nursery when
+ * there's room, anything else goes on the old heap. Objects whose address
+ * is held on to by C across calls back into GML (functions, natives and
+ * atoms) must not be young since young objects move.
+ */
+static void *gml_gc_allocate(gml_state_t *gml, size_t size, int young) {
+    size_t aligned = (size + 15) & ~(size_t)15;
+    if (young && gml->nurserytop + aligned <= gml->nursery + GML_NURSERY_SIZE) {
+        gml_header_t *head = (gml_header_t*)gml->nurserytop;
+        gml->nurserytop += aligned;
+        head->flags = 0;
+        head->next  = NULL;
+        return head;
+    }
+    gml_header_t *head = malloc(size);
+    if (head)
+        gml_gc_track(gml, head, size);
+    return head;
+}
+
+/* Free memory which may be inside of the nursery */
+static void gml_gc_free(gml_state_t *gml, void *pointer) {
+    if (!gml_gc_isyoung(gml, pointer))
+        free(pointer);
+}
+
+/* Register a young object which owns memory allocated with malloc */
+static void gml_gc_own(gml_state_t *gml, gml_header_t *head) {
+    if (gml_gc_isyoung(gml, head) && !gml_vector_push(&gml->young, head)) {
+        gml_throw(true, "out of memory registering a young object");
+        gml_abort(gml);
+    }
+}
+
+size_t gml_handle_push(gml_state_t *gml, gml_value_t value) {
+    if (gml->nhandles == gml->maxhandles) {
+        size_t       size    = gml->maxhandles ? gml->maxhandles * 2 : 16;
+        gml_value_t *handles = realloc(gml->handles, sizeof(gml_value_t) * size);
+        if (!handles) {
+            gml_throw(true, "out of memory pushing a handle");
+            gml_abort(gml);
+        }
+        gml->handles    = handles;
+        gml->maxhandles = size;
+    }
+    gml->handles[gml->nhandles] = value;
+    return gml->nhandles++;
+}
+
+gml_value_t gml_handle_get(gml_state_t *gml, size_t handle) {
+    return gml->handles[handle];
+}
+
+void gml_handle_pop(gml_state_t *gml, size_t count) {
+    gml->nhandles -= count;
+}
+
 gml_type_t gml_arg_contract(char c) {
     switch (c) {
         case 'n': return GML_TYPE_NUMBER;
@@ -226,6 +427,7 @@ gml_type_t gml_arg_contract(char c) {
         case 'a': return GML_TYPE_ARRAY;
         case 't': return GML_TYPE_TABLE;
         case 'f': return GML_TYPE_FUNCTION;
+        case 'b': return GML_TYPE_BUFFER;
         case ':': return GML_TYPE_ATOM;
         default:
             return (gml_type_t)-1;
@@ -262,7 +464,23 @@ void gml_arg_check(gml_state_t *gml, gml_value_t *args, size_t nargs, const char
     }
 }
 
+gml_value_t gml_atom_create(gml_state_t *gml, const char *key);
+static gml_shape_t *gml_shape_create(gml_shape_t *parent, gml_value_t key);
+static void gml_shape_destroy(gml_shape_t *shape);
+static void gml_native_name(gml_state_t *gml, gml_value_t native, const char *name);
+
+/* Whether two values are the very same bits, numbers included */
+static inline int gml_value_identical(gml_value_t v1, gml_value_t v2) {
+    union { gml_value_t val; uint64_t u64; } b1 = { .val = v1 }, b2 = { .val = v2 };
+    return b1.u64 == b2.u64;
+}
+
 /* State runtime */
+/* The number of values the operand stack holds for calls nesting depth deep */
+static size_t gml_vm_stacksize(size_t depth) {
+    return depth < GML_VM_STACK / GML_VM_FRAME ? GML_VM_STACK : depth * GML_VM_FRAME;
+}
+
 gml_state_t *gml_state_create(void) {
     gml_state_t *state = malloc(sizeof(*state));
     if (!state)
@@ -272,29 +490,93 @@ gml_state_t *gml_state_create(void) {
     state->atoms       = gml_ht_create(32);
     state->parse       = NULL;
     state->asts        = list_create();
-    state->objects     = list_create();
-    state->classes     = list_create();
+    state->chunks      = list_create();
     state->lambdaindex = 0;
+    state->upvalues    = NULL;
+    state->frames      = NULL;
+    state->nframes     = 0;
+    state->maxframes   = 0;
+    state->depth       = GML_VM_DEPTH;
+    state->nesting     = 0;
+    state->objects     = NULL;
+    state->allocated   = 0;
+    state->threshold   = GML_GC_MINIMUM;
+    state->gray        = (gml_vector_t) { NULL, 0, 0 };
+    state->remembered  = (gml_vector_t) { NULL, 0, 0 };
+    state->boxes       = (gml_vector_t) { NULL, 0, 0 };
+    state->young       = (gml_vector_t) { NULL, 0, 0 };
+    state->handles     = NULL;
+    state->nhandles    = 0;
+    state->maxhandles  = 0;
+    state->shapes      = NULL;
+    memset(state->chars, 0, sizeof(state->chars));
+    state->interned    = NULL;
+    state->ninterned   = 0;
+    state->maxinterned = 0;
+    state->callables   = NULL;
+    state->stacksize   = gml_vm_stacksize(GML_VM_DEPTH);
+    state->stack       = malloc(sizeof(gml_value_t) * state->stacksize);
+    state->nursery     = malloc(GML_NURSERY_SIZE);
+    if (!state->stack || !state->nursery) {
+        gml_state_destroy(state);
+        return NULL;
+    }
+    state->top         = state->stack;
+    state->nurserytop  = state->nursery;
+
+    /* Anything failing to intern from here on returns nil, so it goes first */
+    state->atomnil   = gml_value_box(state, NULL);
+    state->atomnil   = gml_atom_create(state, "nil");
+    state->atomnone  = gml_atom_create(state, "none");
+    state->atomtrue  = gml_atom_create(state, "true");
+    state->atomfalse = gml_atom_create(state, "false");
+    state->shapes    = gml_shape_create(NULL, state->atomnil);
+    if (!gml_value_unbox(state, state->atomnil)
+    ||  gml_value_identical(state->atomnil, state->atomnone)
+    ||  gml_value_identical(state->atomnil, state->atomtrue)
+    ||  gml_value_identical(state->atomnil, state->atomfalse)
+    ||  !state->shapes) {
+        gml_state_destroy(state);
+        return NULL;
+    }
     return state;
 }
 
 void gml_state_destroy(gml_state_t *state) {
     /* Destroy anything not already handled by the GC */
-    list_iterator_t *it = list_iterator_create(state->objects);
-    while (!list_iterator_end(it)) {
-        gml_header_t *head = list_iterator_next(it);
+    for (size_t i = 0; i < state->young.length; i++) {
+        gml_header_t *head = state->young.items[i];
         head->destroy(state, gml_value_box(state, head));
     }
-    list_iterator_destroy(it);
+    while (state->objects) {
+        gml_header_t *head = state->objects;
+        state->objects = head->next;
+        head->destroy(state, gml_value_box(state, head));
+    }
+    gml_shape_destroy(state->shapes);
+    free(state->interned);
     gml_env_destroy(state->global);
     gml_ht_destroy(state->atoms);
-    list_destroy(state->objects);
-    it = list_iterator_create(state->asts);
+    list_iterator_t *it = list_iterator_create(state->asts);
     while (!list_iterator_end(it))
         ast_destroy(list_iterator_next(it));
     list_iterator_destroy(it);
     list_destroy(state->asts);
-    list_destroy(state->classes);
+    it = list_iterator_create(state->chunks);
+    while (!list_iterator_end(it))
+        chunk_destroy(list_iterator_next(it));
+    list_iterator_destroy(it);
+    list_destroy(state->chunks);
+    free(state->stack);
+    free(state->frames);
+    free(state->nursery);
+    free(state->gray.items);
+    free(state->remembered.items);
+    free(state->boxes.items);
+    free(state->young.items);
+    while (state->callables)
+        gml_callable_destroy(state, state->callables);
+    free(state->handles);
     if (state->parse)
         parse_destroy(state->parse);
     free(state);
@@ -308,6 +590,23 @@ void *gml_state_user_get(gml_state_t *gml) {
     return gml->user;
 }
 
+int gml_set_depth(gml_state_t *gml, size_t depth) {
+    size_t       size;
+    gml_value_t *stack;
+
+    /* Open upvalues and natives running point into the stack */
+    if (gml->nframes || gml->top != gml->stack || depth > SIZE_MAX / sizeof(gml_value_t) / GML_VM_FRAME)
+        return 0;
+    size = gml_vm_stacksize(depth);
+    if (!(stack = realloc(gml->stack, sizeof(gml_value_t) * size)))
+        return 0;
+    gml->stack     = stack;
+    gml->top       = stack;
+    gml->stacksize = size;
+    gml->depth     = depth;
+    return 1;
+}
+
 /* NaN boxed value representation of types */
 #define GML_VALUE_BOX_TAG  0x7FF8000000000000U
 #define GML_VALUE_BOX_MASK 0xFFFF000000000000U
@@ -340,15 +639,40 @@ gml_type_t gml_value_typeof(gml_state_t *gml, gml_value_t value) {
     return GML_TYPE_NUMBER;
 }
 
+static inline int gml_gc_isyoungvalue(gml_state_t *gml, gml_value_t value) {
+    gml_value_box_t box = { .val = value };
+    return (box.u64 & GML_VALUE_BOX_MASK) == GML_VALUE_BOX_TAG && gml_gc_isyoung(gml, gml_value_unbox(gml, value));
+}
+
+/*
+ * The write barrier. Storing a young value into an old object remembers
+ * the object so the next minor collection finds the young value.
+ */
+static inline void gml_gc_barrier(gml_state_t *gml, gml_header_t *head, gml_value_t value) {
+    if ((head->flags & GML_GC_REMEMBERED) || !gml_gc_isyoungvalue(gml, value) || gml_gc_isyoung(gml, head))
+        return;
+    if (!gml_vector_push(&gml->remembered, head)) {
+        gml_throw(true, "out of memory remembering an object");
+        gml_abort(gml);
+    }
+    head->flags |= GML_GC_REMEMBERED;
+}
+
+/* Closed upvalues aren't objects but need the write barrier all the same */
+static inline void gml_gc_barrier_box(gml_state_t *gml, gml_upvalue_t *upvalue) {
+    if (upvalue->remembered || upvalue->location != &upvalue->value || !gml_gc_isyoungvalue(gml, upvalue->value))
+        return;
+    if (!gml_vector_push(&gml->boxes, upvalue)) {
+        gml_throw(true, "out of memory remembering an upvalue");
+        gml_abort(gml);
+    }
+    upvalue->remembered = 1;
+}
+
 /* Registration of globals and native functions */
 void gml_set_global(gml_state_t *gml, const char *name, gml_value_t value) {
     gml_value_t *oldp;
     if (gml_env_lookup(gml->global, name, &oldp)) {
-        if (gml_value_typeof(gml, *oldp) != GML_TYPE_NUMBER) {
-            gml_header_t *head = gml_value_unbox(gml, *oldp);
-            head->destroy(gml, *oldp);
-            list_erase(gml->objects, head);
-        }
         *oldp = value;
     } else {
         gml_env_bind(gml->global, name, value);
@@ -357,14 +681,97 @@ void gml_set_global(gml_state_t *gml, const char *name, gml_value_t value) {
 
 void gml_set_native(gml_state_t *gml, const char *name, gml_native_func_t func, int min, int max) {
     gml_value_t value = gml_native_create(gml, func, min, max);
+    if (gml_value_typeof(gml, value) == GML_TYPE_NATIVE)
+        gml_native_name(gml, value, name);
     gml_set_global(gml, name, value);
 }
 
+/*
+ * Hashing after wyhash. Input is consumed eight bytes at a time, folding
+ * pairs of words together with a 64 by 64 bit multiplication whose high
+ * and low halves are mixed. Inputs of up to sixteen bytes, most keys, are
+ * read with a few overlapping loads and no loop at all.
+ */
+#define GML_HASH_SECRET0 0xA0761D6478BD642FU
+#define GML_HASH_SECRET1 0xE7037ED1A0B428DBU
+#define GML_HASH_SECRET2 0x8EBC6AF09C88C6E3U
+#define GML_HASH_SECRET3 0x589965CC75374CC3U
+
+static inline uint64_t gml_hash_mix(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+    __uint128_t product = (__uint128_t)a * b;
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+#else
+    uint64_t ha = a >> 32, la = (uint32_t)a;
+    uint64_t hb = b >> 32, lb = (uint32_t)b;
+    uint64_t hh = ha * hb, hl = ha * lb, lh = la * hb, ll = la * lb;
+    uint64_t t  = ll + (hl << 32);
+    uint64_t lo = t + (lh << 32);
+    uint64_t hi = hh + (hl >> 32) + (lh >> 32) + (t < ll) + (lo < t);
+    return lo ^ hi;
+#endif
+}
+
+static inline uint64_t gml_hash_read8(const uint8_t *p) {
+    uint64_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+static inline uint64_t gml_hash_read4(const uint8_t *p) {
+    uint32_t word;
+    memcpy(&word, p, sizeof(word));
+    return word;
+}
+
+static uint64_t gml_hash_bytes(const void *data, size_t length) {
+    const uint8_t *p    = data;
+    uint64_t       seed = gml_hash_mix(GML_HASH_SECRET0, GML_HASH_SECRET1);
+    uint64_t       a;
+    uint64_t       b;
+
+    if (length <= 16) {
+        if (length >= 4) {
+            size_t skip = (length >> 3) << 2;
+            a = (gml_hash_read4(p) << 32) | gml_hash_read4(p + skip);
+            b = (gml_hash_read4(p + length - 4) << 32) | gml_hash_read4(p + length - 4 - skip);
+        } else if (length > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[length >> 1] << 8) | p[length - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t left = length;
+        if (left > 48) {
+            uint64_t seed1 = seed;
+            uint64_t seed2 = seed;
+            do {
+                seed  = gml_hash_mix(gml_hash_read8(p)      ^ GML_HASH_SECRET1, gml_hash_read8(p + 8)  ^ seed);
+                seed1 = gml_hash_mix(gml_hash_read8(p + 16) ^ GML_HASH_SECRET2, gml_hash_read8(p + 24) ^ seed1);
+                seed2 = gml_hash_mix(gml_hash_read8(p + 32) ^ GML_HASH_SECRET3, gml_hash_read8(p + 40) ^ seed2);
+                p    += 48;
+                left -= 48;
+            } while (left > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (left > 16) {
+            seed  = gml_hash_mix(gml_hash_read8(p) ^ GML_HASH_SECRET1, gml_hash_read8(p + 8) ^ seed);
+            p    += 16;
+            left -= 16;
+        }
+        a = gml_hash_read8(p + left - 16);
+        b = gml_hash_read8(p + left - 8);
+    }
+    return gml_hash_mix(GML_HASH_SECRET1 ^ length, gml_hash_mix(a ^ GML_HASH_SECRET1, b ^ seed));
+}
+
 /* Runtime atom */
 typedef struct {
     gml_header_t header;
     size_t       length;
     char        *key;
+    uint64_t     hash;
 } gml_atom_t;
 
 void gml_atom_destroy(gml_state_t *gml, gml_value_t value) {
@@ -386,8 +793,9 @@ gml_value_t gml_atom_create(gml_state_t *gml, const char *key) {
     atom->header.destroy = &gml_atom_destroy;
     atom->length         = length;
     atom->key            = strdup(key);
+    atom->hash           = gml_hash_bytes(key, length);
     gml_ht_insert(gml->atoms, key, atom);
-    list_push(gml->objects, atom);
+    gml_gc_track(gml, &atom->header, sizeof(*atom) + length + 1);
     return gml_value_box(gml, (gml_header_t*)atom);
 }
 
@@ -400,6 +808,12 @@ const char *gml_atom_key(gml_state_t *gml, gml_value_t value) {
 }
 
 /* Runtime array */
+/*
+ * The elements of an array are allocated along with it. Arrays growing
+ * past their capacity move their elements to memory of their own, at
+ * least doubling the capacity so appending is amortized constant time.
+ */
+#define GML_ARRAY_MINIMUM 8
 typedef struct {
     gml_header_t header;
     gml_value_t *elements;
@@ -407,46 +821,55 @@ typedef struct {
     size_t       capacity;
 } gml_array_t;
 
+static inline int gml_array_isinline(gml_array_t *array) {
+    return array->elements == (gml_value_t*)(array + 1);
+}
+
 void gml_array_destroy(gml_state_t *gml, gml_value_t value) {
     gml_array_t *array = (gml_array_t*)gml_value_unbox(gml, value);
-    free(array->elements);
-    free(array);
+    if (!gml_array_isinline(array))
+        free(array->elements);
+    gml_gc_free(gml, array);
 }
 
-gml_value_t gml_array_create(gml_state_t *gml, gml_value_t *elements, size_t length) {
-    gml_array_t *array = malloc(sizeof(*array));
+static gml_array_t *gml_array_allocate(gml_state_t *gml, size_t length, int young) {
+    gml_array_t *array = gml_gc_allocate(gml, sizeof(*array) + sizeof(gml_value_t) * length, young);
     if (!array)
-        return gml_nil_create(gml);
-    if (!(array->elements = malloc(sizeof(gml_value_t) * length))) {
-        free(array);
-        return gml_nil_create(gml);
-    }
+        return NULL;
     array->header.type    = GML_TYPE_ARRAY;
     array->header.destroy = &gml_array_destroy;
+    array->elements       = (gml_value_t*)(array + 1);
+    array->length         = length;
+    array->capacity       = length;
+    return array;
+}
+
+/* An array which didn't fit in the nursery may start out holding young values */
+static void gml_array_barrier(gml_state_t *gml, gml_array_t *array) {
+    if (gml_gc_isyoung(gml, array))
+        return;
+    for (size_t i = 0; i < array->length; i++)
+        gml_gc_barrier(gml, &array->header, array->elements[i]);
+}
+
+gml_value_t gml_array_create(gml_state_t *gml, gml_value_t *elements, size_t length) {
+    gml_array_t *array = gml_array_allocate(gml, length, 1);
+    if (!array)
+        return gml_nil_create(gml);
     memcpy(array->elements, elements, sizeof(gml_value_t) * length);
-    array->length   = length;
-    array->capacity = length;
-    list_push(gml->objects, array);
+    gml_array_barrier(gml, array);
     return gml_value_box(gml, (gml_header_t*)array);
 }
 
 gml_value_t gml_array_create_cat(gml_state_t *gml, gml_value_t a1, gml_value_t a2) {
     gml_array_t *array1 = (gml_array_t*)gml_value_unbox(gml, a1);
     gml_array_t *array2 = (gml_array_t*)gml_value_unbox(gml, a2);
-    gml_array_t *array  = malloc(sizeof(*array));
+    gml_array_t *array  = gml_array_allocate(gml, array1->length + array2->length, 1);
     if (!array)
         return gml_nil_create(gml);
-    if (!(array->elements = malloc(sizeof(gml_value_t) * (array1->length + array2->length)))) {
-        free(array);
-        return gml_nil_create(gml);
-    }
-    array->header.type    = GML_TYPE_ARRAY;
-    array->header.destroy = &gml_array_destroy;
     memcpy(array->elements, array1->elements, sizeof(gml_value_t) * array1->length);
     memcpy(&array->elements[array1->length], array2->elements, sizeof(gml_value_t) * array2->length);
-    array->length   = array1->length + array2->length;
-    array->capacity = array->length;
-    list_push(gml->objects, array);
+    gml_array_barrier(gml, array);
     return gml_value_box(gml, (gml_header_t*)array);
 }
 
@@ -459,37 +882,189 @@ gml_value_t gml_array_get(gml_state_t *gml, gml_value_t array, size_t index) {
 }
 
 void gml_array_set(gml_state_t *gml, gml_value_t array, size_t index, gml_value_t value) {
-    ((gml_array_t*)gml_value_unbox(gml, array))->elements[index] = value;
+    gml_array_t *unbox = (gml_array_t*)gml_value_unbox(gml, array);
+    gml_gc_barrier(gml, &unbox->header, value);
+    unbox->elements[index] = value;
 }
 
-/* Runtime function */
+int gml_array_reserve(gml_state_t *gml, gml_value_t value, size_t capacity) {
+    gml_array_t *array = (gml_array_t*)gml_value_unbox(gml, value);
+    gml_value_t *elements;
+    if (capacity <= array->capacity)
+        return 1;
+    if (capacity > SIZE_MAX / sizeof(gml_value_t))
+        return 0;
+    if (gml_array_isinline(array)) {
+        if (!(elements = malloc(sizeof(gml_value_t) * capacity)))
+            return 0;
+        memcpy(elements, array->elements, sizeof(gml_value_t) * array->length);
+        gml_gc_own(gml, &array->header);
+    } else if (!(elements = realloc(array->elements, sizeof(gml_value_t) * capacity))) {
+        return 0;
+    }
+    gml->allocated += sizeof(gml_value_t) * (capacity - array->capacity);
+    array->elements = elements;
+    array->capacity = capacity;
+    return 1;
+}
+
+/* Make room for more elements, growing geometrically */
+static int gml_array_grow(gml_state_t *gml, gml_value_t value, size_t more) {
+    gml_array_t *array    = (gml_array_t*)gml_value_unbox(gml, value);
+    size_t       capacity = array->capacity * 2;
+    if (array->length + more <= array->capacity)
+        return 1;
+    if (more > SIZE_MAX / sizeof(gml_value_t) - array->length)
+        return 0;
+    if (capacity < array->length + more)
+        capacity = array->length + more;
+    if (capacity < GML_ARRAY_MINIMUM)
+        capacity = GML_ARRAY_MINIMUM;
+    return gml_array_reserve(gml, value, capacity);
+}
+
+int gml_array_push(gml_state_t *gml, gml_value_t array, gml_value_t value) {
+    return gml_array_insert(gml, array, gml_array_length(gml, array), value);
+}
+
+gml_value_t gml_array_pop(gml_state_t *gml, gml_value_t array) {
+    size_t length = gml_array_length(gml, array);
+    if (length == 0)
+        return gml_nil_create(gml);
+    return gml_array_remove(gml, array, length - 1);
+}
+
+int gml_array_insert(gml_state_t *gml, gml_value_t array, size_t index, gml_value_t value) {
+    gml_array_t *unbox;
+    if (!gml_array_grow(gml, array, 1))
+        return 0;
+    unbox = (gml_array_t*)gml_value_unbox(gml, array);
+    memmove(&unbox->elements[index + 1], &unbox->elements[index], sizeof(gml_value_t) * (unbox->length - index));
+    unbox->length++;
+    gml_array_set(gml, array, index, value);
+    return 1;
+}
+
+gml_value_t gml_array_remove(gml_state_t *gml, gml_value_t array, size_t index) {
+    gml_array_t *unbox = (gml_array_t*)gml_value_unbox(gml, array);
+    gml_value_t  value = unbox->elements[index];
+    memmove(&unbox->elements[index], &unbox->elements[index + 1], sizeof(gml_value_t) * (unbox->length - index - 1));
+    unbox->length--;
+    return value;
+}
+
+gml_value_t gml_array_slice(gml_state_t *gml, gml_value_t array, size_t start, size_t length) {
+    return gml_array_create(gml, ((gml_array_t*)gml_value_unbox(gml, array))->elements + start, length);
+}
+
+/*
+ * Runtime buffer. The data of a buffer is aligned for the widest vector
+ * instructions the numeric kernels use.
+ */
+#define GML_BUFFER_ALIGN 32
+
 typedef struct {
-    gml_header_t header;
-    char        *name;
-    list_t      *formals;
-    list_t      *body;
-    void        *env;
-} gml_function_t;
+    gml_header_t      header;
+    gml_buffer_kind_t kind;
+    size_t            length;
+    void             *data;
+} gml_buffer_t;
+
+static inline size_t gml_buffer_width(gml_buffer_kind_t kind) {
+    return kind == GML_BUFFER_F32 ? sizeof(float) : sizeof(double);
+}
+
+void gml_buffer_destroy(gml_state_t *gml, gml_value_t value) {
+    gml_buffer_t *buffer = (gml_buffer_t*)gml_value_unbox(gml, value);
+    free(buffer->data);
+    gml_gc_free(gml, buffer);
+}
+
+gml_value_t gml_buffer_create(gml_state_t *gml, gml_buffer_kind_t kind, size_t length) {
+    size_t        size = gml_buffer_width(kind) * (length ? length : 1);
+    void         *data;
+    gml_buffer_t *buffer;
+    if (length > SIZE_MAX / gml_buffer_width(kind))
+        return gml_nil_create(gml);
+    if (posix_memalign(&data, GML_BUFFER_ALIGN, size))
+        return gml_nil_create(gml);
+    if (!(buffer = gml_gc_allocate(gml, sizeof(*buffer), 1))) {
+        free(data);
+        return gml_nil_create(gml);
+    }
+    memset(data, 0, size);
+    buffer->header.type    = GML_TYPE_BUFFER;
+    buffer->header.destroy = &gml_buffer_destroy;
+    buffer->kind           = kind;
+    buffer->length         = length;
+    buffer->data           = data;
+
+    gml->allocated += size;
+    gml_gc_own(gml, &buffer->header);
+    return gml_value_box(gml, (gml_header_t*)buffer);
+}
+
+gml_buffer_kind_t gml_buffer_kind(gml_state_t *gml, gml_value_t buffer) {
+    return ((gml_buffer_t*)gml_value_unbox(gml, buffer))->kind;
+}
+
+size_t gml_buffer_length(gml_state_t *gml, gml_value_t buffer) {
+    return ((gml_buffer_t*)gml_value_unbox(gml, buffer))->length;
+}
+
+void *gml_buffer_data(gml_state_t *gml, gml_value_t buffer) {
+    return ((gml_buffer_t*)gml_value_unbox(gml, buffer))->data;
+}
+
+double gml_buffer_get(gml_state_t *gml, gml_value_t value, size_t index) {
+    gml_buffer_t *buffer = (gml_buffer_t*)gml_value_unbox(gml, value);
+    if (buffer->kind == GML_BUFFER_F32)
+        return ((float*)buffer->data)[index];
+    return ((double*)buffer->data)[index];
+}
+
+void gml_buffer_set(gml_state_t *gml, gml_value_t value, size_t index, double number) {
+    gml_buffer_t *buffer = (gml_buffer_t*)gml_value_unbox(gml, value);
+    if (buffer->kind == GML_BUFFER_F32)
+        ((float*)buffer->data)[index] = (float)number;
+    else
+        ((double*)buffer->data)[index] = number;
+}
+
+/* Runtime function */
+struct gml_function_s {
+    gml_header_t   header;
+    char          *name;
+    chunk_t       *chunk;
+    gml_header_t  *self;     /* the class table of a bound method */
+    gml_upvalue_t *upvalues[];
+};
 
 void gml_function_destroy(gml_state_t *gml, gml_value_t value) {
     gml_function_t *function = (gml_function_t*)gml_value_unbox(gml, value);
+    for (size_t i = 0; i < function->chunk->nupvalues; i++) {
+        gml_upvalue_t *upvalue = function->upvalues[i];
+        /* Open upvalues are freed when they get closed */
+        if (--upvalue->refs == 0 && upvalue->location == &upvalue->value)
+            free(upvalue);
+    }
     free(function->name);
     free(function);
 }
 
-gml_value_t gml_function_create(gml_state_t *gml, const char *name, list_t *formals, list_t *body, gml_env_t *env) {
-    gml_function_t *fun = malloc(sizeof(*fun));
+/* The upvalues of the function are filled in by the caller */
+gml_value_t gml_function_create(gml_state_t *gml, const char *name, chunk_t *chunk) {
+    gml_function_t *fun = malloc(sizeof(*fun) + sizeof(gml_upvalue_t*) * chunk->nupvalues);
     if (!fun)
         return gml_nil_create(gml);
 
     fun->header.type    = GML_TYPE_FUNCTION;
     fun->header.destroy = &gml_function_destroy;
     fun->name           = strdup(name);
-    fun->formals        = formals;
-    fun->body           = body;
-    fun->env            = env;
+    fun->chunk          = chunk;
+    fun->self           = NULL;
 
-    list_push(gml->objects, fun);
+    gml_gc_track(gml, &fun->header, sizeof(*fun) + sizeof(gml_upvalue_t*) * chunk->nupvalues);
     return gml_value_box(gml, (gml_header_t*)fun);
 }
 
@@ -498,15 +1073,28 @@ const char *gml_function_name(gml_state_t *gml, gml_value_t fun) {
 }
 
 list_t *gml_function_formals(gml_state_t *gml, gml_value_t fun) {
-    return ((gml_function_t*)gml_value_unbox(gml, fun))->formals;
-}
-
-list_t *gml_function_body(gml_state_t *gml, gml_value_t fun) {
-    return ((gml_function_t*)gml_value_unbox(gml, fun))->body;
+    return ((gml_function_t*)gml_value_unbox(gml, fun))->chunk->formals;
 }
 
-static gml_env_t *gml_function_env(gml_state_t *gml, gml_value_t fun) {
-    return ((gml_function_t*)gml_value_unbox(gml, fun))->env;
+/*
+ * Bind a method to the class it was taken from. The method may be shared
+ * by other classes, so the bound method is a function of its own sharing
+ * the chunk and upvalues of the method.
+ */
+static gml_value_t gml_function_bind(gml_state_t *gml, gml_value_t fun, gml_value_t self) {
+    gml_function_t *method = (gml_function_t*)gml_value_unbox(gml, fun);
+    gml_value_t     value  = gml_function_create(gml, method->name, method->chunk);
+    if (gml_value_typeof(gml, value) != GML_TYPE_FUNCTION)
+        return value;
+
+    gml_function_t *bound = (gml_function_t*)gml_value_unbox(gml, value);
+    for (size_t i = 0; i < method->chunk->nupvalues; i++) {
+        bound->upvalues[i] = method->upvalues[i];
+        bound->upvalues[i]->refs++;
+    }
+    gml_gc_barrier(gml, &bound->header, self);
+    bound->self = gml_value_unbox(gml, self);
+    return value;
 }
 
 /* Native FFI runtime */
@@ -514,11 +1102,16 @@ typedef struct {
     gml_header_t      header;
     gml_native_func_t func;
     int               min;
-    int               max;
+    int               max;      /* negative for any number of arguments past min */
+    char             *name;     /* NULL unless bound by gml_set_native */
+    size_t            typed;    /* how many arguments the contract covers */
+    uint64_t          contract; /* a byte per argument, bit t set if it takes type t */
 } gml_native_t;
 
 void gml_native_destroy(gml_state_t *gml, gml_value_t value) {
-    free(gml_value_unbox(gml, value));
+    gml_native_t *native = (gml_native_t*)gml_value_unbox(gml, value);
+    free(native->name);
+    free(native);
 }
 
 gml_value_t gml_native_create(gml_state_t *gml, gml_native_func_t func, int min, int max) {
@@ -531,8 +1124,11 @@ gml_value_t gml_native_create(gml_state_t *gml, gml_native_func_t func, int min,
     native->func           = func;
     native->min            = min;
     native->max            = max;
+    native->name           = NULL;
+    native->typed          = 0;
+    native->contract       = 0;
 
-    list_push(gml->objects, native);
+    gml_gc_track(gml, &native->header, sizeof(*native));
     return gml_value_box(gml, (gml_header_t*)native);
 }
 
@@ -540,162 +1136,624 @@ gml_native_func_t gml_native_func(gml_state_t *gml, gml_value_t func) {
     return ((gml_native_t*)gml_value_unbox(gml, func))->func;
 }
 
-/* Runtime string */
-static size_t gml_string_rune_size(gml_string_rune_t rune) {
-    if      (rune >  0x10FFFF) return 0;
-    else if (rune >= 0x10000)  return 4;
-    else if (rune >= 0x800)    return 3;
-    else if (rune >= 0x80)     return 2;
-    return 1;
+/* Names a native for its diagnostics, which do without if out of memory */
+static void gml_native_name(gml_state_t *gml, gml_value_t value, const char *name) {
+    ((gml_native_t*)gml_value_unbox(gml, value))->name = strdup(name);
 }
 
-static uint8_t *gml_string_encode(gml_string_rune_t *runes, size_t nrunes, uint8_t *u) {
-    for (size_t i = 0; i < nrunes; i++) {
-        gml_string_rune_t rune = runes[i];
-        unsigned n = gml_string_rune_size(rune);
-        if (n == 0) {
-            return NULL;
-        } else if (n == 1) {
-            *u++ = (uint8_t)rune;
-            continue;
-        }
-        for (unsigned k = n; k > 1; k--) {
-            *(u + k - 1) = 0x80 | (rune & 0x3F);
-            rune >>= 6;
-        }
-        *u = ~(0xFF >> n) | ((uint8_t)rune & (0x7F >> n));
-        u += n;
+/*
+ * A contract of n characters compiles to n bytes, one per argument, of
+ * the types the argument may have. Checking an argument is then a shift
+ * and a mask rather than going through the contract string.
+ */
+#define GML_NATIVE_CONTRACT 8
+
+static int gml_native_contract(gml_native_t *native, const char *contract) {
+    size_t   count = strlen(contract);
+    uint64_t mask  = 0;
+    if (count > GML_NATIVE_CONTRACT)
+        return 0;
+    for (size_t i = 0; i < count; i++) {
+        gml_type_t type = gml_arg_contract(contract[i]);
+        if (type == (gml_type_t)-1)
+            return 0;
+        mask |= (uint64_t)(1u << type) << (8 * i);
     }
-    *u = 0;
-    return u;
+    native->typed    = count;
+    native->contract = mask;
+    return 1;
 }
 
-static size_t gml_string_encoded_length(gml_string_rune_t *runes, size_t nrunes) {
-    size_t n = 0;
-    for (; nrunes; nrunes--)
-        n += gml_string_rune_size(*runes++);
-    return n;
+static inline int gml_native_accepts(gml_state_t *gml, gml_native_t *native, gml_value_t *args, size_t nargs) {
+    if (nargs < (size_t)native->min || (native->max >= 0 && nargs > (size_t)native->max))
+        return 0;
+    for (size_t i = 0; i < native->typed; i++)
+        if (!((native->contract >> (8 * i)) & (1u << gml_value_typeof(gml, args[i]))))
+            return 0;
+    return 1;
 }
 
-static gml_string_rune_t *gml_string_decode(const uint8_t *u, gml_string_rune_t *runes, size_t *nrunes) {
-    gml_string_rune_t rune = 0;
-    *nrunes = 0;
-    while (*u) {
-        if (*u >= 0xC0) {
-            unsigned n = 0;
-            while (*u & (0x80 >> n))
-                n++;
-            rune = *u++ & (0xFF >> n);
-            for (; n > 1; n--) {
-                if ((*u & 0xC0) != 0x80)
-                    return NULL;
-                rune = (rune << 6) | (*u++ & 0x3F);
+/* Why a native didn't accept its arguments */
+static void gml_native_reject(gml_state_t *gml, gml_native_t *native, gml_value_t *args, size_t nargs, char *message, size_t size) {
+    const char *name = native->name ? native->name : "native";
+    if (nargs >= (size_t)native->min && (native->max < 0 || nargs <= (size_t)native->max)) {
+        for (size_t i = 0; i < native->typed; i++) {
+            unsigned   types = (native->contract >> (8 * i)) & 0xFF;
+            gml_type_t type  = gml_value_typeof(gml, args[i]);
+            if (!(types & (1u << type))) {
+                snprintf(message, size, "incompatible type `%s' in passing argument `%zu' of `%s', expected type `%s'",
+                    gml_typename(gml, type),
+                    i + 1,
+                    name,
+                    gml_typename(gml, (gml_type_t)__builtin_ctz(types))
+                );
+                return;
             }
-        } else {
-            rune = (gml_string_rune_t)*u++;
         }
-        runes[(*nrunes)++] = rune;
     }
-    return runes;
+    if (native->max < 0)
+        snprintf(message, size, "function `%s' expects at least %d arguments, got %zu", name, native->min, nargs);
+    else if (native->min == native->max && native->min == 0)
+        snprintf(message, size, "function `%s' expects no arguments, got %zu", name, nargs);
+    else if (native->min == native->max && native->min == 1)
+        snprintf(message, size, "function `%s' expects an argument, got %zu", name, nargs);
+    else if (native->min == native->max)
+        snprintf(message, size, "function `%s' expects %d arguments, got %zu", name, native->min, nargs);
+    else
+        snprintf(message, size, "function `%s' expects %d to %d arguments, got %zu", name, native->min, native->max, nargs);
+}
+
+int gml_set_native_contract(gml_state_t *gml, const char *name, gml_native_func_t func, const char *contract) {
+    gml_value_t value = gml_native_create(gml, func, (int)strlen(contract), (int)strlen(contract));
+    if (gml_value_typeof(gml, value) != GML_TYPE_NATIVE)
+        return 0;
+    /* The native trusts its contract, so it mustn't be callable without it */
+    if (!gml_native_contract((gml_native_t*)gml_value_unbox(gml, value), contract)) {
+        gml_throw(true, "invalid contract `%s' for native `%s'", contract, name);
+        return 0;
+    }
+    gml_native_name(gml, value, name);
+    gml_set_global(gml, name, value);
+    return 1;
 }
 
+/*
+ * Runtime string. Strings keep their characters as UTF-8 along with how
+ * many runes that is. A string of only ASCII runes is subscripted by byte.
+ * Any other string builds an index of the byte offset of every
+ * GML_STRING_STRIDE'th rune the first time it's subscripted past the
+ * first stride, so finding a rune only ever decodes part of a stride.
+ *
+ * Concatenating strings of GML_STRING_ROPE bytes or more makes a rope, a
+ * string without data of its own referencing the two strings it joins.
+ * Ropes are flattened into data the first time their characters are
+ * needed, so building a string piece by piece copies every piece once.
+ *
+ * A substring is a slice, a string whose data is part of the data of the
+ * string it was taken from, its base, which it keeps alive. Substrings of
+ * fewer than GML_STRING_SLICE bytes are copied instead, as are substrings
+ * too small a part of their base to be worth keeping all of it around.
+ * Single ASCII runes are made once per state and shared. Slices don't end
+ * in a NUL so the first time their data is handed out as a C string they
+ * copy it after all.
+ *
+ * String literals of up to GML_STRING_INTERN bytes are interned, every
+ * evaluation of equal literals yielding the same string, so comparing
+ * them and looking them up as keys mostly compares pointers. The intern
+ * table doesn't keep its strings alive, the code they're literals of
+ * does, and the major collection drops the ones which weren't marked.
+ */
+#define GML_STRING_STRIDE 32
+#define GML_STRING_ROPE   256
+#define GML_STRING_SLICE  32
+#define GML_STRING_SHARE  8   /* slices are at least this part of their base */
+#define GML_STRING_INTERN 32
+
 typedef struct {
-    gml_header_t       header;
-    size_t             length;
-    gml_string_rune_t *runes;
+    gml_header_t header;
+    size_t       length;  /* in runes */
+    size_t       size;    /* in bytes, not counting the terminating NUL */
+    char        *data;    /* NULL for a rope not yet flattened */
+    size_t      *index;   /* NULL until a subscript needs it */
+    gml_value_t  left;    /* the strings a rope joins while data is NULL */
+    gml_value_t  right;
+    gml_header_t *base;   /* the string a slice shares the data of */
+    size_t       depth;   /* how many ropes deep the rope is */
+    uint64_t     hash;    /* zero until the string is first hashed */
+    int          ascii;   /* whether every rune is a single byte */
 } gml_string_t;
 
+static inline int gml_string_isrope(gml_string_t *string) {
+    return string->data == NULL;
+}
+
+/* The bytes of the rune starting with a lead byte */
+static size_t gml_string_width(uint8_t lead) {
+    size_t n = 1;
+    if (lead >= 0xC0)
+        while (n < 8 && (lead & (0x80 >> n)))
+            n++;
+    return n;
+}
+
+/* Count the runes of UTF-8 data, failing when it's malformed */
+static int gml_string_scan(const char *data, size_t size, size_t *length, int *ascii) {
+    const uint8_t *u   = (const uint8_t*)data;
+    const uint8_t *end = u + size;
+    *length = 0;
+    *ascii  = 1;
+    while (u < end) {
+        size_t n = gml_string_width(*u);
+        if (*u >= 0x80)
+            *ascii = 0;
+        if (n > (size_t)(end - u))
+            return 0;
+        for (size_t k = 1; k < n; k++)
+            if ((u[k] & 0xC0) != 0x80)
+                return 0;
+        u += n;
+        (*length)++;
+    }
+    return 1;
+}
+
 void gml_string_destroy(gml_state_t *gml, gml_value_t value) {
     gml_string_t *string = (gml_string_t*)gml_value_unbox(gml, value);
-    free(string->runes);
-    free(string);
+    if (!string->base)
+        free(string->data);
+    free(string->index);
+    gml_gc_free(gml, string);
 }
 
-static gml_value_t gml_string_from_runes(gml_state_t *gml, gml_string_rune_t *runes, size_t nrunes) {
-    gml_string_t *string = malloc(sizeof(*string));
+/* An empty string for the caller to fill in and register with gml_gc_own */
+static gml_string_t *gml_string_allocate(gml_state_t *gml, int young) {
+    gml_string_t *string = gml_gc_allocate(gml, sizeof(*string), young);
     if (!string)
-        return gml_nil_create(gml);
+        return NULL;
 
     string->header.type    = GML_TYPE_STRING;
     string->header.destroy = &gml_string_destroy;
-    string->length         = nrunes;
-    string->runes          = runes;
+    string->length         = 0;
+    string->size           = 0;
+    string->data           = NULL;
+    string->index          = NULL;
+    string->left           = gml_nil_create(gml);
+    string->right          = gml_nil_create(gml);
+    string->base           = NULL;
+    string->depth          = 0;
+    string->hash           = 0;
+    string->ascii          = 1;
+    return string;
+}
+
+/* Make a string of NUL terminated UTF-8 data, taking ownership of it */
+static gml_value_t gml_string_from_data(gml_state_t *gml, char *data, size_t size, size_t length, int ascii) {
+    gml_string_t *string = gml_string_allocate(gml, 1);
+    if (!string) {
+        free(data);
+        return gml_nil_create(gml);
+    }
 
-    list_push(gml->objects, string);
+    string->length  = length;
+    string->size    = size;
+    string->data    = data;
+    string->ascii   = ascii;
+    gml->allocated += size + 1;
+    gml_gc_own(gml, &string->header);
     return gml_value_box(gml, (gml_header_t*)string);
 }
 
 gml_value_t gml_string_create(gml_state_t *gml, const char *string) {
-    size_t             length = strlen(string);
-    gml_string_rune_t *runes  = malloc(sizeof(gml_string_rune_t) * length);
-    size_t             nrunes = 0;
-    if (!runes)
+    size_t size = strlen(string);
+    size_t length;
+    int    ascii;
+    char  *data;
+    if (!gml_string_scan(string, size, &length, &ascii))
         return gml_nil_create(gml);
-    if (!gml_string_decode((uint8_t*)string, runes, &nrunes)) {
-        free(runes);
+    if (!(data = malloc(size + 1)))
         return gml_nil_create(gml);
-    }
-    /* Allow empty strings */
-    if (nrunes != 0) {
-        if (!(runes = realloc(runes, nrunes * sizeof(gml_string_rune_t)))) {
-            free(runes);
-            return gml_nil_create(gml);
-        }
-    }
-    return gml_string_from_runes(gml, runes, nrunes);
+    memcpy(data, string, size + 1);
+    return gml_string_from_data(gml, data, size, length, ascii);
 }
 
-gml_value_t gml_string_create_cat(gml_state_t *gml, const char *str1, const char *str2) {
-    size_t             length  = strlen(str1) + strlen(str2);
-    gml_string_rune_t *runes   = malloc(sizeof(gml_string_rune_t) * length);
-    size_t             nrunesa = 0;
-    size_t             nrunesb = 0;
-    if (!runes)
-        return gml_nil_create(gml);
-    if (!gml_string_decode((uint8_t*)str1, runes, &nrunesa)) {
-        free(runes);
+static gml_value_t gml_string_rope(gml_state_t *gml, gml_string_t *left, gml_string_t *right) {
+    gml_string_t *string = gml_string_allocate(gml, 1);
+    if (!string)
         return gml_nil_create(gml);
+
+    string->length = left->length + right->length;
+    string->size   = left->size + right->size;
+    string->left   = gml_value_box(gml, &left->header);
+    string->right  = gml_value_box(gml, &right->header);
+    string->depth  = (left->depth > right->depth ? left->depth : right->depth) + 1;
+    string->ascii  = left->ascii && right->ascii;
+
+    /* A rope which didn't fit in the nursery may start out joining young strings */
+    gml_gc_barrier(gml, &string->header, string->left);
+    gml_gc_barrier(gml, &string->header, string->right);
+    gml_gc_own(gml, &string->header);
+    return gml_value_box(gml, (gml_header_t*)string);
+}
+
+/*
+ * Copy the pieces of a rope into data of its own, walking the ropes it
+ * joins left to right with a stack of the right halves still to copy.
+ * Ropes are as deep as the strings built piece by piece are long so the
+ * walk doesn't recurse.
+ */
+static char *gml_string_flatten(gml_state_t *gml, gml_string_t *string) {
+    gml_string_t **stack;
+    gml_string_t  *piece  = string;
+    size_t         depth  = 0;
+    size_t         offset = 0;
+    char          *data;
+
+    if (!gml_string_isrope(string))
+        return string->data;
+    data  = malloc(string->size + 1);
+    stack = malloc(sizeof(gml_string_t*) * string->depth);
+    if (!data || !stack) {
+        gml_throw(true, "out of memory flattening a string");
+        gml_abort(gml);
+    }
+
+    for (;;) {
+        while (gml_string_isrope(piece)) {
+            stack[depth++] = (gml_string_t*)gml_value_unbox(gml, piece->right);
+            piece          = (gml_string_t*)gml_value_unbox(gml, piece->left);
+        }
+        memcpy(data + offset, piece->data, piece->size);
+        offset += piece->size;
+        if (depth == 0)
+            break;
+        piece = stack[--depth];
     }
-    if (!gml_string_decode((uint8_t*)str2, &runes[nrunesa], &nrunesb)) {
-        free(runes);
+    data[offset] = '\0';
+    free(stack);
+
+    /* The pieces aren't needed anymore and can be collected */
+    string->data    = data;
+    string->left    = gml_nil_create(gml);
+    string->right   = gml_nil_create(gml);
+    string->depth   = 0;
+    gml->allocated += string->size + 1;
+    return data;
+}
+
+gml_value_t gml_string_create_cat(gml_state_t *gml, gml_value_t s1, gml_value_t s2) {
+    gml_string_t *string1 = (gml_string_t*)gml_value_unbox(gml, s1);
+    gml_string_t *string2 = (gml_string_t*)gml_value_unbox(gml, s2);
+    size_t        size    = string1->size + string2->size;
+    char         *data;
+
+    /* Strings don't change so either one is the concatenation with nothing */
+    if (string2->size == 0)
+        return s1;
+    if (string1->size == 0)
+        return s2;
+    if (size >= GML_STRING_ROPE)
+        return gml_string_rope(gml, string1, string2);
+
+    if (!(data = malloc(size + 1)))
         return gml_nil_create(gml);
+    memcpy(data, gml_string_flatten(gml, string1), string1->size);
+    memcpy(data + string1->size, gml_string_flatten(gml, string2), string2->size);
+    data[size] = '\0';
+    return gml_string_from_data(gml, data, size, string1->length + string2->length,
+                                string1->ascii && string2->ascii);
+}
+
+/* Record the byte offset of every GML_STRING_STRIDE'th rune */
+static void gml_string_index(gml_state_t *gml, gml_string_t *string) {
+    size_t  count  = (string->length - 1) / GML_STRING_STRIDE + 1;
+    size_t *index  = malloc(sizeof(size_t) * count);
+    size_t  offset = 0;
+    if (!index)
+        return;
+    for (size_t i = 0; i < string->length; i++) {
+        if (i % GML_STRING_STRIDE == 0)
+            index[i / GML_STRING_STRIDE] = offset;
+        offset += gml_string_width((uint8_t)string->data[offset]);
     }
-    /* Allow empty string concatenation */
-    if (nrunesa + nrunesb != 0) {
-        if (!(runes = realloc(runes, (nrunesa + nrunesb) * sizeof(gml_string_rune_t)))) {
-            free(runes);
-            return gml_nil_create(gml);
-        }
+    string->index   = index;
+    gml->allocated += sizeof(size_t) * count;
+}
+
+/* The byte offset of a rune, which may be one past the last */
+static size_t gml_string_offset(gml_state_t *gml, gml_string_t *string, size_t rune) {
+    size_t offset = 0;
+    gml_string_flatten(gml, string);
+    if (string->ascii)
+        return rune;
+    if (rune >= GML_STRING_STRIDE && rune < string->length && !string->index)
+        gml_string_index(gml, string);
+    /* Without memory for the index the runes are walked from the start */
+    if (string->index && rune < string->length) {
+        offset = string->index[rune / GML_STRING_STRIDE];
+        rune  %= GML_STRING_STRIDE;
     }
-    return gml_string_from_runes(gml, runes, (nrunesa + nrunesb));
+    for (; rune; rune--)
+        offset += gml_string_width((uint8_t)string->data[offset]);
+    return offset;
 }
 
-gml_value_t gml_string_substring(gml_state_t *gml, gml_value_t string, size_t start, size_t length) {
-    gml_string_t *source = (gml_string_t*)gml_value_unbox(gml, string);
-    return gml_string_from_runes(gml, source->runes + start, length);
-}
+/* The string of a single ASCII rune */
+static gml_value_t gml_string_char(gml_state_t *gml, char c) {
+    gml_string_t *string = (gml_string_t*)gml->chars[(uint8_t)c];
+    char         *data;
+    if (string)
+        return gml_value_box(gml, &string->header);
 
-const gml_string_rune_t *gml_string_runes(gml_state_t *gml, gml_value_t string) {
-    return ((gml_string_t*)gml_value_unbox(gml, string))->runes;
+    /* Made old since they're shared for as long as the state lives */
+    if (!(data = malloc(2)))
+        return gml_nil_create(gml);
+    if (!(string = gml_string_allocate(gml, 0))) {
+        free(data);
+        return gml_nil_create(gml);
+    }
+    data[0]         = c;
+    data[1]         = '\0';
+    string->length  = 1;
+    string->size    = 1;
+    string->data    = data;
+    gml->allocated += 2;
+    gml->chars[(uint8_t)c] = &string->header;
+    return gml_value_box(gml, &string->header);
+}
+
+gml_value_t gml_string_substring(gml_state_t *gml, gml_value_t string, size_t start, size_t length) {
+    gml_string_t *source = (gml_string_t*)gml_value_unbox(gml, string);
+    size_t        begin  = gml_string_offset(gml, source, start);
+    size_t        end    = begin;
+    int           ascii  = source->ascii;
+    gml_string_t *base   = source->base ? (gml_string_t*)source->base : source;
+    gml_string_t *slice;
+    char         *data;
+    if (ascii) {
+        end += length;
+    } else {
+        ascii = 1;
+        for (size_t i = 0; i < length; i++) {
+            if ((uint8_t)source->data[end] >= 0x80)
+                ascii = 0;
+            end += gml_string_width((uint8_t)source->data[end]);
+        }
+    }
+
+    if (length == 1 && ascii)
+        return gml_string_char(gml, source->data[begin]);
+    if (begin == 0 && end == source->size)
+        return string;
+
+    if (end - begin < GML_STRING_SLICE || end - begin < base->size / GML_STRING_SHARE) {
+        if (!(data = malloc(end - begin + 1)))
+            return gml_nil_create(gml);
+        memcpy(data, source->data + begin, end - begin);
+        data[end - begin] = '\0';
+        return gml_string_from_data(gml, data, end - begin, length, ascii);
+    }
+
+    if (!(slice = gml_string_allocate(gml, 1)))
+        return gml_nil_create(gml);
+    slice->length = length;
+    slice->size   = end - begin;
+    slice->data   = source->data + begin;
+    slice->base   = &base->header;
+    slice->ascii  = ascii;
+
+    /* A slice which didn't fit in the nursery may start out sharing a young base */
+    gml_gc_barrier(gml, &slice->header, gml_value_box(gml, slice->base));
+    gml_gc_own(gml, &slice->header);
+    return gml_value_box(gml, &slice->header);
+}
+
+/* The hash of a string, computed the first time it's needed */
+static uint64_t gml_string_hash(gml_state_t *gml, gml_string_t *string) {
+    if (!string->hash)
+        string->hash = gml_hash_bytes(gml_string_flatten(gml, string), string->size) | 1;
+    return string->hash;
+}
+
+/* Put an interned string in the first free slot of its probe sequence */
+static void gml_string_place(gml_header_t **interned, size_t capacity, gml_string_t *string) {
+    size_t mask = capacity - 1;
+    size_t i    = string->hash & mask;
+    while (interned[i])
+        i = (i + 1) & mask;
+    interned[i] = &string->header;
+}
+
+/* Resize the intern table to hold what's in it at most half full */
+static int gml_string_reintern(gml_state_t *gml, size_t capacity) {
+    gml_header_t **interned = calloc(capacity, sizeof(gml_header_t*));
+    if (!interned)
+        return 0;
+    for (size_t i = 0; i < gml->maxinterned; i++)
+        if (gml->interned[i])
+            gml_string_place(interned, capacity, (gml_string_t*)gml->interned[i]);
+    free(gml->interned);
+    gml->interned    = interned;
+    gml->maxinterned = capacity;
+    return 1;
+}
+
+/* Drop the interned strings the major collection didn't mark */
+static void gml_string_prune(gml_state_t *gml) {
+    size_t live = 0;
+    for (size_t i = 0; i < gml->maxinterned; i++) {
+        if (gml->interned[i] && !(gml->interned[i]->flags & GML_GC_MARKED))
+            gml->interned[i] = NULL;
+        else if (gml->interned[i])
+            live++;
+    }
+    /* Every removal breaks probe sequences, rebuilding mends them */
+    gml->ninterned = live;
+    if (gml->maxinterned && !gml_string_reintern(gml, gml->maxinterned)) {
+        gml_throw(true, "out of memory pruning interned strings");
+        gml_abort(gml);
+    }
+}
+
+/*
+ * The string of a literal. Literals live as long as the code they're in
+ * so they're made old, which also spares the intern table from following
+ * them being evacuated.
+ */
+static gml_value_t gml_string_literal(gml_state_t *gml, const char *literal) {
+    size_t        size   = strlen(literal);
+    int           intern = size <= GML_STRING_INTERN;
+    uint64_t      hash   = gml_hash_bytes(literal, size) | 1;
+    size_t        length;
+    int           ascii;
+    gml_string_t *string;
+    char         *data;
+
+    for (size_t i = hash & (gml->maxinterned - 1); intern && gml->maxinterned && gml->interned[i]; i = (i + 1) & (gml->maxinterned - 1)) {
+        string = (gml_string_t*)gml->interned[i];
+        if (string->hash == hash && string->size == size && !memcmp(string->data, literal, size))
+            return gml_value_box(gml, &string->header);
+    }
+
+    if (!gml_string_scan(literal, size, &length, &ascii))
+        return gml_nil_create(gml);
+    /* Without room in the intern table the literal is merely not shared */
+    if (intern && 2 * (gml->ninterned + 1) > gml->maxinterned)
+        intern = gml_string_reintern(gml, gml->maxinterned ? gml->maxinterned * 2 : 64);
+    if (!(data = malloc(size + 1)))
+        return gml_nil_create(gml);
+    if (!(string = gml_string_allocate(gml, 0))) {
+        free(data);
+        return gml_nil_create(gml);
+    }
+    memcpy(data, literal, size + 1);
+    string->length  = length;
+    string->size    = size;
+    string->data    = data;
+    string->hash    = hash;
+    string->ascii   = ascii;
+    gml->allocated += size + 1;
+    if (intern) {
+        gml_string_place(gml->interned, gml->maxinterned, string);
+        gml->ninterned++;
+    }
+    return gml_value_box(gml, &string->header);
 }
 
 size_t gml_string_length(gml_state_t *gml, gml_value_t string) {
     return ((gml_string_t*)gml_value_unbox(gml, string))->length;
 }
 
+const char *gml_string_utf8(gml_state_t *gml, gml_value_t string) {
+    gml_string_t *source = (gml_string_t*)gml_value_unbox(gml, string);
+    char         *data   = gml_string_flatten(gml, source);
+    if (!source->base || data[source->size] == '\0')
+        return data;
+
+    /* The slice doesn't end where its base does and needs a NUL of its own */
+    if (!(data = malloc(source->size + 1))) {
+        gml_throw(true, "out of memory terminating a string");
+        gml_abort(gml);
+    }
+    memcpy(data, source->data, source->size);
+    data[source->size] = '\0';
+    source->data    = data;
+    source->base    = NULL;
+    gml->allocated += source->size + 1;
+    return data;
+}
+
 char *gml_string_utf8data(gml_state_t *gml, gml_value_t string) {
     gml_string_t *source = (gml_string_t*)gml_value_unbox(gml, string);
-    size_t        length = gml_string_encoded_length(source->runes, source->length);
-    char         *utf8   = malloc(length + 1);
+    char         *utf8   = malloc(source->size + 1);
     if (!utf8)
         return NULL;
-    gml_string_encode(source->runes, source->length, (uint8_t*)utf8);
+    memcpy(utf8, gml_string_flatten(gml, source), source->size);
+    utf8[source->size] = '\0';
     return utf8;
 }
+
 size_t gml_string_utf8length(gml_state_t *gml, gml_value_t string) {
-    gml_string_t *source = (gml_string_t*)gml_value_unbox(gml, string);
-    size_t length = gml_string_encoded_length(source->runes, source->length);
-    return length;
+    return ((gml_string_t*)gml_value_unbox(gml, string))->size;
+}
+
+/*
+ * Runtime shape. The keys of tables keyed only by atoms, records, are
+ * described by a shape shared by every record which got the same keys in
+ * the same order. Records keep their values in the order of the keys so
+ * a field found once in a shape is in the same slot of every record with
+ * that shape. Shapes form a tree rooted at the shape without keys, every
+ * shape leading to the shapes with one more key, and live as long as the
+ * state does.
+ */
+#define GML_SHAPE_MAX 32
+
+struct gml_shape_s {
+    gml_shape_t  *parent;
+    gml_shape_t **children;
+    size_t        nchildren;
+    size_t        maxchildren;
+    size_t        length;
+    gml_value_t   keys[];
+};
+
+static gml_shape_t *gml_shape_create(gml_shape_t *parent, gml_value_t key) {
+    size_t       length = parent ? parent->length + 1 : 0;
+    gml_shape_t *shape  = malloc(sizeof(*shape) + sizeof(gml_value_t) * length);
+    if (!shape)
+        return NULL;
+    shape->parent      = parent;
+    shape->children    = NULL;
+    shape->nchildren   = 0;
+    shape->maxchildren = 0;
+    shape->length      = length;
+    if (parent) {
+        memcpy(shape->keys, parent->keys, sizeof(gml_value_t) * parent->length);
+        shape->keys[parent->length] = key;
+    }
+    return shape;
+}
+
+static void gml_shape_destroy(gml_shape_t *shape) {
+    if (!shape)
+        return;
+    for (size_t i = 0; i < shape->nchildren; i++)
+        gml_shape_destroy(shape->children[i]);
+    free(shape->children);
+    free(shape);
+}
+
+/* Yield the slot of a key or the length of the shape when there's none */
+static inline size_t gml_shape_find(gml_shape_t *shape, gml_value_t key) {
+    for (size_t i = 0; i < shape->length; i++)
+        if (gml_value_identical(shape->keys[i], key))
+            return i;
+    return shape->length;
+}
+
+/* The shape reached by adding a key */
+static gml_shape_t *gml_shape_add(gml_state_t *gml, gml_shape_t *shape, gml_value_t key) {
+    for (size_t i = 0; i < shape->nchildren; i++)
+        if (gml_value_identical(shape->children[i]->keys[shape->length], key))
+            return shape->children[i];
+
+    if (shape->nchildren == shape->maxchildren) {
+        size_t        size     = shape->maxchildren ? shape->maxchildren * 2 : 4;
+        gml_shape_t **children = realloc(shape->children, sizeof(gml_shape_t*) * size);
+        if (!children)
+            goto error;
+        shape->children    = children;
+        shape->maxchildren = size;
+    }
+    gml_shape_t *child = gml_shape_create(shape, key);
+    if (!child)
+        goto error;
+    shape->children[shape->nchildren++] = child;
+    return child;
+
+error:
+    gml_throw(true, "out of memory adding a key to a table");
+    gml_abort(gml);
+    return NULL;
 }
 
 /* Runtime table */
@@ -704,150 +1762,402 @@ typedef struct {
     gml_value_t value;
 } gml_table_bucket_t;
 
+/*
+ * Tables are open addressed with a control byte per bucket. The control
+ * byte of a full bucket holds seven bits of the hash of its key, which
+ * lets a probe check a whole group of buckets for a key at once and only
+ * compare the keys whose bits match.
+ *
+ * The control bytes follow the buckets in the same allocation. The first
+ * group of them is mirrored past the end so that a group can be loaded
+ * at any bucket without wrapping around. The capacity is a power of two
+ * and the table grows before more than seven eighths of it is used, so a
+ * probe always runs into an empty bucket eventually.
+ *
+ * Tables start out as records and only become hash tables once they get
+ * a key which isn't an atom, too many keys or have a key removed. Either
+ * way the initial slots or buckets of a table are allocated along with it.
+ */
 typedef struct {
     gml_header_t        header;
+    gml_shape_t        *shape;     /* NULL unless the table is a record */
+    gml_value_t        *slots;
+    size_t              nslots;
     gml_table_bucket_t *buckets;
-    size_t              size;
+    uint8_t            *control;
+    size_t              capacity;
+    size_t              count;     /* full slots or buckets */
+    size_t              growth;    /* empty buckets which may still be used */
+    int                 isclass;   /* methods taken from it are bound to it */
 } gml_table_t;
 
-static void gml_table_clear(gml_state_t *gml, gml_table_t *table) {
-    gml_value_t nil = gml_nil_create(gml);
-    for (size_t i = 0; i < table->size; i++) {
-        table->buckets[i].key   = nil;
-        table->buckets[i].value = nil;
+#define GML_TABLE_SIZE    8
+#define GML_TABLE_GROUP   16
+#define GML_TABLE_EMPTY   0x80
+#define GML_TABLE_DELETED 0xFE
+
+#define GML_TABLE_ISFULL(CONTROL) (!((CONTROL) & 0x80))
+
+static inline size_t gml_table_footprint(size_t capacity) {
+    return sizeof(gml_table_bucket_t) * capacity + capacity + GML_TABLE_GROUP;
+}
+
+/* The bytes allocated along with a table */
+#define GML_TABLE_INLINE (sizeof(gml_table_bucket_t) * GML_TABLE_SIZE + GML_TABLE_SIZE + GML_TABLE_GROUP)
+
+static inline int gml_table_isinline(gml_table_t *table) {
+    if (table->shape)
+        return table->slots == (gml_value_t*)(table + 1);
+    return table->buckets == (gml_table_bucket_t*)(table + 1);
+}
+
+/* Point an inline table which was copied elsewhere at its own memory */
+static void gml_table_relocate(gml_table_t *table) {
+    if (table->shape) {
+        table->slots = (gml_value_t*)(table + 1);
+    } else {
+        table->buckets = (gml_table_bucket_t*)(table + 1);
+        table->control = (uint8_t*)(table->buckets + table->capacity);
     }
 }
 
-static size_t gml_table_probe(gml_table_t *table, uint32_t hash, size_t index) {
-    return (hash + index) % table->size;
+static inline size_t gml_table_maxload(size_t capacity) {
+    return capacity - capacity / 8;
+}
+
+static void gml_table_init(gml_table_t *table, void *memory, size_t capacity) {
+    table->buckets  = memory;
+    table->control  = (uint8_t*)(table->buckets + capacity);
+    table->capacity = capacity;
+    table->count    = 0;
+    table->growth   = gml_table_maxload(capacity);
+    memset(table->control, GML_TABLE_EMPTY, capacity + GML_TABLE_GROUP);
 }
 
-static uint32_t gml_table_hash(gml_state_t *gml, gml_value_t value) {
-    const char *start;
-    size_t      length;
+static inline void gml_table_control(gml_table_t *table, size_t index, uint8_t control) {
+    table->control[index] = control;
+    for (size_t mirror = index + table->capacity; mirror < table->capacity + GML_TABLE_GROUP; mirror += table->capacity)
+        table->control[mirror] = control;
+}
+
+/* Bit i of a group mask is set when control byte i of the group matches */
+static inline uint32_t gml_table_match(const uint8_t *group, uint8_t control) {
+#ifdef __SSE2__
+    __m128i bytes = _mm_loadu_si128((const __m128i*)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8((char)control)));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < GML_TABLE_GROUP; i++)
+        mask |= (uint32_t)(group[i] == control) << i;
+    return mask;
+#endif
+}
+
+/* Empty and deleted buckets are the ones with the high bit set */
+static inline uint32_t gml_table_match_free(const uint8_t *group) {
+#ifdef __SSE2__
+    return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)group));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i < GML_TABLE_GROUP; i++)
+        mask |= (uint32_t)(group[i] >> 7) << i;
+    return mask;
+#endif
+}
+
+static uint64_t gml_table_hash(gml_state_t *gml, gml_value_t value) {
     switch (gml_value_typeof(gml, value)) {
         case GML_TYPE_NUMBER:
-            start  = (char *)&value;
-            length = sizeof(value);
-            break;
+            /* Zero and negative zero are equal keys */
+            if (value == 0.0)
+                value = 0.0;
+            return gml_hash_bytes(&value, sizeof(value));
         case GML_TYPE_STRING:
-            start  = (char *)gml_string_runes(gml, value);
-            length = gml_string_length(gml, value) * sizeof(gml_string_rune_t);
-            break;
+            return gml_string_hash(gml, (gml_string_t*)gml_value_unbox(gml, value));
         case GML_TYPE_ATOM:
-            start  = gml_atom_key(gml, value);
-            length = gml_atom_length(gml, value);
-            break;
+            return ((gml_atom_t*)gml_value_unbox(gml, value))->hash;
         default:
             gml_throw(true, "Tried to hash a non hashable value.");
             gml_abort(gml);
             break;
     }
-    uint32_t hash = 7;
-    for (size_t i = 0; i < length; i++)
-        hash = (hash * 31) ^ *start++;
-    return hash;
+    return 0;
+}
+
+/* Keys are numbers, strings and atoms, atoms being interned */
+static inline int gml_table_equal(gml_state_t *gml, gml_value_t k1, gml_value_t k2) {
+    if (gml_value_identical(k1, k2))
+        return 1;
+    gml_type_t type = gml_value_typeof(gml, k1);
+    if (type != gml_value_typeof(gml, k2))
+        return 0;
+    if (type == GML_TYPE_NUMBER)
+        return k1 == k2;
+    if (type != GML_TYPE_STRING)
+        return 0;
+
+    /* Both strings were hashed to get here */
+    gml_string_t *s1 = (gml_string_t*)gml_value_unbox(gml, k1);
+    gml_string_t *s2 = (gml_string_t*)gml_value_unbox(gml, k2);
+    return s1->hash   == s2->hash
+        && s1->size   == s2->size
+        && !memcmp(s1->data, s2->data, s1->size);
+}
+
+/* Yield the bucket holding a key or the capacity when there's none */
+static size_t gml_table_find(gml_state_t *gml, gml_table_t *table, gml_value_t key, uint64_t hash) {
+    size_t  mask   = table->capacity - 1;
+    size_t  index  = (size_t)(hash >> 7) & mask;
+    uint8_t h2     = (uint8_t)(hash & 0x7F);
+    size_t  stride = 0;
+    for (;;) {
+        const uint8_t *group = table->control + index;
+        for (uint32_t match = gml_table_match(group, h2); match; match &= match - 1) {
+            size_t slot = (index + (size_t)__builtin_ctz(match)) & mask;
+            if (gml_table_equal(gml, table->buckets[slot].key, key))
+                return slot;
+        }
+        if (gml_table_match(group, GML_TABLE_EMPTY))
+            return table->capacity;
+        stride += GML_TABLE_GROUP;
+        index   = (index + stride) & mask;
+    }
+}
+
+/* Yield the first empty or deleted bucket on the probe sequence of a hash */
+static size_t gml_table_free(gml_table_t *table, uint64_t hash) {
+    size_t mask   = table->capacity - 1;
+    size_t index  = (size_t)(hash >> 7) & mask;
+    size_t stride = 0;
+    for (;;) {
+        uint32_t match = gml_table_match_free(table->control + index);
+        if (match)
+            return (index + (size_t)__builtin_ctz(match)) & mask;
+        stride += GML_TABLE_GROUP;
+        index   = (index + stride) & mask;
+    }
+}
+
+/*
+ * Move every entry into new buckets, growing the table unless enough of
+ * the buckets in use are only deleted ones.
+ */
+static void gml_table_rehash(gml_state_t *gml, gml_table_t *table) {
+    gml_table_t old      = *table;
+    size_t      capacity = table->count * 2 >= gml_table_maxload(table->capacity)
+                               ? table->capacity * 2
+                               : table->capacity;
+    void       *memory   = malloc(gml_table_footprint(capacity));
+    if (!memory) {
+        gml_throw(true, "out of memory growing a table");
+        gml_abort(gml);
+    }
+    gml->allocated += gml_table_footprint(capacity);
+    if (gml_table_isinline(table))
+        gml_gc_own(gml, &table->header);
+
+    gml_table_init(table, memory, capacity);
+    for (size_t i = 0; i < old.capacity; i++) {
+        if (!GML_TABLE_ISFULL(old.control[i]))
+            continue;
+        uint64_t hash = gml_table_hash(gml, old.buckets[i].key);
+        size_t   slot = gml_table_free(table, hash);
+        gml_table_control(table, slot, (uint8_t)(hash & 0x7F));
+        table->buckets[slot] = old.buckets[i];
+    }
+    table->count   = old.count;
+    table->growth -= old.count;
+    if (old.buckets != (gml_table_bucket_t*)(table + 1))
+        free(old.buckets);
+}
+
+/* Turn a record into a hash table */
+static void gml_table_unshape(gml_state_t *gml, gml_table_t *table) {
+    gml_shape_t *shape    = table->shape;
+    size_t       count    = table->count;
+    size_t       capacity = GML_TABLE_SIZE;
+    int          isinline = gml_table_isinline(table);
+    void        *memory   = table + 1;
+    gml_value_t  values[GML_SHAPE_MAX];
+
+    memcpy(values, table->slots, sizeof(gml_value_t) * count);
+    while (gml_table_maxload(capacity) <= count)
+        capacity *= 2;
+    if (!isinline || capacity != GML_TABLE_SIZE) {
+        if (!(memory = malloc(gml_table_footprint(capacity)))) {
+            gml_throw(true, "out of memory growing a table");
+            gml_abort(gml);
+        }
+        gml->allocated += gml_table_footprint(capacity);
+        if (isinline)
+            gml_gc_own(gml, &table->header);
+        else
+            free(table->slots);
+    }
+
+    table->shape = NULL;
+    gml_table_init(table, memory, capacity);
+    for (size_t i = 0; i < count; i++) {
+        uint64_t hash = gml_table_hash(gml, shape->keys[i]);
+        size_t   slot = gml_table_free(table, hash);
+        gml_table_control(table, slot, (uint8_t)(hash & 0x7F));
+        table->buckets[slot].key   = shape->keys[i];
+        table->buckets[slot].value = values[i];
+    }
+    table->count   = count;
+    table->growth -= count;
 }
 
-static void gml_table_rehash(gml_state_t *gml, gml_table_t *table);
+/* Add the next key of a record, the shape has to lead from the current one */
+static void gml_table_append(gml_state_t *gml, gml_table_t *table, gml_shape_t *shape, gml_value_t value) {
+    if (table->count == table->nslots) {
+        gml_value_t *slots = malloc(sizeof(gml_value_t) * GML_SHAPE_MAX);
+        if (!slots) {
+            gml_throw(true, "out of memory growing a table");
+            gml_abort(gml);
+        }
+        gml->allocated += sizeof(gml_value_t) * GML_SHAPE_MAX;
+        memcpy(slots, table->slots, sizeof(gml_value_t) * table->count);
+        if (gml_table_isinline(table))
+            gml_gc_own(gml, &table->header);
+        else
+            free(table->slots);
+        table->slots  = slots;
+        table->nslots = GML_SHAPE_MAX;
+    }
+    gml_gc_barrier(gml, &table->header, value);
+    table->slots[table->count++] = value;
+    table->shape = shape;
+}
 
 void gml_table_put(gml_state_t *gml, gml_value_t dict, gml_value_t key, gml_value_t value) {
     gml_table_t *table = (gml_table_t*)gml_value_unbox(gml, dict);
-    uint32_t     hash  = gml_table_hash(gml, key);
-    gml_value_t  nil   = gml_nil_create(gml);
-
-    for (size_t i = 0; i < table->size; i++) {
-        size_t slot = gml_table_probe(table, hash, i);
-        if (gml_equal(gml, table->buckets[slot].key, nil)
-        ||  gml_equal(gml, table->buckets[slot].key, key)) {
-            table->buckets[slot].key   = key;
-            table->buckets[slot].value = value;
+
+    if (table->shape) {
+        size_t index = table->count;
+        if (gml_value_typeof(gml, key) == GML_TYPE_ATOM)
+            index = gml_shape_find(table->shape, key);
+        if (index < table->count) {
+            gml_gc_barrier(gml, &table->header, value);
+            table->slots[index] = value;
+            return;
+        }
+        if (gml_value_typeof(gml, key) == GML_TYPE_ATOM && table->count < GML_SHAPE_MAX) {
+            gml_table_append(gml, table, gml_shape_add(gml, table->shape, key), value);
             return;
         }
+        gml_table_unshape(gml, table);
+    }
+
+    uint64_t     hash  = gml_table_hash(gml, key);
+    size_t       slot  = gml_table_find(gml, table, key, hash);
+
+    gml_gc_barrier(gml, &table->header, key);
+    gml_gc_barrier(gml, &table->header, value);
+
+    if (slot != table->capacity) {
+        table->buckets[slot].value = value;
+        return;
+    }
+
+    slot = gml_table_free(table, hash);
+    if (table->control[slot] == GML_TABLE_EMPTY) {
+        if (!table->growth) {
+            gml_table_rehash(gml, table);
+            slot = gml_table_free(table, hash);
+        }
+        table->growth--;
     }
-    gml_table_rehash(gml, table);
-    gml_table_put(gml, dict, key, value);
+    gml_table_control(table, slot, (uint8_t)(hash & 0x7F));
+    table->buckets[slot].key   = key;
+    table->buckets[slot].value = value;
+    table->count++;
 }
 
 gml_value_t gml_table_get(gml_state_t *gml, gml_value_t dict, gml_value_t key) {
-    gml_table_t *table   = (gml_table_t*)gml_value_unbox(gml, dict);
-    uint32_t     hash    = gml_table_hash(gml, key);
-    gml_value_t  nil     = gml_nil_create(gml);
-    gml_value_t  deleted = gml_atom_create(gml, "deleted");
-    for (size_t i = 0; i < table->size; i++) {
-        size_t slot = gml_table_probe(table, hash, i);
-        if (gml_equal(gml, table->buckets[slot].key, nil)
-        && !gml_equal(gml, table->buckets[slot].value, deleted))
-            break;
-        else if (gml_equal(gml, table->buckets[slot].key, key))
-            return table->buckets[slot].value;
+    gml_table_t *table = (gml_table_t*)gml_value_unbox(gml, dict);
+    if (table->shape) {
+        size_t index = gml_shape_find(table->shape, key);
+        return index < table->count ? table->slots[index] : gml_nil_create(gml);
     }
-    return nil;
+    size_t       slot  = gml_table_find(gml, table, key, gml_table_hash(gml, key));
+    if (slot == table->capacity)
+        return gml_nil_create(gml);
+    return table->buckets[slot].value;
 }
 
-int gml_table_empty(gml_state_t *gml, gml_value_t dict) {
+/*
+ * Removed entries leave a deleted bucket behind so probes for the keys
+ * after it keep going, unless there's an empty bucket close enough on
+ * either side of it that no probe can have gone past it.
+ */
+int gml_table_remove(gml_state_t *gml, gml_value_t dict, gml_value_t key) {
     gml_table_t *table = (gml_table_t*)gml_value_unbox(gml, dict);
-    gml_value_t  nil   = gml_nil_create(gml);
-    for (size_t i = 0; i < table->size; i++)
-        if (!gml_equal(gml, table->buckets[i].key, nil))
+    if (table->shape) {
+        if (gml_shape_find(table->shape, key) == table->count)
             return 0;
+        gml_table_unshape(gml, table);
+    }
+    size_t       slot  = gml_table_find(gml, table, key, gml_table_hash(gml, key));
+    if (slot == table->capacity)
+        return 0;
+
+    uint32_t after  = gml_table_match(table->control + slot, GML_TABLE_EMPTY);
+    uint32_t before = gml_table_match(table->control + ((slot - GML_TABLE_GROUP) & (table->capacity - 1)), GML_TABLE_EMPTY);
+    if (table->capacity >= GML_TABLE_GROUP && after && before
+    &&  (size_t)(__builtin_ctz(after) + __builtin_clz(before << 16)) < GML_TABLE_GROUP) {
+        gml_table_control(table, slot, GML_TABLE_EMPTY);
+        table->growth++;
+    } else {
+        gml_table_control(table, slot, GML_TABLE_DELETED);
+    }
+    table->buckets[slot].key   = gml_nil_create(gml);
+    table->buckets[slot].value = gml_nil_create(gml);
+    table->count--;
     return 1;
 }
 
+int gml_table_empty(gml_state_t *gml, gml_value_t dict) {
+    return ((gml_table_t*)gml_value_unbox(gml, dict))->count == 0;
+}
+
 list_t *gml_table_keys(gml_state_t *gml, gml_value_t dict) {
     gml_table_t *table = (gml_table_t*)gml_value_unbox(gml, dict);
     list_t      *keys  = list_create();
-    gml_value_t  nil   = gml_nil_create(gml);
-    for (size_t i = 0; i < table->size; i++)
-        if(!gml_equal(gml, table->buckets[i].key, nil))
+    if (table->shape) {
+        for (size_t i = 0; i < table->count; i++)
+            list_push(keys, &table->shape->keys[i]);
+        return keys;
+    }
+    for (size_t i = 0; i < table->capacity; i++)
+        if (GML_TABLE_ISFULL(table->control[i]))
             list_push(keys, &table->buckets[i].key);
     return keys;
 }
 
-static void gml_table_rehash(gml_state_t *gml, gml_table_t *table) {
-    size_t              osize    = table->size;
-    gml_table_bucket_t *obuckets = table->buckets;
-    gml_value_t         nil      = gml_nil_create(gml);
-
-    table->size = osize * 2;
-    if (!(table->buckets = malloc(sizeof(gml_table_bucket_t) * table->size)))
-        return;
-
-    gml_table_clear(gml, table);
-    for (size_t i = 0; i < osize; i++) {
-        if (obuckets[i].key == nil)
-            continue;
-        gml_table_put(
-            gml,
-            gml_value_box(gml, (gml_header_t*)table),
-            obuckets[i].key,
-            obuckets[i].value
-        );
-    }
-    free(obuckets);
-}
-
 void gml_table_destroy(gml_state_t *gml, gml_value_t value) {
     gml_table_t *table = (gml_table_t*)gml_value_unbox(gml, value);
-    free(table->buckets);
-    free(table);
+    if (!gml_table_isinline(table))
+        free(table->shape ? (void*)table->slots : (void*)table->buckets);
+    gml_gc_free(gml, table);
 }
 
 gml_value_t gml_table_create(gml_state_t *gml) {
-    gml_table_t *table = malloc(sizeof(*table));
+    gml_table_t *table = gml_gc_allocate(gml, sizeof(*table) + GML_TABLE_INLINE, 1);
     if (!table)
-        gml_nil_create(gml);
+        return gml_nil_create(gml);
 
     table->header.type    = GML_TYPE_TABLE;
     table->header.destroy = &gml_table_destroy;
-    table->size           = 11;
-    if (!(table->buckets = malloc(sizeof(gml_table_bucket_t) * table->size))) {
-        free(table);
-        return gml_nil_create(gml);
-    }
-
-    gml_table_clear(gml, table);
-    list_push(gml->objects, table);
+    table->shape          = gml->shapes;
+    table->slots          = (gml_value_t*)(table + 1);
+    table->nslots         = GML_TABLE_INLINE / sizeof(gml_value_t);
+    table->buckets        = NULL;
+    table->control        = NULL;
+    table->capacity       = 0;
+    table->count          = 0;
+    table->growth         = 0;
+    table->isclass        = 0;
     return gml_value_box(gml, (gml_header_t*)table);
 }
 
@@ -864,19 +2174,19 @@ double gml_number_value(gml_state_t *gml, gml_value_t number) {
 
 /* Special atoms */
 gml_value_t gml_nil_create(gml_state_t *gml) {
-    return gml_atom_create(gml, "nil");
+    return gml->atomnil;
 }
 
 gml_value_t gml_none_create(gml_state_t *gml) {
-    return gml_atom_create(gml, "none");
+    return gml->atomnone;
 }
 
 gml_value_t gml_true_create(gml_state_t *gml) {
-    return gml_atom_create(gml, "true");
+    return gml->atomtrue;
 }
 
 gml_value_t gml_false_create(gml_state_t *gml) {
-    return gml_atom_create(gml, "false");
+    return gml->atomfalse;
 }
 
 /* Comparision runtime */
@@ -888,11 +2198,13 @@ int gml_isfalse(gml_state_t *gml, gml_value_t value) {
         case GML_TYPE_STRING:
             return gml_string_length(gml, value) == 0;
         case GML_TYPE_ATOM:
-            return (!strcmp(gml_atom_key(gml, value), "false") ||
-                    !strcmp(gml_atom_key(gml, value), "nil")   ||
-                    !strcmp(gml_atom_key(gml, value), "none"));
+            return (gml_value_identical(value, gml->atomfalse) ||
+                    gml_value_identical(value, gml->atomnil)   ||
+                    gml_value_identical(value, gml->atomnone));
         case GML_TYPE_ARRAY:
             return gml_array_length(gml, value) == 0;
+        case GML_TYPE_BUFFER:
+            return gml_buffer_length(gml, value) == 0;
         case GML_TYPE_TABLE:
             return gml_table_empty(gml, value);
         case GML_TYPE_NATIVE:
@@ -926,7 +2238,9 @@ int gml_istable(gml_state_t *gml, gml_value_t value) {
 }
 
 int gml_equal(gml_state_t *gml, gml_value_t v1, gml_value_t v2) {
-    size_t length;
+    size_t        length;
+    gml_string_t *s1;
+    gml_string_t *s2;
     if (gml_value_typeof(gml, v1) != gml_value_typeof(gml, v2))
         return 0;
     switch (gml_value_typeof(gml, v1)) {
@@ -935,12 +2249,13 @@ int gml_equal(gml_state_t *gml, gml_value_t v1, gml_value_t v2) {
         case GML_TYPE_ATOM: /* interned compare */
             return gml_value_unbox(gml, v1) == gml_value_unbox(gml, v2);
         case GML_TYPE_STRING:
-            length = gml_string_length(gml, v1);
-            if (length != gml_string_length(gml, v2))
+            s1 = (gml_string_t*)gml_value_unbox(gml, v1);
+            s2 = (gml_string_t*)gml_value_unbox(gml, v2);
+            if (s1 == s2)
+                return 1;
+            if (s1->size != s2->size)
                 return 0;
-            return !memcmp(gml_string_runes(gml, v1),
-                           gml_string_runes(gml, v2),
-                           length * sizeof(gml_string_rune_t));
+            return !memcmp(gml_string_flatten(gml, s1), gml_string_flatten(gml, s2), s1->size);
         case GML_TYPE_ARRAY:
             if (gml_array_length(gml, v1) != gml_array_length(gml, v2))
                 return 0;
@@ -952,6 +2267,14 @@ int gml_equal(gml_state_t *gml, gml_value_t v1, gml_value_t v2) {
                 }
             }
             return 1;
+        case GML_TYPE_BUFFER:
+            length = gml_buffer_length(gml, v1);
+            if (gml_buffer_kind(gml, v1) != gml_buffer_kind(gml, v2) || length != gml_buffer_length(gml, v2))
+                return 0;
+            for (size_t i = 0; i < length; i++)
+                if (gml_buffer_get(gml, v1, i) != gml_buffer_get(gml, v2, i))
+                    return 0;
+            return 1;
         default:
             return 0;
     }
@@ -966,328 +2289,209 @@ int gml_same(gml_state_t *gml, gml_value_t v1, gml_value_t v2) {
 }
 
 /*
- * The evaluator. We should consider compiling the AST to a bytecode
- * instead of walking the AST to evaluate expressions.
+ * The virtual machine. Source is compiled to chunks of bytecode which are
+ * executed here on an operand stack shared by every invocation.
  */
-static gml_value_t gml_eval(gml_state_t *gml, ast_t *expr, gml_env_t *env);
-static gml_value_t gml_eval_block(gml_state_t *gml, list_t *block, gml_env_t *env) {
-    list_iterator_t *it = list_iterator_create(block);
-    gml_value_t value = gml_nil_create(gml);
-    while (!list_iterator_end(it)) {
-        ast_t *next = list_iterator_next(it);
-        value = gml_eval(gml, next, env);
-    }
-    list_iterator_destroy(it);
-    return value;
+static gml_value_t gml_vm_execute(gml_state_t *gml, chunk_t *chunk, gml_function_t *fun, gml_value_t *slots);
+static void gml_gc_collect(gml_state_t *gml);
+
+static inline int gml_gc_due(gml_state_t *gml) {
+    return gml->nurserytop >= gml->nursery + GML_NURSERY_TRIGGER || gml->allocated >= gml->threshold;
+}
+
+static gml_position_t *gml_vm_position(chunk_t *chunk, const code_t *pc) {
+    return &chunk->positions[pc - chunk->code - 1];
+}
+
+static inline int gml_value_isnumber(gml_value_t value) {
+    gml_value_box_t box = { .val = value };
+    return (box.u64 & GML_VALUE_BOX_MASK) != GML_VALUE_BOX_TAG;
+}
+
+static int gml_function_ismethod(gml_state_t *gml, gml_value_t value) {
+    if (gml_value_typeof(gml, value) != GML_TYPE_FUNCTION)
+        return 0;
+    list_t *formals = gml_function_formals(gml, value);
+    return list_length(formals) && !strcmp(list_at(formals, 0), "self");
 }
 
-static gml_value_t gml_eval_ident(gml_state_t *gml, ast_t *expr, gml_env_t *env) {
-    gml_value_t *ptr = NULL;
-    if (!gml_env_lookup(env, expr->ident, &ptr)) {
-        gml_error(&expr->position, "`%s' is unbound.", expr->ident);
+static void gml_typecheck(gml_state_t *gml, gml_position_t *position, gml_value_t value, gml_type_t type) {
+    gml_type_t actual = gml_value_typeof(gml, value);
+    if (actual != type) {
+        gml_error(position, "Expected type `%s' but expression has type `%s'.",
+            gml_typename(gml, type),
+            gml_typename(gml, actual));
         gml_abort(gml);
     }
-    return *ptr;
 }
 
-static gml_value_t gml_eval_call(gml_state_t *gml, ast_t *expr, gml_env_t *env) {
-    gml_value_t callee   = gml_eval(gml, expr->call.callee, env);
-    size_t      nargs    = list_length(expr->call.args);
-    gml_type_t  calltype = gml_value_typeof(gml, callee);
-    list_t     *formals;
-    gml_value_t result;
-    gml_value_t *lookup = NULL;
-    int          method = 0;
+static gml_value_t gml_vm_binary(gml_state_t *gml, gml_position_t *position, opcode_t op, gml_value_t vleft, gml_value_t vright) {
+    gml_value_t vtrue  = gml_true_create(gml);
+    gml_value_t vfalse = gml_false_create(gml);
+    double      nleft;
+    double      nright;
 
-    switch (calltype) {
-        gml_env_t       *callenv;
-        gml_value_t     *actuals;
-        case GML_TYPE_FUNCTION:
-            callenv = gml_env_push((gml_env_t*)gml_function_env(gml, callee));
-            formals = gml_function_formals(gml, callee);
-            /*
-             * If the function contains a binding of "self" already it means the
-             * function was promoted to a method for a table which was promoted to
-             * a class.
-             *
-             * We need to start from formals[1] instead.
-             */
-            if (gml_env_lookup(callenv, "self", &lookup))
-                method = 1;
-            for (size_t i = 0; i < nargs; i++) {
-                gml_value_t value = gml_eval(gml, list_at(expr->call.args, i), env);
-                gml_env_bind(callenv, list_at(formals, i + method), value);
-            }
-            return gml_eval_block(gml, gml_function_body(gml, callee), callenv);
+    switch (op) {
+        case OP_IS:  return gml_same(gml, vleft, vright) ? vtrue : vfalse;
+        case OP_EQ:  return gml_equal(gml, vleft, vright) ? vtrue : vfalse;
+        case OP_NE:  return gml_equal(gml, vleft, vright) ? vfalse : vtrue;
+        case OP_AND: return gml_istrue(gml, vleft) ? vright : vleft;
+        case OP_OR:  return gml_isfalse(gml, vleft) ? vright : vleft;
+        default:
+            break;
+    }
 
-        case GML_TYPE_NATIVE:
-            if (!(actuals = malloc(nargs * sizeof(gml_value_t))))
-                return gml_nil_create(gml);
-            for (size_t i = 0; i < nargs; i++)
-                actuals[i] = gml_eval(gml, list_at(expr->call.args, i), env);
-            result = gml_native_func(gml, callee)(gml, actuals, nargs);
-            free(actuals);
-            return result;
+    gml_typecheck(gml, position, vleft, gml_value_typeof(gml, vright));
+
+    /* String concatenation */
+    if (gml_value_typeof(gml, vright) == GML_TYPE_STRING && op == OP_ADD) {
+        return gml_string_create_cat(gml, vleft, vright);
+    }
 
+    /* Array concatenation */
+    if (gml_value_typeof(gml, vright) == GML_TYPE_ARRAY && op == OP_ADD)
+        return gml_array_create_cat(gml, vleft, vright);
+
+    nleft  = gml_number_value(gml, vleft);
+    nright = gml_number_value(gml, vright);
+
+    switch (op) {
+        case OP_ADD:    return gml_number_create(gml, nleft + nright);
+        case OP_SUB:    return gml_number_create(gml, nleft - nright);
+        case OP_MUL:    return gml_number_create(gml, nleft * nright);
+        case OP_DIV:    return gml_number_create(gml, nleft / nright);
+        case OP_MOD:    return gml_number_create(gml, (uint32_t)nleft %  (uint32_t)nright);
+        case OP_BITAND: return gml_number_create(gml, (uint32_t)nleft &  (uint32_t)nright);
+        case OP_BITOR:  return gml_number_create(gml, (uint32_t)nleft |  (uint32_t)nright);
+        case OP_BITXOR: return gml_number_create(gml, (uint32_t)nleft ^  (uint32_t)nright);
+        case OP_SHL:    return gml_number_create(gml, (uint32_t)nleft << (uint32_t)nright);
+        case OP_SHR:    return gml_number_create(gml, (uint32_t)nleft >> (uint32_t)nright);
+        case OP_LT:     return nleft <  nright ? vtrue : vfalse;
+        case OP_GT:     return nleft >  nright ? vtrue : vfalse;
+        case OP_LE:     return nleft <= nright ? vtrue : vfalse;
+        case OP_GE:     return nleft >= nright ? vtrue : vfalse;
         default:
-            gml_error(
-                &expr->position,
-                "Type `%s' is not a callable type.", gml_typename(gml, calltype)
-            );
-            gml_abort(gml);
+            gml_throw(true, "operation %s is not a binary operation", compile_opname(op));
             break;
     }
     return gml_nil_create(gml);
 }
 
-static gml_value_t gml_eval_array(gml_state_t *gml, ast_t *expr, gml_env_t *env) {
-    size_t       length   = list_length(expr->array);
-    gml_value_t *elements = malloc(sizeof(gml_value_t) * length);
-    if (!elements)
-        return gml_nil_create(gml);
-    for (size_t i = 0; i < length; i++)
-        elements[i] = gml_eval(gml, list_at(expr->array, i), env);
-    gml_value_t value = gml_array_create(gml, elements, length);
-    free(elements);
-    return value;
-}
-
-static gml_value_t gml_eval_table(gml_state_t *gml, ast_t *expr, gml_env_t *env) {
-    size_t      length  = list_length(expr->table);
-    gml_value_t table   = gml_table_create(gml);
-    int         isclass = 0;
-    for (size_t i = 0; i < length; i++) {
-        ast_t      *entry = list_at(expr->table, i);
-        gml_value_t key   = gml_eval(gml, entry->dictentry.key,  env);
-        gml_value_t value = gml_eval(gml, entry->dictentry.expr, env);
-
-        /*
-         * If there is a function which contains a `self' as the first
-         * formal, then we mark the table as being a class one.
-         */
-        if (isclass == 0 && gml_value_typeof(gml, value) == GML_TYPE_FUNCTION) {
-            isclass = 1;
-            list_push(gml->classes, gml_value_unbox(gml, table));
-        }
-
-        gml_table_put(gml, table, key, value);
+static gml_value_t gml_vm_unary(gml_state_t *gml, gml_position_t *position, lex_token_class_t op, gml_value_t value) {
+    gml_type_t type = gml_value_typeof(gml, value);
+    if (type != GML_TYPE_NUMBER) {
+        gml_error(position, "invalid type `%s' in unary expression `%s'",
+            gml_typename(gml, type),
+            lex_token_classname(op));
+        gml_abort(gml);
     }
-    return table;
+    return (op == LEX_TOKEN_MINUS) ? -value : (gml_value_t)~(uint32_t)value;
 }
 
-static gml_value_t gml_eval_assign_variable(gml_state_t *gml, ast_t *expr, gml_env_t *env) {
-    gml_value_t value = gml_eval(gml, expr->binary.right, env);
-    gml_value_t *old;
-    if (gml_env_lookup(env, expr->binary.left->ident, &old)) {
-        if (gml_value_typeof(gml, *old) != GML_TYPE_NUMBER) {
-            gml_header_t *head = gml_value_unbox(gml, *old);
-            head->destroy(gml, *old);
-            list_erase(gml->objects, head);
-        }
-        *old = value;
-    } else {
-        gml_env_bind(env, expr->binary.left->ident, value);
-    }
-    return value;
+/* Slots of a frame not yet bound hold a boxed null pointer */
+#define GML_VM_UNBOUND ((gml_value_box_t) { .u64 = GML_VALUE_BOX_TAG }.val)
+
+static inline int gml_vm_isunbound(gml_value_t value) {
+    gml_value_box_t box = { .val = value };
+    return box.u64 == GML_VALUE_BOX_TAG;
 }
 
-static gml_value_t gml_eval_assign_array(gml_state_t *gml, gml_value_t array, gml_value_t index, ast_t *expr, gml_env_t *env) {
-    gml_value_t value = gml_eval(gml, expr, env);
-    gml_type_t  type  = gml_value_typeof(gml, index);
-    if (type != GML_TYPE_NUMBER) {
-        gml_error(
-            &expr->position,
-            "invalid array subscript: Expected type `number', got type `%s'.",
-            gml_typename(gml, type)
-        );
+/* Make sure the stack can hold the frame of a chunk starting at slots */
+static void gml_vm_reserve(gml_state_t *gml, chunk_t *chunk, gml_value_t *slots) {
+    if (slots + chunk->nslots + chunk->maxstack > gml->stack + gml->stacksize) {
+        gml_throw(false, "stack overflow in `%s'", chunk->name ? chunk->name : "<lambda>");
         gml_abort(gml);
     }
-    gml_array_set(gml, array, (size_t)gml_number_value(gml, index), value);
-    return value;
 }
 
-static gml_value_t gml_eval_assign_table(gml_state_t *gml, gml_value_t table, gml_value_t key, ast_t *expr, gml_env_t *env) {
-    gml_value_t value = gml_eval(gml, expr, env);
-    if (!gml_istable(gml, key)) {
-        gml_throw(true, "Table is not a hashtable.");
+/* Make room for the frame of a call to a chunk, failing past the depth limit */
+static gml_frame_t *gml_vm_push(gml_state_t *gml, chunk_t *chunk) {
+    if (gml->nframes >= gml->depth) {
+        gml_throw(false, "stack overflow in `%s'", chunk->name ? chunk->name : "<lambda>");
         gml_abort(gml);
     }
-    /*
-     * Deal with binding the `self' formal for the function if assigning
-     * a method function to the table.
-     */
-    if (gml_value_typeof(gml, value) == GML_TYPE_FUNCTION) {
-        gml_function_t *fun = (gml_function_t*)gml_value_unbox(gml, value);
-        if (!strcmp(list_at(fun->formals, 0), "self")) {
-            /*
-             * If the table hasn't already been promoted to a class we'll
-             * promote it now.
-             */
-            gml_table_t *unbox = (gml_table_t*)gml_value_unbox(gml, table);
-            if (!list_find(gml->classes, unbox))
-                list_push(gml->classes, unbox);
-
-            gml_env_bind(fun->env, "self", table);
+    if (gml->nframes == gml->maxframes) {
+        size_t       capacity = gml->maxframes ? gml->maxframes * 2 : 64;
+        gml_frame_t *frames   = realloc(gml->frames, sizeof(gml_frame_t) * capacity);
+        if (!frames) {
+            gml_throw(true, "out of memory growing the call stack");
+            gml_abort(gml);
         }
+        gml->frames    = frames;
+        gml->maxframes = capacity;
     }
-    gml_table_put(gml, table, key, value);
-    return value;
+    return &gml->frames[gml->nframes++];
 }
 
-static gml_value_t gml_eval_assign(gml_state_t *gml, ast_t *expr, gml_env_t *env) {
-    if (expr->binary.left->class == AST_IDENT)
-        return gml_eval_assign_variable(gml, expr, env);
-    if (expr->binary.left->class != AST_SUBSCRIPT) {
-        goto expect_lvalue;
-    }
-    gml_value_t target = gml_eval(gml, expr->binary.left->subscript.expr, env);
-    gml_value_t key    = gml_eval(gml, expr->binary.left->subscript.key,  env);
+static gml_upvalue_t *gml_vm_capture(gml_state_t *gml, gml_value_t *slot) {
+    gml_upvalue_t **link = &gml->upvalues;
+    while (*link && (*link)->location > slot)
+        link = &(*link)->next;
+    if (*link && (*link)->location == slot)
+        return *link;
 
-    switch (gml_value_typeof(gml, target)) {
-        case GML_TYPE_ARRAY: return gml_eval_assign_array(gml, target, key, expr->binary.right, env);
-        case GML_TYPE_TABLE: return gml_eval_assign_table(gml, target, key, expr->binary.right, env);
-        default:
-        expect_lvalue:
-            gml_error(
-                &expr->position,
-                "Assignment target is not a valid lvalue."
-            );
-            gml_abort(gml);
-            break;
+    gml_upvalue_t *upvalue = malloc(sizeof(*upvalue));
+    if (!upvalue) {
+        gml_throw(true, "out of memory capturing a variable");
+        gml_abort(gml);
+    }
+    upvalue->location   = slot;
+    upvalue->refs       = 0;
+    upvalue->remembered = 0;
+    upvalue->next     = *link;
+    *link = upvalue;
+    return upvalue;
+}
+
+/* Close the open upvalues referring to slots at or above the given one */
+static void gml_vm_close(gml_state_t *gml, gml_value_t *slot) {
+    while (gml->upvalues && gml->upvalues->location >= slot) {
+        gml_upvalue_t *upvalue = gml->upvalues;
+        gml->upvalues = upvalue->next;
+        if (upvalue->refs == 0) {
+            free(upvalue);
+            continue;
+        }
+        upvalue->value    = *upvalue->location;
+        upvalue->location = &upvalue->value;
+        gml_gc_barrier_box(gml, upvalue);
     }
-    return gml_nil_create(gml);
 }
 
-static void gml_typecheck(gml_state_t *gml, gml_position_t position, gml_value_t value, gml_type_t type) {
-    gml_type_t actual = gml_value_typeof(gml, value);
-    if (actual != type) {
-        gml_error(&position, "Expected type `%s' but expression has type `%s'.",
-            gml_typename(gml, type),
-            gml_typename(gml, actual));
+/*
+ * A slot read before the variable is bound falls back to the global of
+ * the same name, that is the variable the name referred to until then.
+ */
+static gml_value_t gml_vm_slot(gml_state_t *gml, gml_position_t *position, const char *name, gml_value_t value) {
+    gml_value_t *lookup;
+    if (!gml_vm_isunbound(value))
+        return value;
+    if (!gml_env_lookup(gml->global, name, &lookup)) {
+        gml_error(position, "`%s' is unbound.", name);
         gml_abort(gml);
     }
+    return *lookup;
 }
 
-static gml_value_t gml_eval_binary(gml_state_t *gml, ast_t *expr, gml_env_t *env) {
-    if (expr->binary.op == LEX_TOKEN_ASSIGN)
-        return gml_eval_assign(gml, expr, env);
+static gml_value_t gml_vm_table(gml_state_t *gml, gml_value_t *entries, size_t length) {
+    gml_value_t table = gml_table_create(gml);
+    for (size_t i = 0; i < length; i++) {
+        gml_value_t key   = entries[i * 2 + 0];
+        gml_value_t value = entries[i * 2 + 1];
 
-    gml_value_t vleft  = gml_eval(gml, expr->binary.left,  env);
-    gml_value_t vright = gml_eval(gml, expr->binary.right, env);
-    gml_value_t vtrue  = gml_true_create(gml);
-    gml_value_t vfalse = gml_false_create(gml);
-    double      nleft;
-    double      nright;
+        /*
+         * If there is a function which contains a `self' as the first
+         * formal, then we mark the table as being a class one.
+         */
+        if (gml_value_typeof(gml, value) == GML_TYPE_FUNCTION)
+            ((gml_table_t*)gml_value_unbox(gml, table))->isclass = 1;
 
-    switch (expr->binary.op) {
-        case LEX_TOKEN_PLUS:
-        case LEX_TOKEN_MINUS:
-        case LEX_TOKEN_MUL:
-        case LEX_TOKEN_DIV:
-        case LEX_TOKEN_MOD:
-        case LEX_TOKEN_LESS:
-        case LEX_TOKEN_GREATER:
-        case LEX_TOKEN_LEQUAL:
-        case LEX_TOKEN_GEQUAL:
-        case LEX_TOKEN_BITAND:
-        case LEX_TOKEN_BITOR:
-        case LEX_TOKEN_BITLSHIFT:
-        case LEX_TOKEN_BITRSHIFT:
-        case LEX_TOKEN_BITXOR:
-            gml_typecheck(gml, expr->position, vleft, gml_value_typeof(gml, vright));
-
-            /* String concatenation */
-            if (gml_value_typeof(gml, vright) == GML_TYPE_STRING && expr->binary.op == LEX_TOKEN_PLUS) {
-                const char *lhs = gml_string_utf8data(gml, vleft);
-                const char *rhs = gml_string_utf8data(gml, vright);
-                return gml_string_create_cat(gml, lhs, rhs);
-            }
+        gml_table_put(gml, table, key, value);
+    }
+    return table;
+}
 
-            /* Array concatenation */
-            if (gml_value_typeof(gml, vright) == GML_TYPE_ARRAY && expr->binary.op == LEX_TOKEN_PLUS)
-                return gml_array_create_cat(gml, vleft, vright);
-
-            nleft  = gml_number_create(gml, vleft);
-            nright = gml_number_create(gml, vright);
-
-            switch (expr->binary.op) {
-                case LEX_TOKEN_PLUS:      return gml_number_create(gml, nleft + nright);
-                case LEX_TOKEN_MINUS:     return gml_number_create(gml, nleft - nright);
-                case LEX_TOKEN_MUL:       return gml_number_create(gml, nleft * nright);
-                case LEX_TOKEN_DIV:       return gml_number_create(gml, nleft / nright);
-                case LEX_TOKEN_MOD:       return gml_number_create(gml, (uint32_t)nleft %  (uint32_t)nright);
-                case LEX_TOKEN_BITAND:    return gml_number_create(gml, (uint32_t)nleft &  (uint32_t)nright);
-                case LEX_TOKEN_BITOR:     return gml_number_create(gml, (uint32_t)nleft |  (uint32_t)nright);
-                case LEX_TOKEN_BITXOR:    return gml_number_create(gml, (uint32_t)nleft ^  (uint32_t)nright);
-                case LEX_TOKEN_BITLSHIFT: return gml_number_create(gml, (uint32_t)nleft << (uint32_t)nright);
-                case LEX_TOKEN_BITRSHIFT: return gml_number_create(gml, (uint32_t)nleft >> (uint32_t)nright);
-                case LEX_TOKEN_LESS:      return nleft <  nright ? vtrue : vfalse;
-                case LEX_TOKEN_GREATER:   return nleft >  nright ? vtrue : vfalse;
-                case LEX_TOKEN_LEQUAL:    return nleft <= nright ? vtrue : vfalse;
-                case LEX_TOKEN_GEQUAL:    return nleft >= nright ? vtrue : vfalse;
-                default:
-                    gml_throw(true, "operation %s is not a binary operation",
-                        lex_token_classname(expr->binary.op));
-                    break;
-            }
-            break;
-
-        case LEX_TOKEN_IS:     return gml_same(gml, vleft, vright) ? vtrue : vfalse;
-        case LEX_TOKEN_EQUAL:  return gml_equal(gml, vleft, vright) ? vtrue : vfalse;
-        case LEX_TOKEN_NEQUAL: return gml_equal(gml, vleft, vright) ? vfalse : vtrue;
-        case LEX_TOKEN_AND:    return gml_istrue(gml, vleft) ? vright : vleft;
-        case LEX_TOKEN_OR:     return gml_isfalse(gml, vleft) ? vright : vleft;
-
-        default:
-            gml_throw(true, "operation %s is not a binary operation",
-                lex_token_classname(expr->binary.op));
-            break;
-    }
-    return gml_nil_create(gml);
-}
-
-static gml_value_t gml_eval_unary(gml_state_t *gml, ast_t *expr, gml_env_t *env) {
-    gml_value_t value;
-    gml_type_t  type;
-
-    switch (expr->unary.op) {
-        case LEX_TOKEN_NOT:
-            if (gml_istrue(gml, gml_eval(gml, expr->unary.expr, env)))
-                return gml_false_create(gml);
-            return gml_true_create(gml);
-        case LEX_TOKEN_PLUS:
-            return gml_eval(gml, expr->unary.expr, env);
-        case LEX_TOKEN_MINUS:
-            value = gml_eval(gml, expr->unary.expr, env);
-            type  = gml_value_typeof(gml, value);
-            if (type != GML_TYPE_NUMBER) {
-                gml_error(&expr->position, "invalid type `%s' in unary expression `%s'",
-                    gml_typename(gml, type),
-                    lex_token_classname(expr->unary.op));
-                gml_abort(gml);
-            }
-            value = -value;
-            return value;
-        case LEX_TOKEN_BITNOT:
-            value = gml_eval(gml, expr->unary.expr, env);
-            type  = gml_value_typeof(gml, value);
-            if (type != GML_TYPE_NUMBER) {
-                gml_error(&expr->position, "invalid type `%s' in unary expression `%s'",
-                    gml_typename(gml, type),
-                    lex_token_classname(expr->unary.op));
-                gml_abort(gml);
-            }
-            value = ~(uint32_t)value;
-            return value;
-        default:
-            gml_throw(true, "operation %s is not a unary operation",
-                lex_token_classname(expr->binary.op));
-            break;
-    }
-    return gml_nil_create(gml);
-}
-
-static void gml_eval_subscript_check(gml_state_t *gml, gml_position_t *position, gml_value_t key, gml_value_t value) {
+static void gml_vm_subscript_check(gml_state_t *gml, gml_position_t *position, gml_value_t key, gml_value_t value) {
     gml_type_t keytype  = gml_value_typeof(gml, key);
     gml_type_t exprtype = gml_value_typeof(gml, value);
     if (keytype != GML_TYPE_NUMBER) {
@@ -1299,57 +2503,52 @@ static void gml_eval_subscript_check(gml_state_t *gml, gml_position_t *position,
         gml_abort(gml);
     }
 
-    int index  = (int)gml_number_value(gml, key);
-    int length = (exprtype == GML_TYPE_STRING)
-                    ? (int)gml_string_length(gml, value)
-                    : (int)gml_array_length(gml, value);
+    /* Fractions truncate like the conversion to an index does */
+    double index = trunc(gml_number_value(gml, key));
+    size_t length;
+    switch (exprtype) {
+        case GML_TYPE_STRING: length = gml_string_length(gml, value); break;
+        case GML_TYPE_BUFFER: length = gml_buffer_length(gml, value); break;
+        default:              length = gml_array_length(gml, value); break;
+    }
 
-    if (index < 0 || index >= length) {
+    if (!(index >= 0 && index < (double)length)) {
         gml_error(
             position,
-            "subscripting index out of bounds (index=%d, length=%d).",
-            (int)index,
-            (int)length
+            "subscripting index out of bounds (index=%.0f, length=%zu).",
+            index,
+            length
         );
         gml_abort(gml);
     }
 }
 
-static gml_value_t gml_eval_subscript(gml_state_t *gml, ast_t *subexpr, gml_env_t *env) {
-    gml_value_t expr     = gml_eval(gml, subexpr->subscript.expr, env);
-    gml_value_t key      = gml_eval(gml, subexpr->subscript.key,  env);
+static gml_value_t gml_vm_subscript(gml_state_t *gml, gml_position_t *position, gml_value_t expr, gml_value_t key) {
     gml_type_t  exprtype = gml_value_typeof(gml, expr);
     gml_value_t value;
     switch (exprtype) {
         case GML_TYPE_ARRAY:
-            gml_eval_subscript_check(gml, &subexpr->position, key, expr);
+            gml_vm_subscript_check(gml, position, key, expr);
             return gml_array_get(gml, expr, (size_t)gml_number_value(gml, key));
         case GML_TYPE_TABLE:
             value = gml_table_get(gml, expr, key);
-            if (list_find(gml->classes, (const void *)gml_value_unbox(gml, expr))) {
-                /*
-                 * If the table is a class, we need to do a quick check to
-                 * evaluate that the subscript yeilds a method that passes
-                 * self.
-                 */
-                if (gml_value_typeof(gml, value) == GML_TYPE_FUNCTION) {
-                    /*
-                     * If the first formal of the function is `self' then
-                     * this is a method and we need to bind the table to
-                     * the functions environment as `self'.
-                     */
-                    gml_function_t *fun = (gml_function_t*)gml_value_unbox(gml, value);
-                    if (!strcmp(list_at(fun->formals, 0), "self"))
-                        gml_env_bind(fun->env, "self", expr);
-                }
-            }
+            /*
+             * If the table is a class and the subscript yields a method,
+             * that is a function whose first formal is `self', then we
+             * need to bind the table to the function as `self'.
+             */
+            if (((gml_table_t*)gml_value_unbox(gml, expr))->isclass && gml_function_ismethod(gml, value))
+                return gml_function_bind(gml, value, expr);
             return value;
         case GML_TYPE_STRING:
-            gml_eval_subscript_check(gml, &subexpr->position, key, expr);
+            gml_vm_subscript_check(gml, position, key, expr);
             return gml_string_substring(gml, expr, (size_t)gml_number_value(gml, key), 1);
+        case GML_TYPE_BUFFER:
+            gml_vm_subscript_check(gml, position, key, expr);
+            return gml_number_create(gml, gml_buffer_get(gml, expr, (size_t)gml_number_value(gml, key)));
         default:
             gml_error(
-                &subexpr->position,
+                position,
                 "Subscripting on unsupported type `%s' `%s'.",
                 gml_typename(gml, exprtype),
                 gml_typename(gml, gml_value_typeof(gml, key))
@@ -1360,166 +2559,943 @@ static gml_value_t gml_eval_subscript(gml_state_t *gml, ast_t *subexpr, gml_env_
     return gml_nil_create(gml);
 }
 
-static gml_value_t gml_eval_lambda(gml_state_t *gml, ast_t *expr, gml_env_t *env) {
-    char name[1024];
-    snprintf(name, sizeof(name), "#lambda(%zu)", gml->lambdaindex++);
-    return gml_function_create(gml,
-                               name,
-                               expr->lambda.formals,
-                               expr->lambda.body,
-                               env);
+static gml_value_t gml_vm_setindex(gml_state_t *gml, gml_position_t *position, gml_value_t target, gml_value_t key, gml_value_t value) {
+    gml_type_t type;
+    switch (gml_value_typeof(gml, target)) {
+        case GML_TYPE_ARRAY:
+            if ((type = gml_value_typeof(gml, key)) != GML_TYPE_NUMBER) {
+                gml_error(
+                    position,
+                    "invalid array subscript: Expected type `number', got type `%s'.",
+                    gml_typename(gml, type)
+                );
+                gml_abort(gml);
+            }
+            gml_vm_subscript_check(gml, position, key, target);
+            gml_array_set(gml, target, (size_t)gml_number_value(gml, key), value);
+            return value;
+
+        case GML_TYPE_BUFFER:
+            gml_vm_subscript_check(gml, position, key, target);
+            if ((type = gml_value_typeof(gml, value)) != GML_TYPE_NUMBER) {
+                gml_error(
+                    position,
+                    "invalid buffer element: Expected type `number', got type `%s'.",
+                    gml_typename(gml, type)
+                );
+                gml_abort(gml);
+            }
+            gml_buffer_set(gml, target, (size_t)gml_number_value(gml, key), gml_number_value(gml, value));
+            return value;
+
+        case GML_TYPE_TABLE:
+            if (!gml_istable(gml, key)) {
+                gml_throw(true, "Table is not a hashtable.");
+                gml_abort(gml);
+            }
+            /*
+             * Assigning a method function to the table promotes it to a
+             * class, methods taken from it are then bound to it.
+             */
+            if (gml_function_ismethod(gml, value))
+                ((gml_table_t*)gml_value_unbox(gml, target))->isclass = 1;
+            gml_table_put(gml, target, key, value);
+            return value;
+
+        default:
+            gml_error(position, "Assignment target is not a valid lvalue.");
+            gml_abort(gml);
+            break;
+    }
+    return gml_nil_create(gml);
 }
 
-static gml_value_t gml_eval_declfun(gml_state_t *gml, ast_t *expr, gml_env_t *env) {
-    gml_value_t value = gml_function_create(gml,
-                            expr->fundecl.name,
-                            expr->fundecl.impl.formals,
-                            expr->fundecl.impl.body,
-                            env);
-    gml_env_bind(env, expr->fundecl.name, value);
+/*
+ * Field accesses with a constant atom key first look for the shape of a
+ * record in their inline cache, which yields the slot of the field without
+ * searching the keys. Anything else takes the way of a subscript.
+ */
+static inline gml_value_t gml_vm_cacheatom(gml_state_t *gml, cache_t *cache) {
+    if (!cache->atom)
+        cache->atom = gml_value_unbox(gml, gml_atom_create(gml, cache->name));
+    return gml_value_box(gml, cache->atom);
+}
+
+static inline size_t gml_vm_cachefind(cache_t *cache, gml_shape_t *shape) {
+    for (size_t i = 0; i < CACHE_WAYS; i++)
+        if (cache->shapes[i] == shape)
+            return i;
+    return CACHE_WAYS;
+}
+
+/* Once every way of a cache is used the access stays uncached */
+static void gml_vm_cacheadd(cache_t *cache, gml_shape_t *shape, gml_shape_t *target, size_t slot) {
+    size_t way = gml_vm_cachefind(cache, NULL);
+    if (way == CACHE_WAYS)
+        return;
+    cache->shapes[way]  = shape;
+    cache->targets[way] = target;
+    cache->slots[way]   = slot;
+}
+
+/* The field of a table as it is, methods aren't bound */
+static gml_value_t gml_vm_field(gml_state_t *gml, gml_position_t *position, cache_t *cache, gml_value_t expr) {
+    if (gml_value_typeof(gml, expr) != GML_TYPE_TABLE)
+        return gml_vm_subscript(gml, position, expr, gml_vm_cacheatom(gml, cache));
+
+    gml_table_t *table = (gml_table_t*)gml_value_unbox(gml, expr);
+    gml_shape_t *shape = table->shape;
+    size_t       way   = shape ? gml_vm_cachefind(cache, shape) : CACHE_WAYS;
+    if (way != CACHE_WAYS)
+        return table->slots[cache->slots[way]];
+    if (shape) {
+        size_t slot = gml_shape_find(shape, gml_vm_cacheatom(gml, cache));
+        if (slot == table->count)
+            return gml_nil_create(gml);
+        gml_vm_cacheadd(cache, shape, NULL, slot);
+        return table->slots[slot];
+    }
+    return gml_table_get(gml, expr, gml_vm_cacheatom(gml, cache));
+}
+
+static inline int gml_vm_ismethod(gml_state_t *gml, gml_value_t expr, gml_value_t value) {
+    return gml_value_typeof(gml, expr) == GML_TYPE_TABLE
+        && ((gml_table_t*)gml_value_unbox(gml, expr))->isclass
+        && gml_function_ismethod(gml, value);
+}
+
+static gml_value_t gml_vm_getfield(gml_state_t *gml, gml_position_t *position, cache_t *cache, gml_value_t expr) {
+    gml_value_t value = gml_vm_field(gml, position, cache, expr);
+    if (gml_vm_ismethod(gml, expr, value))
+        return gml_function_bind(gml, value, expr);
     return value;
 }
 
-static gml_value_t gml_eval_declvar(gml_state_t *gml, ast_t *expr, gml_env_t *env) {
-    const char *name = expr->vardecl.name;
-    gml_value_t value = (expr->vardecl.initializer)
-                            ? gml_eval(gml, expr->vardecl.initializer, env)
-                            : gml_nil_create(gml);
-    gml_env_bind(env, name, value);
+/*
+ * Calling a field pushes the table as the first argument of a method, so
+ * the method need not be bound. Anything else gets a placeholder instead.
+ */
+static void gml_vm_method(gml_state_t *gml, gml_position_t *position, cache_t *cache, gml_value_t *sp) {
+    gml_value_t expr  = sp[-1];
+    gml_value_t value = gml_vm_field(gml, position, cache, expr);
+    sp[-1] = value;
+    sp[0]  = gml_vm_ismethod(gml, expr, value) ? expr : GML_VM_UNBOUND;
+}
+
+static gml_value_t gml_vm_setfield(gml_state_t *gml, gml_position_t *position, cache_t *cache, gml_value_t target, gml_value_t value) {
+    gml_table_t *table = NULL;
+    gml_shape_t *shape = NULL;
+    size_t       way   = CACHE_WAYS;
+
+    /* Methods stored in a table make it a class, which the subscript does */
+    if (gml_value_typeof(gml, target) == GML_TYPE_TABLE && !gml_function_ismethod(gml, value)) {
+        table = (gml_table_t*)gml_value_unbox(gml, target);
+        shape = table->shape;
+        way   = shape ? gml_vm_cachefind(cache, shape) : CACHE_WAYS;
+    }
+    if (way != CACHE_WAYS) {
+        if (cache->targets[way]) {
+            gml_table_append(gml, table, (gml_shape_t*)cache->targets[way], value);
+        } else {
+            gml_gc_barrier(gml, &table->header, value);
+            table->slots[cache->slots[way]] = value;
+        }
+        return value;
+    }
+
+    gml_vm_setindex(gml, position, target, gml_vm_cacheatom(gml, cache), value);
+    if (shape && table->shape == shape)
+        gml_vm_cacheadd(cache, shape, NULL, gml_shape_find(shape, gml_vm_cacheatom(gml, cache)));
+    else if (shape && table->shape)
+        gml_vm_cacheadd(cache, shape, table->shape, shape->length);
     return value;
 }
 
-static gml_value_t gml_eval_if(gml_state_t *gml, ast_t *expr, gml_env_t *env) {
-    size_t nclauses = list_length(expr->ifstmt);
-    for (size_t i = 0; i < nclauses; i++) {
-        ast_t *clause = list_at(expr->ifstmt, i);
-        if (!clause->ifclause.condition || gml_istrue(gml, gml_eval(gml, clause->ifclause.condition, env)))
-            return gml_eval_block(gml, clause->ifclause.body, env);
+/*
+ * Set up the frame of a function with the arguments already on the stack
+ * at the bottom of it. If a self is given the arguments are shifted up to
+ * make room for it. The stack must have been reserved for the frame.
+ */
+static void gml_vm_enter(gml_state_t *gml, gml_function_t *fun, gml_header_t *self, gml_value_t *slots, size_t nargs) {
+    chunk_t *chunk  = fun->chunk;
+    size_t   method = self ? 1 : 0;
+    size_t   bound  = nargs + method < chunk->nformals ? nargs : chunk->nformals - method;
+
+    if (method) {
+        memmove(slots + 1, slots, sizeof(gml_value_t) * bound);
+        slots[0] = gml_value_box(gml, self);
     }
-    return gml_nil_create(gml);
+    for (size_t i = bound + method; i < chunk->nslots; i++)
+        slots[i] = GML_VM_UNBOUND;
 }
 
-static gml_value_t gml_eval_while(gml_state_t *gml, ast_t *expr, gml_env_t *env) {
-    gml_value_t result = gml_nil_create(gml);
-    while (gml_istrue(gml, gml_eval(gml, expr->whilestmt.condition, env)))
-        result = gml_eval_block(gml, expr->whilestmt.body, env);
-    return result;
+static gml_value_t gml_vm_invoke(gml_state_t *gml, gml_function_t *fun, gml_header_t *self, gml_value_t *slots, size_t nargs) {
+    gml_vm_reserve(gml, fun->chunk, slots);
+    gml_vm_enter(gml, fun, self, slots, nargs);
+    return gml_vm_execute(gml, fun->chunk, fun, slots);
 }
 
-static gml_value_t gml_eval_for_type(gml_state_t *gml, list_t *formals, list_t *body, gml_value_t value, gml_env_t *env) {
-    size_t      i;
-    size_t      nformals  = list_length(formals);
-    size_t      nelements = 0;
-    gml_value_t result;
-    list_t     *keys;
+static gml_value_t gml_vm_call(gml_state_t *gml, gml_position_t *position, gml_value_t callee, gml_value_t *args, size_t nargs) {
+    gml_type_t      calltype = gml_value_typeof(gml, callee);
+    gml_function_t *fun;
+    gml_native_t   *native;
+    char            message[256];
 
-    switch (gml_value_typeof(gml, value)) {
-        case GML_TYPE_ARRAY:
-            nelements = gml_array_length(gml, value);
-            for (i = 0; i < nelements; i += nformals) {
-                for (size_t j = 0; j < nformals && i + j < nelements; j++) {
-                    const char *name = list_at(formals, j);
-                    gml_env_bind(env, name, gml_array_get(gml, value, i + j));
-                }
-                result = gml_eval_block(gml, body, env);
-            }
-            return result;
+    switch (calltype) {
+        case GML_TYPE_FUNCTION:
+            /*
+             * If the function has a `self' bound already it means the function
+             * is a method taken from a table which was promoted to a class.
+             *
+             * We need to start from formals[1] instead.
+             */
+            fun = (gml_function_t*)gml_value_unbox(gml, callee);
+            return gml_vm_invoke(gml, fun, fun->self, args, nargs);
 
-        case GML_TYPE_STRING:
-            nelements = gml_string_length(gml, value);
-            for (i = 0; i < nelements; i += nformals) {
-                for (size_t j = 0; j < nformals && i + j < nelements; j++) {
-                    const char *name = list_at(formals, j);
-                    gml_env_bind(env, name, gml_string_substring(gml, value, i + j, 1));
-                }
-                result = gml_eval_block(gml, body, env);
+        case GML_TYPE_NATIVE:
+            native = (gml_native_t*)gml_value_unbox(gml, callee);
+            if (!gml_native_accepts(gml, native, args, nargs)) {
+                gml_native_reject(gml, native, args, nargs, message, sizeof(message));
+                gml_error(position, "%s", message);
+                gml_abort(gml);
             }
-            return result;
+            return native->func(gml, args, nargs);
 
-        case GML_TYPE_TABLE:
-            keys      = gml_table_keys(gml, value);
-            nelements = list_length(keys);
-            for (i = 0; i < nelements; i += nformals) {
-                for (size_t j = 0; j < nformals && i + j < nelements; j++) {
-                    const char  *name = list_at(formals, j);
-                    gml_value_t  key  = *(gml_value_t*)list_at(keys, i + j);
-                    gml_value_t  val  = gml_table_get(gml, value, key);
-                    gml_value_t  pair = gml_array_create(gml, (gml_value_t[]) { key, val }, 2);
-                    gml_env_bind(env, name, pair);
+        default:
+            gml_error(position, "Type `%s' is not a callable type.", gml_typename(gml, calltype));
+            gml_abort(gml);
+            break;
+    }
+    return gml_nil_create(gml);
+}
+
+/*
+ * The object of a string, atom or array literal, made the first time the
+ * literal is evaluated. Arrays are mutable so array literals yield the
+ * array every evaluation copies.
+ */
+static gml_value_t gml_vm_literal(gml_state_t *gml, constant_t *constants, size_t index) {
+    constant_t  *constant = &constants[index];
+    gml_array_t *array;
+    gml_value_t  value;
+
+    if (constant->value)
+        return gml_value_box(gml, constant->value);
+    switch (constant->class) {
+        case CONSTANT_NUMBER:
+            return gml_number_create(gml, constant->number);
+        case CONSTANT_STRING:
+            value = gml_string_literal(gml, constant->string);
+            if (gml_value_typeof(gml, value) != GML_TYPE_STRING)
+                return value;
+            break;
+        case CONSTANT_ATOM:
+            /* Failing to make an atom yields nil too */
+            value = gml_atom_create(gml, constant->string);
+            if (gml_value_identical(value, gml->atomnil) && strcmp(constant->string, "nil"))
+                return value;
+            break;
+        case CONSTANT_ARRAY:
+            /* Old like everything it holds so it never refers to young objects */
+            if (!(array = gml_array_allocate(gml, constant->array.nitems, 0)))
+                return gml_nil_create(gml);
+            for (size_t i = 0; i < constant->array.nitems; i++) {
+                value = gml_vm_literal(gml, constants, constant->array.items[i]);
+                if (gml_value_identical(value, gml->atomnil) && constants[constant->array.items[i]].class != CONSTANT_ATOM) {
+                    array->length = i;
+                    return value;
                 }
-                result = gml_eval_block(gml, body, env);
+                array->elements[i] = value;
             }
-            return result;
-
-        case GML_TYPE_FUNCTION:
+            value = gml_value_box(gml, &array->header);
             break;
+        default:
+            return gml_nil_create(gml);
+    }
+    constant->value = gml_value_unbox(gml, value);
+    return value;
+}
+
+static gml_value_t gml_vm_closure(gml_state_t *gml, chunk_t *chunk, gml_function_t *enclosing, gml_value_t *slots) {
+    char        name[1024];
+    gml_value_t value;
+    if (chunk->name) {
+        value = gml_function_create(gml, chunk->name, chunk);
+    } else {
+        snprintf(name, sizeof(name), "#lambda(%zu)", gml->lambdaindex++);
+        value = gml_function_create(gml, name, chunk);
+    }
+    if (gml_value_typeof(gml, value) != GML_TYPE_FUNCTION)
+        return value;
+
+    gml_function_t *fun = (gml_function_t*)gml_value_unbox(gml, value);
+    for (size_t i = 0; i < chunk->nupvalues; i++) {
+        upvalue_t *upvalue = &chunk->upvalues[i];
+        fun->upvalues[i] = upvalue->local
+            ? gml_vm_capture(gml, &slots[upvalue->index])
+            : enclosing->upvalues[upvalue->index];
+        fun->upvalues[i]->refs++;
+    }
+    return value;
+}
+
+/* The loop state of a for loop is kept on the stack as: subject keys index */
+static gml_value_t gml_vm_forprep(gml_state_t *gml, gml_value_t subject) {
+    if (gml_value_typeof(gml, subject) != GML_TYPE_TABLE)
+        return gml_nil_create(gml);
+
+    list_t      *keys   = gml_table_keys(gml, subject);
+    size_t       length = list_length(keys);
+    gml_value_t *copy   = malloc(sizeof(gml_value_t) * (length ? length : 1));
+    if (!copy) {
+        list_destroy(keys);
+        return gml_nil_create(gml);
+    }
+    list_iterator_t *it = list_iterator_create(keys);
+    for (size_t i = 0; !list_iterator_end(it); i++)
+        copy[i] = *(gml_value_t*)list_iterator_next(it);
+    list_iterator_destroy(it);
+    list_destroy(keys);
 
+    gml_value_t value = gml_array_create(gml, copy, length);
+    free(copy);
+    return value;
+}
+
+static size_t gml_vm_forlength(gml_state_t *gml, gml_value_t subject, gml_value_t keys) {
+    switch (gml_value_typeof(gml, subject)) {
+        case GML_TYPE_ARRAY:  return gml_array_length(gml, subject);
+        case GML_TYPE_BUFFER: return gml_buffer_length(gml, subject);
+        case GML_TYPE_STRING: return gml_string_length(gml, subject);
+        case GML_TYPE_TABLE:  return gml_array_length(gml, keys);
         default:
             break;
     }
+    return 0;
+}
 
+static gml_value_t gml_vm_forelement(gml_state_t *gml, gml_value_t subject, gml_value_t keys, size_t index) {
+    gml_value_t key;
+    switch (gml_value_typeof(gml, subject)) {
+        case GML_TYPE_ARRAY:
+            return gml_array_get(gml, subject, index);
+        case GML_TYPE_BUFFER:
+            return gml_number_create(gml, gml_buffer_get(gml, subject, index));
+        case GML_TYPE_STRING:
+            return gml_string_substring(gml, subject, index, 1);
+        case GML_TYPE_TABLE:
+            key = gml_array_get(gml, keys, index);
+            return gml_array_create(gml, (gml_value_t[]) { key, gml_table_get(gml, subject, key) }, 2);
+        default:
+            break;
+    }
     return gml_nil_create(gml);
 }
 
-static gml_value_t gml_eval_for(gml_state_t *gml, ast_t *ast, gml_env_t *env) {
-    gml_value_t value   = gml_nil_create(gml);
-    list_t     *formals = ast->forstmt.impl.formals;
-    list_t     *body    = ast->forstmt.impl.body;
-    ast_t      *expr    = ast->forstmt.expr;
-
-    switch (expr->class) {
-        case AST_ARRAY:
-            value = gml_eval_array(gml, expr, env);
-            return gml_eval_for_type(gml, formals, body, value, env);
-        case AST_STRING:
-            value = gml_string_create(gml, expr->string);
-            return gml_eval_for_type(gml, formals, body, value, env);
-        case AST_TABLE:
-            value = gml_eval_table(gml, expr, env);
-            return gml_eval_for_type(gml, formals, body, value, env);
-        case AST_CALL:
-            value = gml_eval_call(gml, expr, env);
-            return gml_eval_for_type(gml, formals, body, value, env);
+#define GML_VM_ARITH(OP, EXPR)                                                           \
+    case OP:                                                                             \
+        if (gml_value_isnumber(sp[-2]) && gml_value_isnumber(sp[-1])) {                  \
+            double nleft  = sp[-2];                                                      \
+            double nright = sp[-1];                                                      \
+            sp[-2] = (EXPR);                                                             \
+        } else {                                                                         \
+            sp[-2] = gml_vm_binary(gml, gml_vm_position(chunk, pc), OP, sp[-2], sp[-1]); \
+        }                                                                                \
+        sp--;                                                                            \
+        break
+
+#define GML_VM_COMPARE(OP, EXPR) \
+    GML_VM_ARITH(OP, (EXPR) ? gml_true_create(gml) : gml_false_create(gml))
+
+/*
+ * Execute a chunk with its frame starting at slots. The operands of the
+ * chunk are pushed right above the slots. Functions the chunk calls run
+ * in the same loop with frames of their own, up to the frame it started
+ * with returning.
+ */
+static gml_value_t gml_vm_execute(gml_state_t *gml, chunk_t *chunk, gml_function_t *fun, gml_value_t *slots) {
+    const code_t   *code      = chunk->code;
+    const code_t   *pc        = code;
+    constant_t     *constants = chunk->constants;
+    gml_value_t    *sp        = slots + chunk->nslots;
+    gml_value_t    *lookup    = NULL;
+    size_t          base      = gml->nframes;
+    gml_frame_t    *frame;
+    gml_upvalue_t  *upvalue;
+    gml_value_t    *result;
+    gml_value_t     callee;
+    int             invoke;
+    int             method;
+    gml_value_t     value;
+    size_t          index;
+    size_t          length;
+
+    if (gml->nesting == GML_VM_NESTING) {
+        gml_throw(false, "stack overflow in `%s' called from a native", chunk->name ? chunk->name : "<lambda>");
+        gml_abort(gml);
+    }
+    frame  = gml_vm_push(gml, chunk);
+    *frame = (gml_frame_t) { chunk, fun, slots, NULL, NULL };
+    gml->nesting++;
+
+    for (;;) {
+        code_t word = *pc++;
+        switch (CODE_OP(word)) {
+            case OP_NIL:
+                *sp++ = gml_nil_create(gml);
+                break;
+            case OP_NUMBER:
+                *sp++ = gml_number_create(gml, constants[CODE_ARG(word)].number);
+                break;
+            case OP_STRING:
+            case OP_ATOM:
+                *sp++ = gml_vm_literal(gml, constants, CODE_ARG(word));
+                break;
+            case OP_POP:
+                sp--;
+                break;
+            case OP_NIP:
+                sp[-2] = sp[-1];
+                sp--;
+                break;
+
+            case OP_GETLOCAL:
+                index = CODE_ARG(word);
+                value = slots[index];
+                if (gml_vm_isunbound(value))
+                    value = gml_vm_slot(gml, gml_vm_position(chunk, pc), chunk->slots[index], value);
+                *sp++ = value;
+                break;
+            case OP_SETLOCAL:
+            case OP_BINDLOCAL:
+                slots[CODE_ARG(word)] = sp[-1];
+                break;
+            case OP_GETUPVAL:
+                index = CODE_ARG(word);
+                value = *fun->upvalues[index]->location;
+                if (gml_vm_isunbound(value))
+                    value = gml_vm_slot(gml, gml_vm_position(chunk, pc), chunk->upvalues[index].name, value);
+                *sp++ = value;
+                break;
+            case OP_SETUPVAL:
+                upvalue = fun->upvalues[CODE_ARG(word)];
+                *upvalue->location = sp[-1];
+                gml_gc_barrier_box(gml, upvalue);
+                break;
+            case OP_GETGLOBAL:
+                if (!gml_env_lookup(gml->global, constants[CODE_ARG(word)].string, &lookup)) {
+                    gml_error(gml_vm_position(chunk, pc), "`%s' is unbound.", constants[CODE_ARG(word)].string);
+                    gml_abort(gml);
+                }
+                *sp++ = *lookup;
+                break;
+            case OP_SETGLOBAL:
+                if (gml_env_lookup(gml->global, constants[CODE_ARG(word)].string, &lookup))
+                    *lookup = sp[-1];
+                else
+                    gml_env_bind(gml->global, constants[CODE_ARG(word)].string, sp[-1]);
+                break;
+            case OP_BINDGLOBAL:
+                gml_env_bind(gml->global, constants[CODE_ARG(word)].string, sp[-1]);
+                break;
+
+            case OP_ARRAY:
+                length = CODE_ARG(word);
+                value  = gml_array_create(gml, sp - length, length);
+                sp    -= length;
+                *sp++  = value;
+                break;
+            case OP_LITERAL:
+                value = gml_vm_literal(gml, constants, CODE_ARG(word));
+                if (gml_value_typeof(gml, value) == GML_TYPE_ARRAY)
+                    value = gml_array_create(gml, ((gml_array_t*)gml_value_unbox(gml, value))->elements, gml_array_length(gml, value));
+                *sp++ = value;
+                break;
+            case OP_TABLE:
+                length = CODE_ARG(word);
+                value  = gml_vm_table(gml, sp - length * 2, length);
+                sp    -= length * 2;
+                *sp++  = value;
+                break;
+            case OP_SUBSCRIPT:
+                sp[-2] = gml_vm_subscript(gml, gml_vm_position(chunk, pc), sp[-2], sp[-1]);
+                sp--;
+                break;
+            case OP_SETINDEX:
+                sp[-3] = gml_vm_setindex(gml, gml_vm_position(chunk, pc), sp[-3], sp[-2], sp[-1]);
+                sp -= 2;
+                break;
+            case OP_GETFIELD:
+                sp[-1] = gml_vm_getfield(gml, gml_vm_position(chunk, pc), &chunk->caches[CODE_ARG(word)], sp[-1]);
+                break;
+            case OP_SETFIELD:
+                sp[-2] = gml_vm_setfield(gml, gml_vm_position(chunk, pc), &chunk->caches[CODE_ARG(word)], sp[-2], sp[-1]);
+                sp--;
+                break;
+
+            GML_VM_ARITH(OP_ADD, nleft + nright);
+            GML_VM_ARITH(OP_SUB, nleft - nright);
+            GML_VM_ARITH(OP_MUL, nleft * nright);
+            GML_VM_ARITH(OP_DIV, nleft / nright);
+            GML_VM_ARITH(OP_MOD,    (uint32_t)nleft %  (uint32_t)nright);
+            GML_VM_ARITH(OP_BITAND, (uint32_t)nleft &  (uint32_t)nright);
+            GML_VM_ARITH(OP_BITOR,  (uint32_t)nleft |  (uint32_t)nright);
+            GML_VM_ARITH(OP_BITXOR, (uint32_t)nleft ^  (uint32_t)nright);
+            GML_VM_ARITH(OP_SHL,    (uint32_t)nleft << (uint32_t)nright);
+            GML_VM_ARITH(OP_SHR,    (uint32_t)nleft >> (uint32_t)nright);
+            GML_VM_COMPARE(OP_LT, nleft <  nright);
+            GML_VM_COMPARE(OP_GT, nleft >  nright);
+            GML_VM_COMPARE(OP_LE, nleft <= nright);
+            GML_VM_COMPARE(OP_GE, nleft >= nright);
+
+            case OP_EQ:
+            case OP_NE:
+            case OP_IS:
+            case OP_AND:
+            case OP_OR:
+                sp[-2] = gml_vm_binary(gml, gml_vm_position(chunk, pc), CODE_OP(word), sp[-2], sp[-1]);
+                sp--;
+                break;
+
+            case OP_NOT:
+                sp[-1] = gml_istrue(gml, sp[-1]) ? gml_false_create(gml) : gml_true_create(gml);
+                break;
+            case OP_NEGATE:
+                sp[-1] = gml_vm_unary(gml, gml_vm_position(chunk, pc), LEX_TOKEN_MINUS, sp[-1]);
+                break;
+            case OP_BITNOT:
+                sp[-1] = gml_vm_unary(gml, gml_vm_position(chunk, pc), LEX_TOKEN_BITNOT, sp[-1]);
+                break;
+
+            case OP_CALL:
+            case OP_INVOKE:
+            case OP_TAILCALL:
+            case OP_TAILINVOKE:
+                length   = CODE_ARG(word);
+                gml->top = sp;
+                if (gml_gc_due(gml))
+                    gml_gc_collect(gml);
+                invoke   = CODE_OP(word) == OP_INVOKE || CODE_OP(word) == OP_TAILINVOKE;
+                result   = sp - length - 1 - invoke;
+                callee   = *result;
+                /* A method takes the self in front of the arguments */
+                method   = invoke && !gml_vm_isunbound(sp[-length - 1]);
+                length  += method;
+                if (gml_value_typeof(gml, callee) != GML_TYPE_FUNCTION) {
+                    /* Natives in tail position return by the return following */
+                    value   = gml_vm_call(gml, gml_vm_position(chunk, pc), callee, sp - length, length);
+                    sp      = result + 1;
+                    *result = value;
+                    break;
+                }
+
+                fun = (gml_function_t*)gml_value_unbox(gml, callee);
+                if (CODE_OP(word) == OP_TAILCALL || CODE_OP(word) == OP_TAILINVOKE) {
+                    /* The callee takes over the frame of the caller */
+                    gml_vm_close(gml, slots);
+                    memmove(slots, sp - length, sizeof(gml_value_t) * length);
+                    frame = &gml->frames[gml->nframes - 1];
+                } else {
+                    gml->frames[gml->nframes - 1].pc = pc;
+                    slots         = sp - length;
+                    frame         = gml_vm_push(gml, fun->chunk);
+                    frame->result = result;
+                }
+                gml_vm_reserve(gml, fun->chunk, slots);
+                gml_vm_enter(gml, fun, method ? NULL : fun->self, slots, length);
+                frame->chunk = fun->chunk;
+                frame->fun   = fun;
+                frame->slots = slots;
+                chunk        = fun->chunk;
+                code         = chunk->code;
+                pc           = code;
+                constants    = chunk->constants;
+                sp           = slots + chunk->nslots;
+                break;
+            case OP_METHOD:
+                gml_vm_method(gml, gml_vm_position(chunk, pc), &chunk->caches[CODE_ARG(word)], sp);
+                sp++;
+                break;
+            case OP_CLOSURE:
+                *sp++ = gml_vm_closure(gml, constants[CODE_ARG(word)].chunk, fun, slots);
+                break;
+
+            case OP_JUMP:
+                /* Loops need not call anything, so back edges are safepoints too */
+                if (CODE_ARG(word) < (size_t)(pc - code) && gml_gc_due(gml)) {
+                    gml->top = sp;
+                    gml_gc_collect(gml);
+                }
+                pc = code + CODE_ARG(word);
+                break;
+            case OP_JUMPFALSE:
+                if (gml_isfalse(gml, *--sp))
+                    pc = code + CODE_ARG(word);
+                break;
+
+            case OP_FORPREP:
+                sp[0] = gml_vm_forprep(gml, sp[-1]);
+                sp[1] = gml_number_create(gml, 0);
+                sp   += 2;
+                break;
+            case OP_FORLOOP:
+                index = (size_t)gml_number_value(gml, sp[-1]);
+                if (index >= gml_vm_forlength(gml, sp[-3], sp[-2])) {
+                    sp -= 3;
+                    pc  = code + CODE_ARG(word);
+                }
+                break;
+            case OP_FORBIND:
+                index = (size_t)gml_number_value(gml, sp[-1]) + *pc++;
+                if (index < gml_vm_forlength(gml, sp[-3], sp[-2])) {
+                    value = gml_vm_forelement(gml, sp[-3], sp[-2], index);
+                    *sp++ = value;
+                } else {
+                    pc = code + CODE_ARG(word);
+                }
+                break;
+            case OP_FORSTEP:
+                sp[-5] = sp[-1];
+                sp--;
+                sp[-1] = gml_number_create(gml, gml_number_value(gml, sp[-1]) + CODE_ARG(word));
+                break;
+
+            case OP_RETURN:
+                value = sp[-1];
+                gml_vm_close(gml, slots);
+                frame = &gml->frames[--gml->nframes];
+                if (gml->nframes == base) {
+                    gml->top = slots;
+                    gml->nesting--;
+                    return value;
+                }
+                sp        = frame->result;
+                *sp++     = value;
+                frame     = &gml->frames[gml->nframes - 1];
+                chunk     = frame->chunk;
+                fun       = frame->fun;
+                slots     = frame->slots;
+                code      = chunk->code;
+                pc        = frame->pc;
+                constants = chunk->constants;
+                break;
+
+            default:
+                gml_throw(true, "invalid instruction `%s'", compile_opname(CODE_OP(word)));
+                gml_abort(gml);
+                break;
+        }
+    }
+}
+
+#undef GML_VM_COMPARE
+#undef GML_VM_ARITH
+
+/*
+ * The garbage collector is generational. A minor collection evacuates the
+ * young objects still reachable out of the nursery to the old heap and
+ * then resets the nursery. Its roots are those of a full collection plus
+ * the old objects and closed upvalues the write barrier remembered.
+ *
+ * A major collection marks everything reachable from the roots and sweeps
+ * the old heap of everything else. The roots are the globals, the operand
+ * stack up to its top, the handles pushed by natives and the literals of
+ * compiled code. Atoms are interned and live as long as the state.
+ *
+ * Collections only happen at the safepoints of the virtual machine, calls
+ * and backward jumps, where every value in use is on the operand stack.
+ */
+static void gml_gc_gray(gml_state_t *gml, gml_header_t *head) {
+    if (!gml_vector_push(&gml->gray, head)) {
+        gml_throw(true, "out of memory collecting garbage");
+        gml_abort(gml);
+    }
+}
+
+/* The bytes of a young object, inline elements or buckets included */
+static size_t gml_gc_footprint(gml_header_t *head) {
+    switch (head->type) {
+        case GML_TYPE_ARRAY:
+            if (gml_array_isinline((gml_array_t*)head))
+                return sizeof(gml_array_t) + sizeof(gml_value_t) * ((gml_array_t*)head)->capacity;
+            return sizeof(gml_array_t);
+        case GML_TYPE_TABLE:
+            if (gml_table_isinline((gml_table_t*)head))
+                return sizeof(gml_table_t) + GML_TABLE_INLINE;
+            return sizeof(gml_table_t);
+        case GML_TYPE_STRING:
+            return sizeof(gml_string_t);
+        case GML_TYPE_BUFFER:
+            return sizeof(gml_buffer_t);
         default:
             break;
     }
-    return gml_nil_create(gml);
+    return 0;
 }
 
-static gml_value_t gml_eval_statement(gml_state_t *gml, ast_t *expr, gml_env_t *env) {
-    switch (expr->class) {
-        case AST_DECLFUN: return gml_eval_declfun(gml, expr, env);
-        case AST_DECLVAR: return gml_eval_declvar(gml, expr, env);
-        case AST_IF:      return gml_eval_if(gml, expr, env);
-        case AST_WHILE:   return gml_eval_while(gml, expr, env);
-        case AST_FOR:     return gml_eval_for(gml, expr, env);
+/* Move a young object to the old heap, yielding where it went */
+static gml_value_t gml_gc_evacuate(gml_state_t *gml, gml_value_t value) {
+    if (!gml_gc_isyoungvalue(gml, value))
+        return value;
+    gml_header_t *head = gml_value_unbox(gml, value);
+    if (head->flags & GML_GC_FORWARDED)
+        return gml_value_box(gml, head->next);
+
+    size_t        size = gml_gc_footprint(head);
+    gml_header_t *copy = malloc(size);
+    if (!copy) {
+        gml_throw(true, "out of memory collecting garbage");
+        gml_abort(gml);
+    }
+    memcpy(copy, head, size);
+    if (head->type == GML_TYPE_ARRAY && gml_array_isinline((gml_array_t*)head))
+        ((gml_array_t*)copy)->elements = (gml_value_t*)((gml_array_t*)copy + 1);
+    else if (head->type == GML_TYPE_TABLE && gml_table_isinline((gml_table_t*)head))
+        gml_table_relocate((gml_table_t*)copy);
+
+    gml_gc_track(gml, copy, size);
+    head->flags |= GML_GC_FORWARDED;
+    head->next   = copy;
+    gml_gc_gray(gml, copy);
+    return gml_value_box(gml, copy);
+}
+
+/* Evacuate everything an object references */
+static void gml_gc_scavenge(gml_state_t *gml, gml_header_t *head) {
+    gml_array_t    *array;
+    gml_table_t    *table;
+    gml_function_t *fun;
+    gml_string_t   *string;
+
+    switch (head->type) {
+        case GML_TYPE_ARRAY:
+            array = (gml_array_t*)head;
+            for (size_t i = 0; i < array->length; i++)
+                array->elements[i] = gml_gc_evacuate(gml, array->elements[i]);
+            break;
+        case GML_TYPE_TABLE:
+            table = (gml_table_t*)head;
+            if (table->shape) {
+                for (size_t i = 0; i < table->count; i++)
+                    table->slots[i] = gml_gc_evacuate(gml, table->slots[i]);
+                break;
+            }
+            for (size_t i = 0; i < table->capacity; i++) {
+                if (!GML_TABLE_ISFULL(table->control[i]))
+                    continue;
+                table->buckets[i].key   = gml_gc_evacuate(gml, table->buckets[i].key);
+                table->buckets[i].value = gml_gc_evacuate(gml, table->buckets[i].value);
+            }
+            break;
+        case GML_TYPE_FUNCTION:
+            fun = (gml_function_t*)head;
+            if (fun->self)
+                fun->self = gml_value_unbox(gml, gml_gc_evacuate(gml, gml_value_box(gml, fun->self)));
+            for (size_t i = 0; i < fun->chunk->nupvalues; i++)
+                *fun->upvalues[i]->location = gml_gc_evacuate(gml, *fun->upvalues[i]->location);
+            break;
+        case GML_TYPE_STRING:
+            string = (gml_string_t*)head;
+            if (gml_string_isrope(string)) {
+                string->left  = gml_gc_evacuate(gml, string->left);
+                string->right = gml_gc_evacuate(gml, string->right);
+            }
+            if (string->base)
+                string->base = gml_value_unbox(gml, gml_gc_evacuate(gml, gml_value_box(gml, string->base)));
+            break;
         default:
-            return gml_nil_create(gml);
+            break;
+    }
+}
+
+static void gml_gc_minor(gml_state_t *gml) {
+    for (gml_value_t *value = gml->stack; value < gml->top; value++)
+        *value = gml_gc_evacuate(gml, *value);
+    for (size_t i = 0; i < gml->nhandles; i++)
+        gml->handles[i] = gml_gc_evacuate(gml, gml->handles[i]);
+    for (gml_callable_t *callable = gml->callables; callable; callable = callable->next) {
+        callable->function = gml_gc_evacuate(gml, callable->function);
+        for (size_t i = 0; i < callable->nargs; i++)
+            callable->args[i] = gml_gc_evacuate(gml, callable->args[i]);
+    }
+    for (size_t i = 0; i < ENV_BUCKETS; i++)
+        for (gml_env_binding_t *bind = gml->global->buckets[i]; bind; bind = bind->next)
+            bind->value = gml_gc_evacuate(gml, bind->value);
+    for (size_t i = 0; i < gml->remembered.length; i++) {
+        gml_header_t *head = gml->remembered.items[i];
+        head->flags &= ~GML_GC_REMEMBERED;
+        gml_gc_scavenge(gml, head);
+    }
+    for (size_t i = 0; i < gml->boxes.length; i++) {
+        gml_upvalue_t *upvalue = gml->boxes.items[i];
+        upvalue->remembered = 0;
+        upvalue->value      = gml_gc_evacuate(gml, upvalue->value);
     }
+    while (gml->gray.length)
+        gml_gc_scavenge(gml, gml->gray.items[--gml->gray.length]);
+
+    /* Whatever wasn't evacuated is garbage, free what it owns */
+    for (size_t i = 0; i < gml->young.length; i++) {
+        gml_header_t *head = gml->young.items[i];
+        if (!(head->flags & GML_GC_FORWARDED))
+            head->destroy(gml, gml_value_box(gml, head));
+    }
+
+    gml->young.length      = 0;
+    gml->remembered.length = 0;
+    gml->boxes.length      = 0;
+    gml->nurserytop        = gml->nursery;
 }
 
-static gml_value_t gml_eval(gml_state_t *gml, ast_t *expr, gml_env_t *env) {
-    switch (expr->class) {
-        case AST_TOPLEVEL:  return gml_eval_block(gml, expr->toplevel, env);
-        case AST_IDENT:     return gml_eval_ident(gml, expr, env);
-        case AST_CALL:      return gml_eval_call(gml, expr, env);
-        case AST_ATOM:      return gml_atom_create(gml, expr->atom);
-        case AST_NUMBER:    return gml_number_create(gml, expr->number);
-        case AST_STRING:    return gml_string_create(gml, expr->string);
-        case AST_ARRAY:     return gml_eval_array(gml, expr, env);
-        case AST_TABLE:     return gml_eval_table(gml, expr, env);
-        case AST_BINARY:    return gml_eval_binary(gml, expr, env);
-        case AST_UNARY:     return gml_eval_unary(gml, expr, env);
-        case AST_SUBSCRIPT: return gml_eval_subscript(gml, expr, env);
-        case AST_LAMBDA:    return gml_eval_lambda(gml, expr, env);
-        case AST_DECLFUN:   return gml_eval_statement(gml, expr, env);
-        case AST_DECLVAR:   return gml_eval_statement(gml, expr, env);
-        case AST_IF:        return gml_eval_statement(gml, expr, env);
-        case AST_WHILE:     return gml_eval_statement(gml, expr, env);
-        case AST_FOR:       return gml_eval_statement(gml, expr, env);
+static void gml_gc_unmark(gml_state_t *gml) {
+    for (gml_header_t *head = gml->objects; head; head = head->next)
+        head->flags &= ~GML_GC_MARKED;
+}
+
+static void gml_gc_mark(gml_state_t *gml, gml_value_t value) {
+    if (gml_value_isnumber(value) || gml_vm_isunbound(value))
+        return;
+    gml_header_t *head = gml_value_unbox(gml, value);
+    if (head->flags & GML_GC_MARKED)
+        return;
+    head->flags |= GML_GC_MARKED;
+
+    if (!gml_vector_push(&gml->gray, head)) {
+        gml->gray.length = 0;
+        gml_gc_unmark(gml);
+        gml_throw(true, "out of memory collecting garbage");
+        gml_abort(gml);
+    }
+}
+
+/* Mark everything an object references, yielding the bytes it holds */
+static size_t gml_gc_traverse(gml_state_t *gml, gml_header_t *head) {
+    gml_array_t    *array;
+    gml_table_t    *table;
+    gml_function_t *fun;
+    gml_string_t   *string;
+
+    switch (head->type) {
+        case GML_TYPE_ARRAY:
+            array = (gml_array_t*)head;
+            for (size_t i = 0; i < array->length; i++)
+                gml_gc_mark(gml, array->elements[i]);
+            return sizeof(*array) + sizeof(gml_value_t) * array->capacity;
+        case GML_TYPE_TABLE:
+            table = (gml_table_t*)head;
+            if (table->shape) {
+                for (size_t i = 0; i < table->count; i++)
+                    gml_gc_mark(gml, table->slots[i]);
+                if (gml_table_isinline(table))
+                    return sizeof(*table) + GML_TABLE_INLINE;
+                return sizeof(*table) + sizeof(gml_value_t) * table->nslots;
+            }
+            for (size_t i = 0; i < table->capacity; i++) {
+                if (!GML_TABLE_ISFULL(table->control[i]))
+                    continue;
+                gml_gc_mark(gml, table->buckets[i].key);
+                gml_gc_mark(gml, table->buckets[i].value);
+            }
+            return sizeof(*table) + gml_table_footprint(table->capacity);
+        case GML_TYPE_FUNCTION:
+            fun = (gml_function_t*)head;
+            if (fun->self)
+                gml_gc_mark(gml, gml_value_box(gml, fun->self));
+            for (size_t i = 0; i < fun->chunk->nupvalues; i++)
+                gml_gc_mark(gml, *fun->upvalues[i]->location);
+            return sizeof(*fun) + sizeof(gml_upvalue_t*) * fun->chunk->nupvalues;
+        case GML_TYPE_STRING:
+            string = (gml_string_t*)head;
+            if (gml_string_isrope(string)) {
+                gml_gc_mark(gml, string->left);
+                gml_gc_mark(gml, string->right);
+                return sizeof(*string);
+            }
+            /* A slice's data is its base's */
+            if (string->base)
+                gml_gc_mark(gml, gml_value_box(gml, string->base));
+            return sizeof(*string) + (string->base ? 0 : string->size + 1)
+                 + (string->index ? sizeof(size_t) * ((string->length - 1) / GML_STRING_STRIDE + 1) : 0);
+        case GML_TYPE_NATIVE:
+            return sizeof(gml_native_t);
+        case GML_TYPE_BUFFER:
+            return sizeof(gml_buffer_t) + gml_buffer_width(((gml_buffer_t*)head)->kind) * ((gml_buffer_t*)head)->length;
         default:
-            return gml_nil_create(gml);
+            break;
+    }
+    return 0;
+}
+
+static void gml_gc_sweep(gml_state_t *gml) {
+    gml_header_t **link = &gml->objects;
+    while (*link) {
+        gml_header_t *head = *link;
+        if ((head->flags & GML_GC_MARKED) || head->type == GML_TYPE_ATOM) {
+            head->flags &= ~GML_GC_MARKED;
+            link = &head->next;
+            continue;
+        }
+        *link = head->next;
+        head->destroy(gml, gml_value_box(gml, head));
+    }
+}
+
+/* Mark the literals made for a chunk and for the chunks inside of it */
+static void gml_gc_mark_literals(gml_state_t *gml, chunk_t *chunk) {
+    for (size_t i = 0; i < chunk->nconstants; i++) {
+        if (chunk->constants[i].class == CONSTANT_CHUNK)
+            gml_gc_mark_literals(gml, chunk->constants[i].chunk);
+        else if (chunk->constants[i].value)
+            gml_gc_mark(gml, gml_value_box(gml, chunk->constants[i].value));
+    }
+}
+
+static void gml_gc_major(gml_state_t *gml) {
+    size_t           live = 0;
+    list_iterator_t *it;
+
+    for (gml_value_t *value = gml->stack; value < gml->top; value++)
+        gml_gc_mark(gml, *value);
+    for (size_t i = 0; i < gml->nhandles; i++)
+        gml_gc_mark(gml, gml->handles[i]);
+    /* The function a frame runs may be unreachable otherwise after a tail call */
+    for (size_t i = 0; i < gml->nframes; i++)
+        if (gml->frames[i].fun)
+            gml_gc_mark(gml, gml_value_box(gml, &gml->frames[i].fun->header));
+    for (gml_callable_t *callable = gml->callables; callable; callable = callable->next) {
+        gml_gc_mark(gml, callable->function);
+        for (size_t i = 0; i < callable->nargs; i++)
+            gml_gc_mark(gml, callable->args[i]);
     }
+    for (size_t i = 0; i < ENV_BUCKETS; i++)
+        for (gml_env_binding_t *bind = gml->global->buckets[i]; bind; bind = bind->next)
+            gml_gc_mark(gml, bind->value);
+    for (size_t i = 0; i < sizeof(gml->chars) / sizeof(*gml->chars); i++)
+        if (gml->chars[i])
+            gml_gc_mark(gml, gml_value_box(gml, gml->chars[i]));
+    it = list_iterator_create(gml->chunks);
+    while (!list_iterator_end(it))
+        gml_gc_mark_literals(gml, list_iterator_next(it));
+    list_iterator_destroy(it);
+
+    while (gml->gray.length)
+        live += gml_gc_traverse(gml, gml->gray.items[--gml->gray.length]);
+    gml_string_prune(gml);
+    gml_gc_sweep(gml);
+
+    /* Let the heap grow to twice what survived before collecting again */
+    gml->allocated = 0;
+    gml->threshold = live > GML_GC_MINIMUM / 2 ? live * 2 : GML_GC_MINIMUM;
+}
+
+/*
+ * The major collection always follows a minor one so that nothing old is
+ * referenced only from the nursery and the remembered sets are empty.
+ */
+static void gml_gc_collect(gml_state_t *gml) {
+    gml_gc_minor(gml);
+    if (gml->allocated >= gml->threshold)
+        gml_gc_major(gml);
 }
 
 size_t gml_dump(gml_state_t *gml, gml_value_t value, char *buffer, size_t length) {
@@ -1535,7 +3511,7 @@ size_t gml_dump(gml_state_t *gml, gml_value_t value, char *buffer, size_t length
         case GML_TYPE_NUMBER:
             return snprintf(buffer, length, "%g", gml_number_value(gml, value));
         case GML_TYPE_STRING:
-            return snprintf(buffer, length, "\"%s\"", gml_string_utf8data(gml, value));
+            return snprintf(buffer, length, "\"%s\"", gml_string_utf8(gml, value));
         case GML_TYPE_ATOM:
             /* The none atom is nothingness. It's used to specify nothingness. */
             atom = gml_atom_key(gml, value);
@@ -1554,6 +3530,16 @@ size_t gml_dump(gml_state_t *gml, gml_value_t value, char *buffer, size_t length
             }
             append("]");
             return offset;
+        case GML_TYPE_BUFFER:
+            nelems = gml_buffer_length(gml, value);
+            append(gml_buffer_kind(gml, value) == GML_BUFFER_F32 ? "f32[" : "f64[");
+            for (size_t i = 0; i < nelems; i++) {
+                offset += snprintf(buffer + offset, space, "%g", gml_buffer_get(gml, value, i));
+                if (i < nelems - 1)
+                    append(", ");
+            }
+            append("]");
+            return offset;
         case GML_TYPE_TABLE:
             keys  = gml_table_keys(gml, value);
             nkeys = list_length(keys);
@@ -1578,20 +3564,39 @@ size_t gml_dump(gml_state_t *gml, gml_value_t value, char *buffer, size_t length
     return offset;
 }
 
+static int gml_runbuffer_isglobal(void *data, const char *name) {
+    gml_value_t *lookup;
+    return gml_env_lookup(((gml_state_t*)data)->global, name, &lookup);
+}
+
 static gml_value_t gml_runbuffer(gml_state_t *gml, const char *filename, const char *source) {
     if (gml->parse)
         parse_destroy(gml->parse);
 
-    ast_t *ast;
+    ast_t       *ast;
+    chunk_t     *chunk;
+    gml_value_t *top     = gml->top;
+    size_t       handles = gml->nhandles;
+    size_t       frames  = gml->nframes;
+    size_t       nesting = gml->nesting;
     gml->parse = parse_create(filename, source);
     if (setjmp(gml->escape) == 0) {
         ast = parse_run(gml->parse);
         if (ast) {
             list_push(gml->asts, ast);
-            return gml_eval(gml, ast, gml->global);
+            if ((chunk = compile_run(ast, &gml_runbuffer_isglobal, gml))) {
+                list_push(gml->chunks, chunk);
+                gml_vm_reserve(gml, chunk, top);
+                return gml_vm_execute(gml, chunk, NULL, top);
+            }
         }
     }
 
+    gml_vm_close(gml, top);
+    gml->top      = top;
+    gml->nhandles = handles;
+    gml->nframes  = frames;
+    gml->nesting  = nesting;
     return gml_nil_create(gml);
 }
 
@@ -1624,8 +3629,124 @@ gml_value_t gml_run_file(gml_state_t *gml, const char *filename) {
 }
 
 gml_value_t gml_function_run(gml_state_t *gml, gml_value_t function, gml_value_t *args, size_t nargs) {
-    gml_env_t *callenv = gml_env_push((gml_env_t*)gml_function_env(gml, function));
+    if (gml_value_typeof(gml, function) == GML_TYPE_NATIVE) {
+        gml_native_t *native = (gml_native_t*)gml_value_unbox(gml, function);
+        char          message[256];
+        if (!gml_native_accepts(gml, native, args, nargs)) {
+            gml_native_reject(gml, native, args, nargs, message, sizeof(message));
+            gml_throw(false, "%s", message);
+            gml_abort(gml);
+        }
+        return native->func(gml, args, nargs);
+    }
+
+    gml_function_t *fun   = (gml_function_t*)gml_value_unbox(gml, function);
+    gml_value_t    *slots = gml->top;
+    if (nargs > fun->chunk->nformals)
+        nargs = fun->chunk->nformals;
+    gml_vm_reserve(gml, fun->chunk, slots);
+    memcpy(slots, args, sizeof(gml_value_t) * nargs);
+    return gml_vm_invoke(gml, fun, fun->self, slots, nargs);
+}
+
+/* Null for anything but functions and natives taking nargs arguments */
+gml_callable_t *gml_callable_create(gml_state_t *gml, gml_value_t function, size_t nargs) {
+    gml_callable_t *callable;
+    gml_native_t   *native;
+    switch (gml_value_typeof(gml, function)) {
+        case GML_TYPE_NATIVE:
+            native = (gml_native_t*)gml_value_unbox(gml, function);
+            if (nargs < (size_t)native->min || (native->max >= 0 && nargs > (size_t)native->max))
+                return NULL;
+            break;
+        case GML_TYPE_FUNCTION:
+            break;
+        default:
+            return NULL;
+    }
+    if (!(callable = malloc(sizeof(*callable) + sizeof(gml_value_t) * nargs)))
+        return NULL;
+    callable->function = function;
+    callable->nargs    = nargs;
     for (size_t i = 0; i < nargs; i++)
-        gml_env_bind(callenv, list_at(gml_function_formals(gml, function), i), args[i]);
-    return gml_eval_block(gml, gml_function_body(gml, function), callenv);
+        callable->args[i] = gml->atomnil;
+    callable->prev = NULL;
+    callable->next = gml->callables;
+    if (gml->callables)
+        gml->callables->prev = callable;
+    gml->callables = callable;
+    return callable;
+}
+
+void gml_callable_destroy(gml_state_t *gml, gml_callable_t *callable) {
+    if (callable->prev)
+        callable->prev->next = callable->next;
+    else
+        gml->callables = callable->next;
+    if (callable->next)
+        callable->next->prev = callable->prev;
+    free(callable);
+}
+
+gml_value_t *gml_callable_args(gml_callable_t *callable) {
+    return callable->args;
+}
+
+/*
+ * Callables may be invoked from outside of running any source, where
+ * there's nowhere for an error to escape to, so they catch errors of
+ * their own and unwind whatever the call left behind.
+ */
+gml_value_t gml_callable_invoke(gml_state_t *gml, gml_callable_t *callable) {
+    jmp_buf      escape;
+    gml_value_t *top     = gml->top;
+    size_t       handles = gml->nhandles;
+    size_t       frames  = gml->nframes;
+    size_t       nesting = gml->nesting;
+    gml_value_t  value   = gml_nil_create(gml);
+
+    memcpy(escape, gml->escape, sizeof(jmp_buf));
+    if (setjmp(gml->escape) == 0) {
+        value = gml_function_run(gml, callable->function, callable->args, callable->nargs);
+    } else {
+        gml_vm_close(gml, top);
+        gml->top      = top;
+        gml->nhandles = handles;
+        gml->nframes  = frames;
+        gml->nesting  = nesting;
+    }
+    memcpy(gml->escape, escape, sizeof(jmp_buf));
+    return value;
+}
+
+size_t gml_callable_batch(gml_state_t *gml, gml_callable_t *callable, const gml_value_t *tuples, size_t ntuples, gml_value_t *results) {
+    jmp_buf          escape;
+    gml_value_t     *top     = gml->top;
+    size_t           handles = gml->nhandles;
+    size_t           frames  = gml->nframes;
+    size_t           nesting = gml->nesting;
+    size_t           nargs   = callable->nargs;
+    volatile size_t  done    = 0;
+
+    memcpy(escape, gml->escape, sizeof(jmp_buf));
+    if (setjmp(gml->escape) == 0) {
+        /* The tuples and results live in C so they're kept as handles meanwhile */
+        for (size_t i = 0; i < ntuples * nargs; i++)
+            gml_handle_push(gml, tuples[i]);
+        for (; done < ntuples; done++) {
+            for (size_t i = 0; i < nargs; i++)
+                callable->args[i] = gml->handles[handles + done * nargs + i];
+            gml_handle_push(gml, gml_function_run(gml, callable->function, callable->args, nargs));
+        }
+    } else {
+        gml_vm_close(gml, top);
+        gml->top     = top;
+        gml->nframes = frames;
+        gml->nesting = nesting;
+    }
+    for (size_t i = 0; i < done; i++)
+        results[i] = gml->handles[handles + ntuples * nargs + i];
+    gml->nhandles = handles;
+    memcpy(gml->escape, escape, sizeof(jmp_buf));
+    return done;
 }